@@ -0,0 +1,410 @@
+// tac08-batch: runs every cart in a directory headless for a fixed number of frames, spread over
+// all cores, and writes a json report of frame times, final framebuffer hashes and lua errors.
+//
+//   tac08-batch [-frames n] [-threads n] [-o report.json] [-golden dir [-update]] cartdir
+//
+// with -golden the final frame of each cart is checked against the hash stored in
+// dir/<cart>.hash. on a mismatch the frame is written to dir/<cart>.actual.png along with
+// dir/<cart>.diff.png, which marks the changed pixels in red over the golden image. carts
+// without a golden are listed as missing but do not fail the run. -update writes the current
+// results as the new goldens.
+//
+// a cart can have an input script next to it with the same name and an .input extension
+// (game.p8 -> game.input). each line holds a frame number and the buttons held from that frame
+// on, as letters from "lrudox" or "-" for none. lines starting with # are comments:
+//
+//   # hold right, jump at frame 60
+//   0 r
+//   60 rx
+//   61 r
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "hal_core.h"
+#include "log.h"
+#include "pico_cart.h"
+#include "pico_core.h"
+#include "pico_loop.h"
+#include "pico_machine.h"
+#include "pico_script.h"
+#include "png.h"
+#include "utils.h"
+
+struct InputScript {
+	typedef std::pair<int, uint8_t> Change;
+	std::vector<Change> changes;
+
+	static bool byFrame(const Change& a, const Change& b) {
+		return a.first < b.first;
+	}
+
+	bool load(const std::string& filename) {
+		FILE* f = fopen(filename.c_str(), "r");
+		if (!f) {
+			return false;
+		}
+		char line[256];
+		while (fgets(line, sizeof(line), f)) {
+			char buttons[64] = "";
+			int frame;
+			if (line[0] == '#' || sscanf(line, "%d %63s", &frame, buttons) < 1) {
+				continue;
+			}
+			uint8_t state = 0;
+			for (const char* c = buttons; *c; c++) {
+				const char* pos = strchr("lrudox", *c);
+				if (pos) {
+					state |= 1 << (pos - "lrudox");
+				}
+			}
+			changes.push_back(std::make_pair(frame, state));
+		}
+		fclose(f);
+		std::stable_sort(changes.begin(), changes.end(), byFrame);
+		return true;
+	}
+
+	uint8_t at(int frame) const {
+		uint8_t state = 0;
+		for (auto& c : changes) {
+			if (c.first > frame) {
+				break;
+			}
+			state = c.second;
+		}
+		return state;
+	}
+};
+
+// frame times are bucketed by the upper bound of each bucket in microseconds, the last bucket
+// holds everything slower.
+static const uint64_t histogramBounds[] = {250, 500, 1000, 2000, 4000, 8000, 16667, 33333};
+static const size_t histogramSize = sizeof(histogramBounds) / sizeof(histogramBounds[0]) + 1;
+
+struct CartResult {
+	std::string cart;
+	bool hasInput = false;
+	int frames = 0;
+	std::string error;
+	uint64_t hash = 0;
+	int width = 0;
+	int height = 0;
+	uint64_t totalTime = 0;
+	uint64_t maxTime = 0;
+	uint64_t histogram[histogramSize] = {0};
+	std::vector<uint8_t> rgba;  // final frame as displayed, kept for golden checks
+	std::string golden;
+
+	void addFrame(uint64_t us) {
+		size_t n = 0;
+		while (n < histogramSize - 1 && us > histogramBounds[n]) {
+			n++;
+		}
+		histogram[n]++;
+		totalTime += us;
+		maxTime = std::max(maxTime, us);
+		frames++;
+	}
+};
+
+// the hal palette is rgb565
+static void toRGBA(const uint8_t* buffer, int size, const PaletteState& pal, uint8_t* rgba) {
+	for (int n = 0; n < size; n++) {
+		pixel_t p = pal.mapped[buffer[n]];
+		uint8_t r = (p >> 11) & 0x1f;
+		uint8_t g = (p >> 5) & 0x3f;
+		uint8_t b = p & 0x1f;
+		rgba[n * 4 + 0] = (r << 3) | (r >> 2);
+		rgba[n * 4 + 1] = (g << 2) | (g >> 4);
+		rgba[n * 4 + 2] = (b << 3) | (b >> 2);
+		rgba[n * 4 + 3] = 0xff;
+	}
+}
+
+static bool isCart(const std::string& name) {
+	auto ends = [&](const char* ext) {
+		size_t len = strlen(ext);
+		return name.size() > len && name.compare(name.size() - len, len, ext) == 0;
+	};
+	return ends(".p8") || ends(".p8.png");
+}
+
+static std::vector<std::string> findCarts(const std::string& dir) {
+	std::vector<std::string> carts;
+	DIR* d = opendir(dir.c_str());
+	if (!d) {
+		return carts;
+	}
+	while (dirent* e = readdir(d)) {
+		if (isCart(e->d_name)) {
+			carts.push_back(dir + "/" + e->d_name);
+		}
+	}
+	closedir(d);
+	std::sort(carts.begin(), carts.end());
+	return carts;
+}
+
+// the cart path without the .p8 or .p8.png extension
+static std::string baseName(const std::string& cart) {
+	return cart.substr(0, cart.find(".p8", cart.find_last_of('/') + 1));
+}
+
+static std::string fileName(const std::string& path) {
+	return path.substr(path.find_last_of('/') + 1);
+}
+
+// runs on a pool thread with a machine of its own
+static void runCart(CartResult& result, int frames, bool keepFrame) {
+	InputScript input;
+	result.hasInput = input.load(baseName(result.cart) + ".input");
+
+	pico_machine::Machine* machine = pico_machine::create();
+	pico_machine::select(machine);
+	TIME_UseVirtualClock(true);
+	try {
+		pico_api::load(result.cart);
+
+		pico_control::GameLoop loop;
+		for (int f = 0; f < frames && !loop.scriptError(); f++) {
+			HAL_StartFrame();
+			pico_control::FrameTimes times = loop.step(input.at(f), MouseState{0, 0, 0, 0});
+			result.addFrame(times.update_us + times.draw_us);
+			HAL_EndFrame();
+			TIME_AdvanceVirtualClock(1000000 / loop.targetFps());
+		}
+		result.error = loop.errorMessage();
+
+		pico_api::colour_t* buffer = pico_control::get_buffer(result.width, result.height);
+		result.hash = utils::fnv1a(buffer, result.width * result.height);
+		if (keepFrame) {
+			result.rgba.resize(result.width * result.height * 4);
+			toRGBA(buffer, result.width * result.height, GFX_GetPaletteState(), &result.rgba[0]);
+		}
+	} catch (std::exception& e) {
+		result.error = e.what();
+	}
+	pico_machine::destroy(machine);
+}
+
+// goldens are plain files, so they are read directly rather than through FILE_LoadFile
+static std::string readFile(const std::string& name) {
+	std::string data;
+	FILE* f = fopen(name.c_str(), "rb");
+	if (f) {
+		char buf[4096];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+			data.append(buf, n);
+		}
+		fclose(f);
+	}
+	return data;
+}
+
+static std::string hashString(const CartResult& r) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%016llx %dx%d\n", (unsigned long long)r.hash, r.width, r.height);
+	return buf;
+}
+
+// golden image with the changed pixels in red, the rest dimmed
+static bool writeDiff(const std::string& name, const std::string& golden, const CartResult& r) {
+	std::vector<uint8_t> diff(r.rgba.size());
+	int rows = 0;
+	try {
+		png::decodeRGBA(golden, [&](int y, const uint8_t* row, int width) {
+			if (width != r.width || y >= r.height) {
+				throw png::error("size changed");
+			}
+			for (int x = 0; x < width * 4; x += 4) {
+				size_t n = y * width * 4 + x;
+				bool same = memcmp(row + x, &r.rgba[n], 4) == 0;
+				diff[n + 0] = same ? row[x + 0] / 4 : 0xff;
+				diff[n + 1] = same ? row[x + 1] / 4 : 0;
+				diff[n + 2] = same ? row[x + 2] / 4 : 0;
+				diff[n + 3] = 0xff;
+			}
+			rows++;
+		});
+	} catch (png::error&) {
+		return false;
+	}
+	return rows == r.height &&
+	       FILE_WriteFileAtomic(name, png::encodeRGBA(diff.data(), r.width, r.height));
+}
+
+static void checkGolden(CartResult& r, const std::string& dir, bool update) {
+	if (r.rgba.empty()) {
+		r.golden = "none";
+		return;
+	}
+	std::string base = dir + "/" + fileName(baseName(r.cart));
+	std::string image = png::encodeRGBA(r.rgba.data(), r.width, r.height);
+	if (update) {
+		bool ok = FILE_WriteFileAtomic(base + ".hash", hashString(r)) &&
+		          FILE_WriteFileAtomic(base + ".png", image);
+		r.golden = ok ? "updated" : "write failed";
+		return;
+	}
+
+	std::string expected = readFile(base + ".hash");
+	if (expected.empty()) {
+		r.golden = "missing";
+	} else if (expected == hashString(r)) {
+		r.golden = "match";
+		return;
+	} else {
+		r.golden = "mismatch";
+		writeDiff(base + ".diff.png", readFile(base + ".png"), r);
+	}
+	FILE_WriteFileAtomic(base + ".actual.png", image);
+}
+
+static std::string jsonString(const std::string& s) {
+	std::string res = "\"";
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\') {
+			res += '\\';
+			res += c;
+		} else if (c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			res += buf;
+		} else {
+			res += c;
+		}
+	}
+	return res + "\"";
+}
+
+static std::string toJson(const std::vector<CartResult>& results) {
+	std::ostringstream out;
+	out << "{\n  \"histogram_bounds_us\": [";
+	for (size_t n = 0; n < histogramSize - 1; n++) {
+		out << (n ? ", " : "") << histogramBounds[n];
+	}
+	out << "],\n  \"carts\": [";
+	for (size_t i = 0; i < results.size(); i++) {
+		const CartResult& r = results[i];
+		char hash[17];
+		snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)r.hash);
+
+		out << (i ? ",\n" : "\n") << "    {\"cart\": " << jsonString(r.cart)
+		    << ", \"input\": " << (r.hasInput ? "true" : "false") << ", \"frames\": " << r.frames
+		    << ", \"error\": " << (r.error.empty() ? "null" : jsonString(r.error))
+		    << ", \"width\": " << r.width << ", \"height\": " << r.height << ", \"hash\": \""
+		    << hash << "\", \"mean_us\": " << (r.frames ? r.totalTime / r.frames : 0)
+		    << ", \"max_us\": " << r.maxTime;
+		if (!r.golden.empty()) {
+			out << ", \"golden\": " << jsonString(r.golden);
+		}
+		out << ", \"histogram\": [";
+		for (size_t n = 0; n < histogramSize; n++) {
+			out << (n ? ", " : "") << r.histogram[n];
+		}
+		out << "]}";
+	}
+	out << "\n  ]\n}\n";
+	return out.str();
+}
+
+static int usage() {
+	fprintf(stderr,
+	        "usage: tac08-batch [-frames n] [-threads n] [-o report.json] "
+	        "[-golden dir [-update]] cartdir\n");
+	return 1;
+}
+
+int main(int argc, char** argv) {
+	logr.enable(true);
+	logr.setOutputFunction(SYSLOG_LogMessage);
+	logr.setOutputFilter(LogLevel::perf, false);
+	logr.setOutputFilter(LogLevel::info, false);
+	logr.setOutputFilter(LogLevel::trace, false);
+	logr.setOutputFilter(LogLevel::apitrace, false);
+
+	int frames = 300;
+	int threads = 0;
+	std::string outName;
+	std::string goldenDir;
+	bool update = false;
+	std::string dir;
+	for (int n = 1; n < argc; n++) {
+		std::string arg = argv[n];
+		if (arg == "-frames" && n + 1 < argc) {
+			frames = atoi(argv[++n]);
+		} else if (arg == "-threads" && n + 1 < argc) {
+			threads = atoi(argv[++n]);
+		} else if (arg == "-o" && n + 1 < argc) {
+			outName = argv[++n];
+		} else if (arg == "-golden" && n + 1 < argc) {
+			goldenDir = argv[++n];
+		} else if (arg == "-update") {
+			update = true;
+		} else if (dir.empty() && arg[0] != '-') {
+			dir = arg;
+		} else {
+			return usage();
+		}
+	}
+	if (dir.empty()) {
+		return usage();
+	}
+
+	std::vector<std::string> carts = findCarts(dir);
+	if (carts.empty()) {
+		fprintf(stderr, "no carts found in %s\n", dir.c_str());
+		return 1;
+	}
+
+	std::vector<CartResult> results(carts.size());
+	for (size_t n = 0; n < carts.size(); n++) {
+		results[n].cart = carts[n];
+	}
+
+	uint64_t start = TIME_GetProfileTime();
+	bool golden = !goldenDir.empty();
+	auto run = [&](size_t n) { runCart(results[n], frames, golden); };
+	pico_machine::parallel_for(results.size(), run, threads);
+	fprintf(stderr, "ran %d carts in %dms\n", (int)carts.size(),
+	        (int)TIME_GetElapsedProfileTime_ms(start));
+
+	if (golden) {
+		for (auto& r : results) {
+			checkGolden(r, goldenDir, update);
+		}
+	}
+
+	std::string json = toJson(results);
+	if (outName.empty()) {
+		fputs(json.c_str(), stdout);
+	} else if (!FILE_WriteFileAtomic(outName, json)) {
+		fprintf(stderr, "failed to write %s\n", outName.c_str());
+		return 1;
+	}
+
+	// a cart without a golden has nothing to be checked against yet, so it is reported
+	// rather than failed
+	int failed = 0;
+	int missing = 0;
+	for (auto& r : results) {
+		bool goldenOk = r.golden.empty() || r.golden == "match" || r.golden == "updated" ||
+		                r.golden == "missing";
+		failed += r.error.empty() && goldenOk ? 0 : 1;
+		missing += r.golden == "missing" ? 1 : 0;
+	}
+	if (missing) {
+		fprintf(stderr, "%d carts have no golden in %s, -update records them\n", missing,
+		        goldenDir.c_str());
+	}
+	return failed ? 2 : 0;
+}
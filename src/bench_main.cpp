@@ -0,0 +1,270 @@
+// tac08-bench: times the graphics primitives and memory functions headless at a range of screen
+// sizes. each benchmark runs in a loop calibrated to take roughly -ms milliseconds and the best
+// of three runs is reported.
+//
+//   tac08-bench [-ms n] [-size n] [name...]
+//
+// names limit the run to the benchmarks whose name starts with one of them. the output is one
+// line per benchmark and screen size, whitespace separated, with a header naming the format
+// version and the architecture so results can be tracked across versions and machines:
+//
+//   # tac08-bench 1 x86_64
+//   # name size ns/op mpix/s
+//   spr 128 41.2 1553.40
+//
+// mpix/s counts the pixels an op writes, or for the memory functions two pixels per byte of
+// screen memory moved.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "hal_core.h"
+#include "log.h"
+#include "pico_core.h"
+#include "pico_machine.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BENCH_ARCH "x86_64"
+#elif defined(__i386__) || defined(_M_IX86)
+#define BENCH_ARCH "x86"
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define BENCH_ARCH "arm64"
+#elif defined(__arm__) || defined(_M_ARM)
+#define BENCH_ARCH "arm"
+#else
+#define BENCH_ARCH "unknown"
+#endif
+
+// bump when a benchmark changes so old results are not compared with new ones
+static const int BENCH_FORMAT_VERSION = 1;
+
+static const int screenSizes[] = {128, 256, 384, 512};
+
+struct Bench {
+	std::string name;
+	// pixels written by one op at the given screen size
+	std::function<uint64_t(int w, int h)> pixels;
+	std::function<void(uint64_t i, int w, int h)> op;
+};
+
+// keeps the results of peek from being optimised away
+static volatile uint32_t sink;
+
+// a position that moves around the screen from op to op while keeping a size x size area on it
+static int place(uint64_t i, int range, int size) {
+	return (int)((i * 13) % (uint64_t)std::max(1, range - size));
+}
+
+static std::vector<Bench> benchmarks() {
+	using namespace pico_api;
+	const std::string text = "the quick brown fox 0123456789";
+
+	std::vector<Bench> b;
+	b.push_back({"cls", [](int w, int h) { return (uint64_t)w * h; },
+	             [](uint64_t i, int w, int h) { cls(i & 15); }});
+	b.push_back({"spr", [](int w, int h) { return 8 * 8; },
+	             [](uint64_t i, int w, int h) { spr(1, place(i, w, 8), place(i * 7, h, 8)); }});
+	b.push_back({"spr_4x4", [](int w, int h) { return 32 * 32; },
+	             [](uint64_t i, int w, int h) {
+		             spr(1, place(i, w, 32), place(i * 7, h, 32), 4, 4, i & 1, false);
+	             }});
+	b.push_back({"sspr", [](int w, int h) { return 32 * 32; },
+	             [](uint64_t i, int w, int h) {
+		             sspr(0, 0, 32, 32, place(i, w, 32), place(i * 7, h, 32));
+	             }});
+	b.push_back({"sspr_stretch", [](int w, int h) { return 80 * 80; },
+	             [](uint64_t i, int w, int h) {
+		             sspr(0, 0, 32, 32, place(i, w, 80), place(i * 7, h, 80), 80, 80);
+	             }});
+	// a 32x32 sprite at twice the size, turning a little each op
+	b.push_back({"rspr", [](int w, int h) { return 64 * 64; },
+	             [](uint64_t i, int w, int h) {
+		             pico_apix::rspr(0, 0, 32, 32, 46 + place(i, w, 92), 46 + place(i * 7, h, 92),
+		                             (i & 63) / 64.0, 2, false);
+	             }});
+	b.push_back({"map", [](int w, int h) { return (uint64_t)w * h; },
+	             [](uint64_t i, int w, int h) { map(i & 15, 0, 0, 0, w / 8, h / 8); }});
+	// a mode 7 style floor, one textured span per screen row
+	b.push_back({"tline", [](int w, int h) { return (uint64_t)w * h; },
+	             [](uint64_t i, int w, int h) {
+		             for (int y = 0; y < h; y++) {
+			             int32_t step = 0x800 + y * 0x20;
+			             tline(0, y, w - 1, y, (int32_t)(i & 15) << 16, y << 12, step, 0);
+		             }
+	             }});
+	b.push_back({"rectfill", [](int w, int h) { return 64 * 64; },
+	             [](uint64_t i, int w, int h) {
+		             int x = place(i, w, 64);
+		             int y = place(i * 7, h, 64);
+		             rectfill(x, y, x + 63, y + 63, i & 15);
+	             }});
+	b.push_back({"rectfill_fillp", [](int w, int h) { return 64 * 64; },
+	             [](uint64_t i, int w, int h) {
+		             int x = place(i, w, 64);
+		             int y = place(i * 7, h, 64);
+		             fillp(0x5a5a, false);
+		             rectfill(x, y, x + 63, y + 63, i & 0xff);
+	             }});
+	b.push_back({"rectfill_screen", [](int w, int h) { return (uint64_t)w * h; },
+	             [](uint64_t i, int w, int h) { rectfill(0, 0, w - 1, h - 1, i & 15); }});
+	// the area of a filled circle of radius 32 is about 3217 pixels
+	b.push_back({"circfill", [](int w, int h) { return 3217; },
+	             [](uint64_t i, int w, int h) {
+		             circfill(32 + place(i, w, 64), 32 + place(i * 7, h, 64), 32, i & 15);
+	             }});
+	b.push_back({"line", [](int w, int h) { return std::max(w, h); },
+	             [](uint64_t i, int w, int h) {
+		             if (i & 1) {
+			             line(0, 0, w - 1, h - 1, i & 15);
+		             } else {
+			             line(w - 1, 0, 0, h - 1, i & 15);
+		             }
+	             }});
+	// each glyph sits in a 4x6 cell
+	b.push_back({"print", [text](int w, int h) { return (uint64_t)text.size() * 4 * 6; },
+	             [text](uint64_t i, int w, int h) {
+		             print(text, place(i, w, 4 * (int)text.size()), place(i * 7, h, 6), i & 15);
+	             }});
+	b.push_back({"peek", [](int w, int h) { return 0x200 * 2; },
+	             [](uint64_t i, int w, int h) {
+		             uint32_t sum = 0;
+		             for (uint16_t a = 0x6000; a < 0x6200; a++) {
+			             sum += peek(a);
+		             }
+		             sink = sum;
+	             }});
+	b.push_back({"poke", [](int w, int h) { return 0x200 * 2; },
+	             [](uint64_t i, int w, int h) {
+		             for (uint16_t a = 0x6000; a < 0x6200; a++) {
+			             poke(a, (uint8_t)(a + i));
+		             }
+	             }});
+	b.push_back({"memcpy", [](int w, int h) { return 0x1000 * 2; },
+	             [](uint64_t i, int w, int h) { memory_cpy(0x6000, 0x0000, 0x1000); }});
+	b.push_back({"copybackbuffer", [](int w, int h) { return (uint64_t)w * h; },
+	             [](uint64_t i, int w, int h) {
+		             int bw, bh;
+		             colour_t* buffer = pico_control::get_buffer(bw, bh);
+		             GFX_CopyBackBuffer(buffer, bw, bh, pico_control::get_screen_mode());
+	             }});
+	return b;
+}
+
+// sprites and map cells with a mix of colours and transparent pixels
+static void setupData() {
+	std::vector<uint8_t> sprites(pico_control::SPRITE_DATA_SIZE);
+	for (int y = 0; y < 128; y++) {
+		for (int x = 0; x < 128; x++) {
+			sprites[y * 128 + x] = (x ^ y) & 15;
+		}
+	}
+	pico_control::set_sprite_data_raw(sprites.data());
+	for (int y = 0; y < 32; y++) {
+		for (int x = 0; x < 128; x++) {
+			pico_api::mset(x, y, 1 + (x + y) % 255);
+		}
+	}
+}
+
+// runs op for a calibrated number of iterations and returns the best time per op in ns
+static double measure(const Bench& bench, int w, int h, uint64_t target_us) {
+	auto run = [&](uint64_t iterations) {
+		uint64_t start = TIME_GetProfileTime();
+		for (uint64_t i = 0; i < iterations; i++) {
+			bench.op(i, w, h);
+		}
+		return TIME_GetElapsedProfileTime_us(start);
+	};
+
+	uint64_t iterations = 1;
+	uint64_t elapsed = run(iterations);
+	while (elapsed < target_us / 10) {
+		iterations *= 2;
+		elapsed = run(iterations);
+	}
+	iterations = std::max<uint64_t>(1, iterations * target_us / std::max<uint64_t>(1, elapsed));
+
+	double best = 0;
+	for (int n = 0; n < 3; n++) {
+		double ns = run(iterations) * 1000.0 / iterations;
+		best = n == 0 ? ns : std::min(best, ns);
+	}
+	return best;
+}
+
+static bool selected(const std::string& name, const std::vector<std::string>& filters) {
+	if (filters.empty()) {
+		return true;
+	}
+	for (auto& f : filters) {
+		if (name.compare(0, f.size(), f) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int usage() {
+	fprintf(stderr, "usage: tac08-bench [-ms n] [-size n] [name...]\n");
+	return 1;
+}
+
+int main(int argc, char** argv) {
+	logr.enable(true);
+	logr.setOutputFunction(SYSLOG_LogMessage);
+	logr.setOutputFilter(LogLevel::perf, false);
+	logr.setOutputFilter(LogLevel::info, false);
+	logr.setOutputFilter(LogLevel::trace, false);
+	logr.setOutputFilter(LogLevel::apitrace, false);
+
+	int ms = 200;
+	int onlySize = 0;
+	std::vector<std::string> filters;
+	for (int n = 1; n < argc; n++) {
+		std::string arg = argv[n];
+		if (arg == "-ms" && n + 1 < argc) {
+			ms = std::max(1, atoi(argv[++n]));
+		} else if (arg == "-size" && n + 1 < argc) {
+			onlySize = atoi(argv[++n]);
+		} else if (arg[0] != '-') {
+			filters.push_back(arg);
+		} else {
+			return usage();
+		}
+	}
+
+	pico_machine::Machine* machine = pico_machine::create();
+	pico_machine::select(machine);
+	setupData();
+
+	printf("# tac08-bench %d %s\n", BENCH_FORMAT_VERSION, BENCH_ARCH);
+	printf("# name size ns/op mpix/s\n");
+	std::vector<Bench> all = benchmarks();
+	for (int size : screenSizes) {
+		if (onlySize && size != onlySize) {
+			continue;
+		}
+		pico_apix::screen(size, size);
+		GFX_SetBackBufferSize(size, size);
+		for (auto& bench : all) {
+			if (!selected(bench.name, filters)) {
+				continue;
+			}
+			pico_api::cls();
+			pico_api::fillp();
+			double ns = measure(bench, size, size, (uint64_t)ms * 1000);
+			double mpix = bench.pixels(size, size) * 1000.0 / ns;
+			printf("%s %d %.1f %.2f\n", bench.name.c_str(), size, ns, mpix);
+			fflush(stdout);
+		}
+	}
+
+	pico_machine::select(nullptr);
+	pico_machine::destroy(machine);
+	return 0;
+}
@@ -11,7 +11,20 @@ namespace config {
 	const int AUDIO_FREQ = 22050;
 	const int AUDIO_BUFFER_SIZE = 2048;
 	const int AUDIO_CHANNELS = 4;
+	const int AUDIO_CACHE_SIZE = 16 * 1024 * 1024;  // bytes of decoded wav data kept resident
+	const int AUDIO_STREAM_CHUNK_SAMPLES = 4096;
+	const int AUDIO_ADPCM_BLOCK_SIZE = 1024;
 	const int PALETTE_SIZE = 16;
+	const int CARTDATA_SAVE_DELAY_MS = 1000;  // max time cartdata changes wait before being saved
+	// bytes of rewind history, 0 turns rewinding off. 16MB holds over a minute of most carts.
+	const int REWIND_BUFFER_SIZE = 16 * 1024 * 1024;
+	// rewind states are saved as often as keeps their average cost per frame under this
+	const int REWIND_FRAME_BUDGET_US = 250;
+	const int REWIND_MAX_INTERVAL = 30;  // most frames between rewind states
+	const int GIF_SECONDS = 8;  // seconds of play kept for the gif recording
+	const int GIF_BUFFER_SIZE = 16 * 1024 * 1024;  // bytes of frames kept for the gif recording
+	const int SCREENSHOT_SCALE = 4;  // size of each screen pixel in screenshots
+	const int FRAME_MAX_CATCHUP = 4;  // game frames run back to back before lost time is dropped
 }  // namespace config
 
 #endif /* CONFIG_H */
@@ -0,0 +1,177 @@
+#include "gif.h"
+
+#include <string.h>
+
+#include <vector>
+
+namespace gif {
+
+	static const int MIN_CODE_SIZE = 8;
+	static const int MAX_CODES = 4096;
+	static const int HASH_SIZE = 8192;  // power of two, more than MAX_CODES
+
+	static void write_u16(std::string& out, int v) {
+		out += (char)(v & 0xff);
+		out += (char)((v >> 8) & 0xff);
+	}
+
+	static void writePalette(std::string& out, const uint32_t* palette) {
+		for (int n = 0; n < 256; n++) {
+			out += (char)((palette[n] >> 16) & 0xff);
+			out += (char)((palette[n] >> 8) & 0xff);
+			out += (char)(palette[n] & 0xff);
+		}
+	}
+
+	// lzw codes are packed least significant bit first and stored in blocks of up to 255 bytes
+	class BlockWriter {
+	   public:
+		BlockWriter(std::string& out) : m_out(out) {
+		}
+
+		void code(uint32_t c, int n) {
+			m_bitbuf |= c << m_bitcnt;
+			m_bitcnt += n;
+			while (m_bitcnt >= 8) {
+				byte(m_bitbuf & 0xff);
+				m_bitbuf >>= 8;
+				m_bitcnt -= 8;
+			}
+		}
+
+		void finish() {
+			if (m_bitcnt) {
+				byte(m_bitbuf & 0xff);
+			}
+			if (m_len) {
+				flushBlock();
+			}
+			m_out += (char)0;
+		}
+
+	   private:
+		void byte(uint8_t b) {
+			m_block[m_len++] = b;
+			if (m_len == 255) {
+				flushBlock();
+			}
+		}
+
+		void flushBlock() {
+			m_out += (char)m_len;
+			m_out.append((const char*)m_block, m_len);
+			m_len = 0;
+		}
+
+		std::string& m_out;
+		uint32_t m_bitbuf = 0;
+		int m_bitcnt = 0;
+		uint8_t m_block[255];
+		int m_len = 0;
+	};
+
+	Encoder::Encoder(int width, int height, const uint32_t* palette)
+	    : m_width(width), m_height(height) {
+		memcpy(m_palette, palette, sizeof(m_palette));
+
+		m_out = "GIF89a";
+		write_u16(m_out, width);
+		write_u16(m_out, height);
+		m_out += (char)0xf7;  // 256 entry global colour table, 8 bits per channel
+		m_out += (char)0;     // background colour
+		m_out += (char)0;     // square pixels
+		writePalette(m_out, m_palette);
+
+		// loop forever
+		m_out += "\x21\xff\x0bNETSCAPE2.0";
+		m_out += (char)3;
+		m_out += (char)1;
+		write_u16(m_out, 0);
+		m_out += (char)0;
+	}
+
+	void Encoder::addFrame(const uint8_t* pixels, const uint32_t* palette, int delay) {
+		// graphic control extension, the frame replaces the last one with no transparency
+		m_out += "\x21\xf9\x04";
+		m_out += (char)0x04;
+		write_u16(m_out, delay);
+		m_out += (char)0;
+		m_out += (char)0;
+
+		bool local = memcmp(palette, m_palette, sizeof(m_palette)) != 0;
+		m_out += (char)0x2c;
+		write_u16(m_out, 0);
+		write_u16(m_out, 0);
+		write_u16(m_out, m_width);
+		write_u16(m_out, m_height);
+		m_out += (char)(local ? 0x87 : 0);
+		if (local) {
+			writePalette(m_out, palette);
+		}
+
+		writeLZW(pixels, (size_t)m_width * m_height);
+	}
+
+	// the string table is a hash of (prefix code, next index) -> code, cleared whenever it fills
+	void Encoder::writeLZW(const uint8_t* pixels, size_t count) {
+		const int clearCode = 1 << MIN_CODE_SIZE;
+		const int endCode = clearCode + 1;
+
+		std::vector<int32_t> keys(HASH_SIZE);
+		std::vector<uint16_t> codes(HASH_SIZE);
+		auto clear = [&]() { std::fill(keys.begin(), keys.end(), -1); };
+		clear();
+
+		m_out += (char)MIN_CODE_SIZE;
+		BlockWriter w(m_out);
+		int codeSize = MIN_CODE_SIZE + 1;
+		int maxCode = endCode;
+		w.code(clearCode, codeSize);
+
+		if (count == 0) {
+			w.code(endCode, codeSize);
+			w.finish();
+			return;
+		}
+
+		int cur = pixels[0];
+		for (size_t n = 1; n < count; n++) {
+			uint8_t next = pixels[n];
+			int32_t key = (cur << 8) | next;
+			uint32_t slot = ((uint32_t)key * 2654435761u) >> 19;
+			while (keys[slot] != -1 && keys[slot] != key) {
+				slot = (slot + 1) & (HASH_SIZE - 1);
+			}
+			if (keys[slot] == key) {
+				cur = codes[slot];
+				continue;
+			}
+
+			w.code(cur, codeSize);
+			maxCode++;
+			keys[slot] = key;
+			codes[slot] = (uint16_t)maxCode;
+			if (maxCode >= (1 << codeSize)) {
+				codeSize++;
+			}
+			if (maxCode == MAX_CODES - 1) {
+				w.code(clearCode, codeSize);
+				clear();
+				codeSize = MIN_CODE_SIZE + 1;
+				maxCode = endCode;
+			}
+			cur = next;
+		}
+		w.code(cur, codeSize);
+		w.code(endCode, codeSize);
+		w.finish();
+	}
+
+	std::string Encoder::finish() {
+		m_out += (char)0x3b;
+		std::string out;
+		out.swap(m_out);
+		return out;
+	}
+
+}  // namespace gif
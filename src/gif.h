@@ -0,0 +1,41 @@
+#ifndef GIF_H
+#define GIF_H
+
+#include <stdint.h>
+#include <string>
+
+namespace gif {
+
+	// builds an animated, looping gif one frame at a time. every frame is a full canvas of 8 bit
+	// colour indexes, palettes hold 0xrrggbb for all 256 indexes. a frame whose palette differs
+	// from the first frame's carries its own colour table.
+	class Encoder {
+	   public:
+		Encoder(int width, int height, const uint32_t* palette);
+
+		// delay is in hundredths of a second
+		void addFrame(const uint8_t* pixels, const uint32_t* palette, int delay);
+
+		// ends the gif and returns the file data
+		std::string finish();
+
+		int width() const {
+			return m_width;
+		}
+
+		int height() const {
+			return m_height;
+		}
+
+	   private:
+		void writeLZW(const uint8_t* pixels, size_t count);
+
+		int m_width;
+		int m_height;
+		uint32_t m_palette[256];
+		std::string m_out;
+	};
+
+}  // namespace gif
+
+#endif /* GIF_H */
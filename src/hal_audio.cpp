@@ -2,8 +2,11 @@
 #include <SDL2/SDL_audio.h>
 
 #include <stdint.h>
+#include <string.h>
 #include <algorithm>
 #include <array>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "hal_audio.h"
@@ -13,14 +16,39 @@
 
 static const int NUM_CHANNELS = config::AUDIO_CHANNELS;
 
-struct Wav {
-	SDL_AudioSpec spec;
-	int16_t* sampleData = 0;
+static const uint16_t WAVE_FORMAT_PCM = 0x0001;
+static const uint16_t WAVE_FORMAT_IMA_ADPCM = 0x0011;
+
+// sample storage for a wav. held by the cache and by any channel playing it, so a wav
+// evicted from the cache while still playing is only freed once the channel lets go of it.
+struct WavData {
+	int freq = config::AUDIO_FREQ;
 	uint32_t numSamples = 0;
+
+	// 16 bit mono pcm samples. empty if the wav is held as ima adpcm.
+	std::vector<int16_t> pcm;
+
+	// ima adpcm blocks, decoded a block at a time as the wav is played.
+	std::vector<uint8_t> adpcm;
+	uint32_t blockAlign = 0;
+	uint32_t samplesPerBlock = 0;
+
+	size_t bytes() const {
+		return pcm.size() * sizeof(int16_t) + adpcm.size();
+	}
+};
+
+struct Wav {
+	std::string name;
+	bool trim = true;
+	bool pack = false;
+	uint64_t lastUsed = 0;
+	std::shared_ptr<WavData> data;  // null until first played, or after eviction
 };
 
 struct Channel {
-	Wav wav;
+	int id = -1;
+	std::shared_ptr<WavData> wav;
 	uint32_t current = 0;
 	bool loop = false;
 	bool playing = false;
@@ -28,17 +56,361 @@ struct Channel {
 	uint32_t end = 0;
 	uint32_t loop_start = 0;
 	uint32_t loop_end = 0;
+
+	// currently decoded adpcm block
+	std::vector<int16_t> block;
+	int32_t blockIndex = -1;
 };
 
 std::vector<Wav> loadedWavs;
 SDL_AudioDeviceID audioDevice = 0;
 std::array<Channel, NUM_CHANNELS> channels;
 
+static size_t cacheBytes = 0;
+static uint64_t useCounter = 0;
+
 static void throw_error(std::string msg) {
 	msg += SDL_GetError();
 	throw(audio_exception(msg));
 }
 
+// ------------------------------------------------------------------
+// IMA ADPCM
+// ------------------------------------------------------------------
+
+static const int adpcmIndexTable[16] = {-1, -1, -1, -1, 2, 4, 6, 8,
+                                        -1, -1, -1, -1, 2, 4, 6, 8};
+
+static const int adpcmStepTable[89] = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,    19,    21,    23,
+    25,    28,    31,    34,    37,    41,    45,    50,    55,    60,    66,    73,    80,
+    88,    97,    107,   118,   130,   143,   157,   173,   190,   209,   230,   253,   279,
+    307,   337,   371,   408,   449,   494,   544,   598,   658,   724,   796,   876,   963,
+    1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,  2272,  2499,  2749,  3024,  3327,
+    3660,  4026,  4428,  4871,  5358,  5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+struct AdpcmState {
+	int predictor = 0;
+	int index = 0;
+
+	int16_t decode(uint8_t nibble) {
+		int step = adpcmStepTable[index];
+		int diff = step >> 3;
+		if (nibble & 1)
+			diff += step >> 2;
+		if (nibble & 2)
+			diff += step >> 1;
+		if (nibble & 4)
+			diff += step;
+		if (nibble & 8)
+			predictor -= diff;
+		else
+			predictor += diff;
+
+		predictor = std::min(std::max(predictor, (int)INT16_MIN), (int)INT16_MAX);
+		index = std::min(std::max(index + adpcmIndexTable[nibble], 0), 88);
+		return (int16_t)predictor;
+	}
+
+	uint8_t encode(int16_t sample) {
+		int step = adpcmStepTable[index];
+		int diff = sample - predictor;
+		uint8_t nibble = 0;
+		if (diff < 0) {
+			nibble = 8;
+			diff = -diff;
+		}
+		for (uint8_t mask = 4; mask; mask >>= 1) {
+			if (diff >= step) {
+				nibble |= mask;
+				diff -= step;
+			}
+			step >>= 1;
+		}
+		// run the decoder so the encoder tracks exactly what will be played back
+		decode(nibble);
+		return nibble;
+	}
+};
+
+// decodes a single mono block: 4 byte header holding the first sample & step index,
+// followed by 4 bit samples, low nibble first.
+static void decode_adpcm_block(const uint8_t* src, uint32_t len, int16_t* dest) {
+	AdpcmState s;
+	s.predictor = int16_t(src[0] | (src[1] << 8));
+	s.index = std::min<int>(src[2], 88);
+	*dest++ = (int16_t)s.predictor;
+	for (uint32_t n = 4; n < len; n++) {
+		*dest++ = s.decode(src[n] & 0x0f);
+		*dest++ = s.decode(src[n] >> 4);
+	}
+}
+
+// incrementally packs 16 bit pcm into ima adpcm blocks, so long tracks can be converted
+// while being read without ever holding the whole pcm stream.
+struct AdpcmPacker {
+	WavData& wav;
+	AdpcmState state;
+	uint32_t blockPos = 0;  // samples written to current block
+	size_t blockStart = 0;
+	bool hiNibble = false;
+
+	AdpcmPacker(WavData& w) : wav(w) {
+		wav.blockAlign = config::AUDIO_ADPCM_BLOCK_SIZE;
+		wav.samplesPerBlock = (wav.blockAlign - 4) * 2 + 1;
+	}
+
+	void add(int16_t sample) {
+		if (blockPos == 0) {
+			blockStart = wav.adpcm.size();
+			wav.adpcm.resize(blockStart + wav.blockAlign, 0);
+			state.predictor = sample;
+			wav.adpcm[blockStart + 0] = uint8_t(sample);
+			wav.adpcm[blockStart + 1] = uint8_t(sample >> 8);
+			wav.adpcm[blockStart + 2] = uint8_t(state.index);
+			hiNibble = false;
+		} else {
+			uint8_t nibble = state.encode(sample);
+			uint8_t& b = wav.adpcm[blockStart + 4 + (blockPos - 1) / 2];
+			b |= hiNibble ? (nibble << 4) : nibble;
+			hiNibble = !hiNibble;
+		}
+		wav.numSamples++;
+		if (++blockPos == wav.samplesPerBlock) {
+			blockPos = 0;
+		}
+	}
+};
+
+// ------------------------------------------------------------------
+// wav file reading
+// ------------------------------------------------------------------
+
+struct WavFormat {
+	uint16_t format = 0;
+	uint16_t channels = 0;
+	uint32_t freq = 0;
+	uint16_t blockAlign = 0;
+	uint16_t bits = 0;
+	uint32_t factSamples = 0;
+	uint32_t dataOffset = 0;
+	uint32_t dataSize = 0;
+};
+
+static uint32_t read_u32(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+static uint16_t read_u16(const uint8_t* p) {
+	return p[0] | (p[1] << 8);
+}
+
+// walks the riff chunks up to the start of the sample data. rw is left positioned at the
+// start of the data chunk.
+static bool read_wav_header(SDL_RWops* rw, WavFormat& fmt) {
+	uint8_t hdr[12];
+	if (SDL_RWread(rw, hdr, sizeof(hdr), 1) != 1 || memcmp(hdr, "RIFF", 4) != 0 ||
+	    memcmp(hdr + 8, "WAVE", 4) != 0) {
+		return false;
+	}
+
+	uint8_t chunk[8];
+	while (SDL_RWread(rw, chunk, sizeof(chunk), 1) == 1) {
+		uint32_t size = read_u32(chunk + 4);
+		Sint64 next = SDL_RWtell(rw) + size + (size & 1);
+
+		if (memcmp(chunk, "fmt ", 4) == 0) {
+			uint8_t f[16];
+			if (size < sizeof(f) || SDL_RWread(rw, f, sizeof(f), 1) != 1) {
+				return false;
+			}
+			fmt.format = read_u16(f);
+			fmt.channels = read_u16(f + 2);
+			fmt.freq = read_u32(f + 4);
+			fmt.blockAlign = read_u16(f + 12);
+			fmt.bits = read_u16(f + 14);
+		} else if (memcmp(chunk, "fact", 4) == 0) {
+			uint8_t f[4];
+			if (size >= sizeof(f) && SDL_RWread(rw, f, sizeof(f), 1) == 1) {
+				fmt.factSamples = read_u32(f);
+			}
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			fmt.dataOffset = (uint32_t)SDL_RWtell(rw);
+			fmt.dataSize = size;
+			return fmt.format != 0;
+		}
+		SDL_RWseek(rw, next, RW_SEEK_SET);
+	}
+	return false;
+}
+
+static bool is_native_format(const WavFormat& fmt) {
+	if (fmt.channels != 1) {
+		return false;
+	}
+	if (fmt.format == WAVE_FORMAT_PCM && fmt.bits == 16) {
+		return true;
+	}
+	return fmt.format == WAVE_FORMAT_IMA_ADPCM && fmt.bits == 4 && fmt.blockAlign > 4;
+}
+
+static uint32_t trim_sample(int16_t* sampleData, uint32_t numSamples) {
+	for (uint32_t n = numSamples; n > 0; n--) {
+		if (sampleData[n - 1] != 0) {
+			return n;
+		}
+	}
+	return 0;
+}
+
+// reads pcm sample data in fixed size chunks, either straight into the wav or through the
+// adpcm packer.
+static void read_pcm(SDL_RWops* rw, const WavFormat& fmt, WavData& wav, bool pack) {
+	std::vector<int16_t> chunk(config::AUDIO_STREAM_CHUNK_SAMPLES);
+	uint32_t remaining = fmt.dataSize / 2;
+
+	if (!pack) {
+		wav.pcm.reserve(remaining);
+	}
+	AdpcmPacker packer(wav);
+
+	while (remaining) {
+		uint32_t n = std::min<uint32_t>(remaining, chunk.size());
+		n = (uint32_t)SDL_RWread(rw, chunk.data(), sizeof(int16_t), n);
+		if (n == 0) {
+			break;
+		}
+		remaining -= n;
+		if (pack) {
+			for (uint32_t i = 0; i < n; i++) {
+				packer.add(SDL_SwapLE16(chunk[i]));
+			}
+		} else {
+			for (uint32_t i = 0; i < n; i++) {
+				wav.pcm.push_back(SDL_SwapLE16(chunk[i]));
+			}
+		}
+	}
+
+	if (!pack) {
+		wav.numSamples = (uint32_t)wav.pcm.size();
+	}
+}
+
+static void read_adpcm(SDL_RWops* rw, const WavFormat& fmt, WavData& wav) {
+	wav.blockAlign = fmt.blockAlign;
+	wav.samplesPerBlock = (fmt.blockAlign - 4) * 2 + 1;
+	uint32_t blocks = fmt.dataSize / fmt.blockAlign;
+
+	wav.adpcm.resize(blocks * fmt.blockAlign);
+	if (blocks && SDL_RWread(rw, wav.adpcm.data(), fmt.blockAlign, blocks) != blocks) {
+		throw audio_exception("truncated adpcm data");
+	}
+
+	wav.numSamples = blocks * wav.samplesPerBlock;
+	if (fmt.factSamples && fmt.factSamples < wav.numSamples) {
+		wav.numSamples = fmt.factSamples;
+	}
+}
+
+// formats not handled natively are converted by SDL and held uncompressed
+static void read_sdl(const Wav& w, WavData& wav) {
+	SDL_AudioSpec spec;
+	uint8_t* buf = nullptr;
+	uint32_t len = 0;
+
+	if (SDL_LoadWAV(w.name.c_str(), &spec, &buf, &len) == nullptr) {
+		throw_error("SDL_LoadWav error: ");
+	}
+	wav.freq = spec.freq;
+	wav.pcm.assign((int16_t*)buf, (int16_t*)buf + len / 2);
+	wav.numSamples = (uint32_t)wav.pcm.size();
+	SDL_FreeWAV(buf);
+}
+
+static std::shared_ptr<WavData> decode_wav(const Wav& w) {
+	auto wav = std::make_shared<WavData>();
+
+	SDL_RWops* rw = SDL_RWFromFile(w.name.c_str(), "rb");
+	if (rw == nullptr) {
+		throw_error("SDL_RWFromFile error: ");
+	}
+
+	WavFormat fmt;
+	if (!read_wav_header(rw, fmt) || !is_native_format(fmt)) {
+		SDL_RWclose(rw);
+		read_sdl(w, *wav);
+	} else {
+		wav->freq = fmt.freq;
+		try {
+			if (fmt.format == WAVE_FORMAT_PCM) {
+				read_pcm(rw, fmt, *wav, w.pack);
+			} else {
+				read_adpcm(rw, fmt, *wav);
+			}
+		} catch (audio_exception&) {
+			SDL_RWclose(rw);
+			throw;
+		}
+		SDL_RWclose(rw);
+	}
+
+	if (w.trim && !wav->pcm.empty()) {
+		wav->numSamples = trim_sample(wav->pcm.data(), wav->numSamples);
+	}
+
+	logr << "decoded wav: " << w.name << " freq: " << wav->freq << " samples: " << wav->numSamples
+	     << " bytes: " << wav->bytes() << (wav->adpcm.empty() ? "" : " (adpcm)")
+	     << " duration: " << (double)wav->numSamples / (double)wav->freq;
+
+	return wav;
+}
+
+// drop least recently used wavs until the cache is back within budget. wavs still held by
+// a channel are left alone.
+static void evict_wavs(int keep) {
+	while (cacheBytes > config::AUDIO_CACHE_SIZE) {
+		int lru = -1;
+		for (int id = 0; id < (int)loadedWavs.size(); id++) {
+			const Wav& w = loadedWavs[id];
+			if (id != keep && w.data && w.data.use_count() == 1 &&
+			    (lru < 0 || w.lastUsed < loadedWavs[lru].lastUsed)) {
+				lru = id;
+			}
+		}
+		if (lru < 0) {
+			return;
+		}
+		logr << "evicting wav: " << loadedWavs[lru].name;
+		cacheBytes -= loadedWavs[lru].data->bytes();
+		loadedWavs[lru].data.reset();
+	}
+}
+
+static std::shared_ptr<WavData> get_wav(int id) {
+	if (id < 0 || id >= (int)loadedWavs.size())
+		return nullptr;
+
+	Wav& w = loadedWavs[id];
+	w.lastUsed = ++useCounter;
+	if (!w.data) {
+		try {
+			w.data = decode_wav(w);
+		} catch (audio_exception& e) {
+			logr << LogLevel::err << "failed to load wav: " << w.name << " " << e.what();
+			return nullptr;
+		}
+		cacheBytes += w.data->bytes();
+		evict_wavs(id);
+	}
+	return w.data;
+}
+
+// ------------------------------------------------------------------
+// mixer
+// ------------------------------------------------------------------
+
 inline int16_t getNextSample(Channel& c) {
 	if (!c.playing)
 		return 0;
@@ -51,7 +423,18 @@ inline int16_t getNextSample(Channel& c) {
 			return 0;
 		}
 	}
-	return c.wav.sampleData[c.current++];
+
+	const WavData& wav = *c.wav;
+	if (wav.adpcm.empty()) {
+		return wav.pcm[c.current++];
+	}
+
+	int32_t block = c.current / wav.samplesPerBlock;
+	if (block != c.blockIndex) {
+		decode_adpcm_block(&wav.adpcm[block * wav.blockAlign], wav.blockAlign, c.block.data());
+		c.blockIndex = block;
+	}
+	return c.block[c.current++ - block * wav.samplesPerBlock];
 }
 
 inline int16_t clamp(int32_t s) {
@@ -62,9 +445,8 @@ inline int16_t clamp(int32_t s) {
 	return (int16_t)s;
 }
 
-static void callback(void* userdata, uint8_t* stream, int len) {
-	int16_t* stream16 = (int16_t*)stream;
-	for (int n = 0; n < len / 2; n++) {
+static void mix(int16_t* stream16, int samples) {
+	for (int n = 0; n < samples; n++) {
 		// bad mixing...
 		int32_t sum = 0;
 		for (int n = 0; n < NUM_CHANNELS; n++) {
@@ -74,6 +456,45 @@ static void callback(void* userdata, uint8_t* stream, int len) {
 	}
 }
 
+static void callback(void* userdata, uint8_t* stream, int len) {
+	mix((int16_t*)stream, len / 2);
+}
+
+// ------------------------------------------------------------------
+// offline rendering
+// ------------------------------------------------------------------
+
+static SDL_RWops* renderFile = nullptr;
+static uint32_t renderSamples = 0;
+static uint64_t renderFraction = 0;  // part samples carried between frames, in 1/fps units
+static std::vector<int16_t> renderBuffer;
+
+static void write_wav_header(SDL_RWops* rw, uint32_t samples) {
+	uint32_t dataSize = samples * sizeof(int16_t);
+	SDL_RWwrite(rw, "RIFF", 4, 1);
+	SDL_WriteLE32(rw, 36 + dataSize);
+	SDL_RWwrite(rw, "WAVEfmt ", 8, 1);
+	SDL_WriteLE32(rw, 16);
+	SDL_WriteLE16(rw, WAVE_FORMAT_PCM);
+	SDL_WriteLE16(rw, 1);
+	SDL_WriteLE32(rw, config::AUDIO_FREQ);
+	SDL_WriteLE32(rw, config::AUDIO_FREQ * sizeof(int16_t));
+	SDL_WriteLE16(rw, sizeof(int16_t));
+	SDL_WriteLE16(rw, 16);
+	SDL_RWwrite(rw, "data", 4, 1);
+	SDL_WriteLE32(rw, dataSize);
+}
+
+static void end_render() {
+	if (renderFile) {
+		SDL_RWseek(renderFile, 0, RW_SEEK_SET);
+		write_wav_header(renderFile, renderSamples);
+		SDL_RWclose(renderFile);
+		renderFile = nullptr;
+		logr << "rendered " << renderSamples << " samples of audio";
+	}
+}
+
 void AUDIO_Init() {
 	TraceFunction();
 
@@ -95,117 +516,158 @@ void AUDIO_Init() {
 	SDL_PauseAudioDevice(audioDevice, 0);
 }
 
+// no audio device is opened, instead the mixer is run by AUDIO_RenderFrame and the output
+// is written to a wav file.
+void AUDIO_InitRender(const char* filename) {
+	TraceFunction();
+
+	renderFile = SDL_RWFromFile(filename, "wb");
+	if (renderFile == nullptr) {
+		throw_error("SDL_RWFromFile error: ");
+	}
+	renderSamples = 0;
+	renderFraction = 0;
+	write_wav_header(renderFile, 0);
+}
+
+// mixes one game frame worth of audio. the sample count is carried between frames so the
+// output stays in sync with the game at any frame rate.
+void AUDIO_RenderFrame(int fps) {
+	if (renderFile == nullptr || fps <= 0)
+		return;
+
+	renderFraction += config::AUDIO_FREQ;
+	uint32_t samples = (uint32_t)(renderFraction / fps);
+	renderFraction %= fps;
+
+	renderBuffer.resize(samples);
+	mix(renderBuffer.data(), samples);
+	for (auto& s : renderBuffer) {
+		s = SDL_SwapLE16(s);
+	}
+	SDL_RWwrite(renderFile, renderBuffer.data(), sizeof(int16_t), samples);
+	renderSamples += samples;
+}
+
+bool AUDIO_IsRendering() {
+	return renderFile != nullptr;
+}
+
 void AUDIO_Shutdown() {
 	TraceFunction();
-	SDL_PauseAudioDevice(audioDevice, 1);
-	SDL_CloseAudioDevice(audioDevice);
+	end_render();
+	if (audioDevice) {
+		SDL_PauseAudioDevice(audioDevice, 1);
+		SDL_CloseAudioDevice(audioDevice);
+		audioDevice = 0;
+	}
 
-	for (auto& wav : loadedWavs) {
-		SDL_FreeWAV((uint8_t*)(wav.sampleData));
+	for (auto& c : channels) {
+		c = Channel{};
 	}
 	loadedWavs.clear();
+	cacheBytes = 0;
 	SDL_QuitSubSystem(SDL_INIT_AUDIO);
 }
 
-static uint32_t trim_sample(int16_t* sampleData, uint32_t numSamples) {
-	for (uint32_t n = numSamples; n > 0; n--) {
-		if (sampleData[n - 1] != 0) {
-			return n;
+// registers the wav, the file header is checked now but the sample data is not read until
+// the wav is first played.
+int AUDIO_LoadWav(const char* name, bool trim, bool pack) {
+	for (int id = 0; id < (int)loadedWavs.size(); id++) {
+		const Wav& w = loadedWavs[id];
+		if (w.name == name && w.trim == trim && w.pack == pack) {
+			return id;
 		}
 	}
-	return 0;
-}
-
-int AUDIO_LoadWav(const char* name, bool trim) {
-	Wav wav;
-	SDL_zero(wav);
 
-	if (SDL_LoadWAV(name, &wav.spec, (uint8_t**)&wav.sampleData, &wav.numSamples) == nullptr) {
+	SDL_RWops* rw = SDL_RWFromFile(name, "rb");
+	if (rw == nullptr) {
 		throw_error("SDL_LoadWav error: ");
 	}
-
-	wav.numSamples /= 2;
-
-	if (trim) {
-		wav.numSamples = trim_sample(wav.sampleData, wav.numSamples);
+	WavFormat fmt;
+	bool valid = read_wav_header(rw, fmt);
+	SDL_RWclose(rw);
+	if (!valid) {
+		throw audio_exception(std::string("SDL_LoadWav error: not a wav file: ") + name);
 	}
 
-	SDL_LockAudioDevice(audioDevice);
+	Wav wav;
+	wav.name = name;
+	wav.trim = trim;
+	wav.pack = pack && fmt.format == WAVE_FORMAT_PCM;
 	loadedWavs.push_back(wav);
-	SDL_UnlockAudioDevice(audioDevice);
 
 	int id = loadedWavs.size() - 1;
 
-	logr << "loaded wav: " << name << " id: " << id << " freq: " << wav.spec.freq
-	     << " samples: " << wav.numSamples
-	     << " duration: " << (double)wav.numSamples / (double)wav.spec.freq;
+	logr << "registered wav: " << name << " id: " << id << " freq: " << fmt.freq
+	     << " format: " << fmt.format << " bytes: " << fmt.dataSize;
 
 	return id;
 }
 
-void AUDIO_Play(int id, int chan, bool loop) {
-	if (id >= (int)loadedWavs.size())
+// convert a position in a sample (128th of a second) to a sample index
+static uint32_t pos2sample(int pos, int frequency) {
+	return (uint32_t)(pos * ((double)frequency / 128.0));
+}
+
+static void start_channel(int chan, Channel& ci, uint32_t current) {
+	if (chan < 0 || chan >= NUM_CHANNELS)
 		return;
 
-	Channel ci;
-	ci.wav = loadedWavs[id];
-	ci.loop = loop;
 	ci.playing = true;
-
-	ci.start = 0;
-	ci.end = ci.wav.numSamples;
-	ci.loop_start = ci.start;
-	ci.loop_end = ci.end;
-	ci.current = ci.start;
+	ci.current = current;
+	if (!ci.wav->adpcm.empty()) {
+		ci.block.resize(ci.wav->samplesPerBlock);
+	}
 
 	SDL_LockAudioDevice(audioDevice);
-	channels[chan] = ci;
+	std::swap(channels[chan], ci);
 	SDL_UnlockAudioDevice(audioDevice);
 }
 
-// convert a position in a sample (128th of a second) to a sample index
-static uint32_t pos2sample(int pos, int frequency) {
-	return (uint32_t)(pos * ((double)frequency / 128.0));
+void AUDIO_Play(int id, int chan, bool loop) {
+	Channel ci;
+	ci.id = id;
+	ci.wav = get_wav(id);
+	if (!ci.wav)
+		return;
+
+	ci.loop = loop;
+	ci.start = 0;
+	ci.end = ci.wav->numSamples;
+	ci.loop_start = ci.start;
+	ci.loop_end = ci.end;
+	start_channel(chan, ci, ci.start);
 }
 
 void AUDIO_Play(int id, int chan, int start, int end, bool loop) {
-	if (id >= (int)loadedWavs.size())
+	Channel ci;
+	ci.id = id;
+	ci.wav = get_wav(id);
+	if (!ci.wav)
 		return;
 
-	Channel ci;
-	ci.wav = loadedWavs[id];
 	ci.loop = loop;
-	ci.playing = true;
-
-	ci.start = std::min(pos2sample(start, ci.wav.spec.freq), ci.wav.numSamples);
-	ci.end = std::min(pos2sample(end, ci.wav.spec.freq), ci.wav.numSamples);
+	ci.start = std::min(pos2sample(start, ci.wav->freq), ci.wav->numSamples);
+	ci.end = std::min(pos2sample(end, ci.wav->freq), ci.wav->numSamples);
 	ci.loop_start = ci.start;
 	ci.loop_end = ci.end;
-	ci.current = ci.start;
-
-	SDL_LockAudioDevice(audioDevice);
-	channels[chan] = ci;
-	SDL_UnlockAudioDevice(audioDevice);
+	start_channel(chan, ci, ci.start);
 }
 
 void AUDIO_Play(int id, int chan, int loop_start, int loop_end) {
-	if (id >= (int)loadedWavs.size())
+	Channel ci;
+	ci.id = id;
+	ci.wav = get_wav(id);
+	if (!ci.wav)
 		return;
 
-	Channel ci;
-	ci.wav = loadedWavs[id];
 	ci.loop = true;
-	ci.playing = true;
-
 	ci.start = 0;
-	ci.end = ci.wav.numSamples;
-	ci.loop_start = std::min(pos2sample(loop_start, ci.wav.spec.freq), ci.end);
-	ci.loop_end = std::min(pos2sample(loop_end, ci.wav.spec.freq), ci.end);
-	ci.current = ci.start;
-
-	SDL_LockAudioDevice(audioDevice);
-	channels[chan] = ci;
-	SDL_UnlockAudioDevice(audioDevice);
+	ci.end = ci.wav->numSamples;
+	ci.loop_start = std::min(pos2sample(loop_start, ci.wav->freq), ci.end);
+	ci.loop_end = std::min(pos2sample(loop_end, ci.wav->freq), ci.end);
+	start_channel(chan, ci, ci.start);
 }
 
 void AUDIO_StopAll() {
@@ -245,4 +707,51 @@ int AUDIO_AvailableChan(bool force) {
 	} else {
 		return -1;
 	}
-}
\ No newline at end of file
+}
+
+AudioChannelState AUDIO_GetChannelState(int chan) {
+	AudioChannelState state;
+	SDL_LockAudioDevice(audioDevice);
+	const Channel& c = channels[chan];
+	if (c.playing) {
+		state.wav = loadedWavs[c.id].name;
+		state.trim = loadedWavs[c.id].trim;
+		state.pack = loadedWavs[c.id].pack;
+		state.loop = c.loop;
+		state.current = c.current;
+		state.start = c.start;
+		state.end = c.end;
+		state.loop_start = c.loop_start;
+		state.loop_end = c.loop_end;
+	}
+	SDL_UnlockAudioDevice(audioDevice);
+	return state;
+}
+
+// restarts a channel part way through its wav. the wav is registered again by name so states
+// saved by an earlier run can be restored.
+void AUDIO_SetChannelState(int chan, const AudioChannelState& state) {
+	if (chan < 0 || chan >= NUM_CHANNELS)
+		return;
+
+	Channel ci;
+	if (!state.wav.empty()) {
+		try {
+			ci.id = AUDIO_LoadWav(state.wav.c_str(), state.trim, state.pack);
+		} catch (audio_exception&) {
+			logr << LogLevel::err << "failed to restore wav: " << state.wav;
+		}
+		ci.wav = get_wav(ci.id);
+	}
+	if (!ci.wav) {
+		AUDIO_Stop(chan);
+		return;
+	}
+
+	ci.loop = state.loop;
+	ci.end = std::min(state.end, ci.wav->numSamples);
+	ci.start = std::min(state.start, ci.end);
+	ci.loop_end = std::min(state.loop_end, ci.wav->numSamples);
+	ci.loop_start = std::min(state.loop_start, ci.loop_end);
+	start_channel(chan, ci, std::min(state.current, ci.wav->numSamples));
+}
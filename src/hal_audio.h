@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdexcept>
+#include <string>
 
 struct audio_exception : public std::runtime_error {
 	using std::runtime_error::runtime_error;
@@ -11,7 +12,11 @@ struct audio_exception : public std::runtime_error {
 void AUDIO_Init();
 void AUDIO_Shutdown();
 
-int AUDIO_LoadWav(const char* name, bool trim = true);
+void AUDIO_InitRender(const char* filename);
+void AUDIO_RenderFrame(int fps);
+bool AUDIO_IsRendering();
+
+int AUDIO_LoadWav(const char* name, bool trim = true, bool pack = false);
 void AUDIO_Play(int id, int chan, bool loop);
 void AUDIO_Play(int id, int chan, int start, int end, bool loop);
 void AUDIO_Play(int id, int chan, int loop_start, int loop_end);
@@ -21,4 +26,19 @@ void AUDIO_StopLoop(int chan);
 bool AUDIO_isPlaying(int chan);
 int AUDIO_AvailableChan(bool force = false);
 
+struct AudioChannelState {
+	std::string wav;  // name of the wav playing, empty when the channel is idle
+	bool trim = true;
+	bool pack = false;
+	bool loop = false;
+	uint32_t current = 0;
+	uint32_t start = 0;
+	uint32_t end = 0;
+	uint32_t loop_start = 0;
+	uint32_t loop_end = 0;
+};
+
+AudioChannelState AUDIO_GetChannelState(int chan);
+void AUDIO_SetChannelState(int chan, const AudioChannelState& state);
+
 #endif /* SDL_AUDIO_H */
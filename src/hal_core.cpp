@@ -3,18 +3,37 @@
 #include <SDL2/SDL_rwops.h>
 #include <assert.h>
 
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #ifdef __ANDROID__
 #include <jni.h>
 #endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "config.h"
 #include "crypt.h"
 #include "deque"
 #include "hal_core.h"
 #include "hal_palette.h"
+#include "hal_screenmode.h"
 #include "log.h"
 
 static SDL_Window* sdlWin = nullptr;
@@ -27,15 +46,59 @@ static int screenHeight = config::INIT_SCREEN_HEIGHT;
 
 static std::array<pixel_t, 256> original_palette;
 static std::array<pixel_t, 256> palette;
+// set when palette differs from original_palette, so restoring an unmapped palette is free
+static bool paletteMapped = false;
 
 static bool debug_trace_state = false;
 static bool reload_requested = false;
+static bool save_state_requested = false;
+static bool load_state_requested = false;
+static bool save_gif_requested = false;
+static bool screenshot_requested = false;
+static bool rewind_held = false;
 static std::string selectedPalette;
 
 static SDL_Point zoom_origin = SDL_Point{64, 64};
 static double zoom_factor = 1.0;
 static double zoom_rot = 0.0;
 
+// converting frames on a thread of its own. the game thread hands over each finished 8 bit frame
+// along with the palette and zoom it was drawn with, and the converter turns it into texture
+// pixels while the game runs the next frame. sdl only supports rendering from the main thread,
+// so the upload and present of the last converted frame stay there.
+struct PresentFrame {
+	std::vector<uint8_t> pixels;
+	std::vector<pixel_t> converted;  // filled in by the converter
+	int w = 0;
+	int h = 0;
+	std::array<pixel_t, 256> palette;
+	SDL_Point zoom_origin;
+	double zoom_factor = 1.0;
+	double zoom_rot = 0.0;
+	uint64_t submitted_us = 0;
+};
+
+enum class PresenterState { stopped, starting, running };
+
+static std::thread presentThread;
+static std::mutex presentMutex;
+static std::condition_variable presentCond;
+static PresenterState presenterState = PresenterState::stopped;
+static bool presentQuit = false;
+static PresentFrame gameFrame;     // filled in by the game thread
+static PresentFrame pendingFrame;  // handed over and waiting for the converter
+static PresentFrame readyFrame;    // converted and waiting to be presented
+static PresentFrame shownFrame;    // being presented by the game thread
+static bool framePending = false;
+static bool frameReady = false;
+
+// presenting through sdl's software renderer, see GFX_UseSoftwarePresent
+static bool softwarePresent = false;
+
+// guarded by presentMutex
+static PresentStats presentStats;
+static uint64_t copySubmitted_us = 0;
+
 static void throw_error(std::string msg) {
 	msg += SDL_GetError();
 	throw(gfx_exception(msg));
@@ -61,6 +124,18 @@ void SYSLOG_LogMessage(LogLevel l, const char* msg) {
 	}
 }
 
+static SDL_Renderer* createRenderer() {
+	if (softwarePresent) {
+		return SDL_CreateRenderer(sdlWin, -1, SDL_RENDERER_SOFTWARE);
+	}
+	return SDL_CreateRenderer(sdlWin, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+}
+
+static SDL_Texture* createTexture() {
+	return SDL_CreateTexture(sdlRen, SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING,
+	                         config::MAX_SCREEN_WIDTH, config::MAX_SCREEN_HEIGHT);
+}
+
 void GFX_Init(int x, int y) {
 	TraceFunction();
 
@@ -85,10 +160,15 @@ void GFX_Init(int x, int y) {
 		throw_error("SDL_CreateWindow Error: ");
 	}
 
-	sdlRen = SDL_CreateRenderer(sdlWin, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+	sdlRen = createRenderer();
 	if (sdlRen == nullptr) {
 		throw_error("SDL_CreateRenderer Error: ");
 	}
+	SDL_RendererInfo info;
+	if (SDL_GetRendererInfo(sdlRen, &info) == 0 && (info.flags & SDL_RENDERER_SOFTWARE)) {
+		logr << "no accelerated renderer, using the software present path";
+		softwarePresent = true;
+	}
 	SDL_ShowCursor(SDL_DISABLE);
 
 	int joystick_index = -1;
@@ -120,8 +200,11 @@ void GFX_Init(int x, int y) {
 	logr << "num touch devices: " << num;
 }
 
+static void stopPresentThread();
+
 void GFX_End() {
 	TraceFunction();
+	stopPresentThread();
 	if (sdlRen) {
 		SDL_DestroyRenderer(sdlRen);
 	}
@@ -161,8 +244,7 @@ void GFX_CreateBackBuffer(int x, int y) {
 	TraceFunction();
 	GFX_SetBackBufferSize(x, y);
 
-	sdlTex = SDL_CreateTexture(sdlRen, SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING,
-	                           config::MAX_SCREEN_WIDTH, config::MAX_SCREEN_HEIGHT);
+	sdlTex = createTexture();
 	if (sdlTex == nullptr) {
 		throw_error("SDL_CreateTexture Error: ");
 	}
@@ -187,14 +269,19 @@ void GFX_SelectPalette(const std::string& name) {
 		original_palette[i] = pix;
 		palette[i] = pix;
 	}
+	paletteMapped = false;
 }
 
 void GFX_MapPaletteIndex(uint8_t to, uint8_t from) {
 	palette[to] = original_palette[from];
+	paletteMapped = true;
 }
 
 void GFX_RestorePaletteMapping() {
-	palette = original_palette;
+	if (paletteMapped) {
+		palette = original_palette;
+		paletteMapped = false;
+	}
 }
 
 void GFX_RestorePaletteMappingIndex(uint8_t i) {
@@ -220,7 +307,11 @@ void GFX_SetPaletteRGBIndex(uint8_t i, uint8_t r, uint8_t g, uint8_t b) {
 	original_palette[i] = palette[i];
 }
 
-void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h) {
+static bool convertToTexture(const uint8_t* buffer,
+                             int buffer_w,
+                             int buffer_h,
+                             uint8_t screenMode,
+                             const std::array<pixel_t, 256>& pal) {
 	pixel_t* pixels;
 	int pitch;
 
@@ -228,20 +319,55 @@ void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h) {
 
 	int res = SDL_LockTexture(sdlTex, &r, (void**)&pixels, &pitch);
 	if (res < 0) {
-		throw_error("SDL_LockTexture Error: ");
+		return false;
 	}
 
-	for (int y = 0; y < buffer_h; y++) {
-		for (int x = 0; x < buffer_w; x++) {
-			pixels[x] = palette[buffer[x]];
-			x++;
-			pixels[x] = palette[buffer[x]];
+	GFX_ConvertScreenMode(buffer, buffer_w, buffer_h, screenMode, pal.data(), pixels,
+	                      pitch / (int)sizeof(pixel_t));
+
+	SDL_UnlockTexture(sdlTex);
+	return true;
+}
+
+void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h, uint8_t screenMode) {
+	uint64_t now = TIME_GetProfileTime_us();
+	if (presenterState == PresenterState::running || softwarePresent) {
+		// the frame is converted later, only the screen mode is applied here
+		if (screenMode == 0) {
+			gameFrame.pixels.assign(buffer, buffer + buffer_w * buffer_h);
+		} else {
+			uint8_t identity[256];
+			for (int i = 0; i < 256; i++) {
+				identity[i] = (uint8_t)i;
+			}
+			gameFrame.pixels.resize(buffer_w * buffer_h);
+			GFX_ConvertScreenMode(buffer, buffer_w, buffer_h, screenMode, identity,
+			                      gameFrame.pixels.data(), buffer_w);
 		}
-		pixels += pitch / sizeof(pixel_t);
-		buffer += buffer_w;
+		gameFrame.w = buffer_w;
+		gameFrame.h = buffer_h;
+		gameFrame.palette = palette;
+		gameFrame.submitted_us = now;
+	} else if (!convertToTexture(buffer, buffer_w, buffer_h, screenMode, palette)) {
+		throw_error("SDL_LockTexture Error: ");
 	}
+	std::lock_guard<std::mutex> lock(presentMutex);
+	copySubmitted_us = now;
+}
 
-	SDL_UnlockTexture(sdlTex);
+PaletteState GFX_GetPaletteState() {
+	PaletteState state;
+	state.name = selectedPalette;
+	state.rgb = original_palette;
+	state.mapped = palette;
+	return state;
+}
+
+void GFX_SetPaletteState(const PaletteState& state) {
+	selectedPalette = state.name;
+	original_palette = state.rgb;
+	palette = state.mapped;
+	paletteMapped = palette != original_palette;
 }
 
 void GFX_ShowHWMouse(bool show) {
@@ -259,10 +385,12 @@ void GFX_SetZoom(int x, int y, double factor, double rot) {
 	zoom_rot = rot;
 }
 
-static SDL_Rect getDisplayArea(SDL_Window* win, double* scale = nullptr) {
-	int winx, winy;
-	SDL_GetWindowSize(win, &winx, &winy);
-
+// the largest area of winx by winy with the screen's aspect ratio, centred
+static SDL_Rect fitArea(int winx,
+                        int winy,
+                        int screenWidth,
+                        int screenHeight,
+                        double* scale = nullptr) {
 	SDL_Rect r = {0, 0, winx, winy};
 	double xscale = (double)winx / (double)screenWidth;
 	double yscale = (double)winy / (double)screenHeight;
@@ -281,8 +409,21 @@ static SDL_Rect getDisplayArea(SDL_Window* win, double* scale = nullptr) {
 	return r;
 }
 
-void GFX_Flip() {
-	SDL_Rect dr = getDisplayArea(sdlWin);
+static SDL_Rect getDisplayArea(SDL_Window* win,
+                               int screenWidth,
+                               int screenHeight,
+                               double* scale = nullptr) {
+	int winx, winy;
+	SDL_GetWindowSize(win, &winx, &winy);
+	return fitArea(winx, winy, screenWidth, screenHeight, scale);
+}
+
+static void renderTexture(int screenWidth,
+                          int screenHeight,
+                          SDL_Point zoom_origin,
+                          double zoom_factor,
+                          double zoom_rot) {
+	SDL_Rect dr = getDisplayArea(sdlWin, screenWidth, screenHeight);
 	SDL_Rect sr = {0, 0, screenWidth, screenHeight};
 
 	SDL_RenderClear(sdlRen);
@@ -303,6 +444,366 @@ void GFX_Flip() {
 	SDL_RenderPresent(sdlRen);
 }
 
+// nearest neighbour scaling by a whole number, each source row is expanded once and the
+// expanded row copied down for the rest of its height. N is fixed for the common scales so the
+// inner loop unrolls and vectorises.
+template <typename P, int N>
+static void scaleFrame(const uint8_t* src, int w, int h, const P* pal, uint8_t* dst, int pitch) {
+	for (int y = 0; y < h; y++) {
+		P* row = (P*)dst;
+		for (int x = 0; x < w; x++) {
+			P v = pal[src[x]];
+			for (int k = 0; k < N; k++) {
+				row[x * N + k] = v;
+			}
+		}
+		for (int k = 1; k < N; k++) {
+			memcpy(dst + k * pitch, dst, w * N * sizeof(P));
+		}
+		src += w;
+		dst += N * pitch;
+	}
+}
+
+template <typename P>
+static void scaleFrame(const uint8_t* src, int w, int h, const P* pal, uint8_t* dst, int pitch,
+                       int scale) {
+	switch (scale) {
+		case 1:
+			scaleFrame<P, 1>(src, w, h, pal, dst, pitch);
+			break;
+		case 2:
+			scaleFrame<P, 2>(src, w, h, pal, dst, pitch);
+			break;
+		case 3:
+			scaleFrame<P, 3>(src, w, h, pal, dst, pitch);
+			break;
+		case 4:
+			scaleFrame<P, 4>(src, w, h, pal, dst, pitch);
+			break;
+		default:
+			for (int y = 0; y < h; y++) {
+				P* row = (P*)dst;
+				for (int x = 0; x < w; x++) {
+					P v = pal[src[x]];
+					for (int k = 0; k < scale; k++) {
+						row[x * scale + k] = v;
+					}
+				}
+				for (int k = 1; k < scale; k++) {
+					memcpy(dst + k * pitch, dst, w * scale * sizeof(P));
+				}
+				src += w;
+				dst += scale * pitch;
+			}
+			break;
+	}
+}
+
+// the zoomed and rotated view that renderTexture draws, resampled straight from the 8 bit
+// frame. each output pixel in the display area is mapped back to the frame with the inverse
+// transform, stepped along the scanline in 16.16 fixed point so the inner loop is two adds, a
+// bounds check and a palette lookup.
+template <typename P>
+static void affineFrame(const PresentFrame& f,
+                        const P* pal,
+                        P black,
+                        const SDL_Rect& area,
+                        uint8_t* pixels,
+                        int pitch) {
+	double sx = double(area.w) / f.w * f.zoom_factor;
+	double sy = double(area.h) / f.h * f.zoom_factor;
+	double rad = f.zoom_rot * M_PI / 180.0;
+	double c = cos(rad);
+	double s = sin(rad);
+	auto fix = [](double d) { return (int32_t)floor(d * 65536.0); };
+
+	// frame position of the centre of the top left output pixel, and the steps to the next
+	// pixel across and down
+	double dx = area.x + 0.5 - (area.x + area.w / 2);
+	double dy = area.y + 0.5 - (area.y + area.h / 2);
+	int32_t u0 = fix(f.zoom_origin.x + (c * dx + s * dy) / sx);
+	int32_t v0 = fix(f.zoom_origin.y + (c * dy - s * dx) / sy);
+	int32_t dudx = fix(c / sx);
+	int32_t dvdx = fix(-s / sy);
+	int32_t dudy = fix(s / sx);
+	int32_t dvdy = fix(c / sy);
+
+	const uint8_t* src = f.pixels.data();
+	uint32_t uw = (uint32_t)f.w << 16;
+	uint32_t vh = (uint32_t)f.h << 16;
+	for (int y = 0; y < area.h; y++) {
+		P* row = (P*)(pixels + (area.y + y) * pitch) + area.x;
+		int32_t u = u0;
+		int32_t v = v0;
+		for (int x = 0; x < area.w; x++) {
+			if ((uint32_t)u < uw && (uint32_t)v < vh) {
+				row[x] = pal[src[(v >> 16) * f.w + (u >> 16)]];
+			} else {
+				row[x] = black;
+			}
+			u += dudx;
+			v += dvdx;
+		}
+		u0 += dudy;
+		v0 += dvdy;
+	}
+}
+
+// the software fast path, draws the frame straight into the window surface. an unzoomed frame
+// is scaled by the largest whole number that fits, a zoomed or rotated one is resampled into the
+// display area. the rest of the window is black. returns false for surface formats not handled
+// here, which leaves the frame to the renderer.
+static bool blitToWindowSurface(const PresentFrame& f) {
+	SDL_Surface* surface = SDL_GetWindowSurface(sdlWin);
+	if (surface == nullptr || f.w == 0 || f.h == 0) {
+		return false;
+	}
+	int bpp = surface->format->BytesPerPixel;
+	if (bpp != 2 && bpp != 4) {
+		return false;
+	}
+
+	uint32_t pal[256];
+	for (int i = 0; i < 256; i++) {
+		pixel_t p = f.palette[i];
+		uint8_t r = (p >> 11) & 0x1f;
+		uint8_t g = (p >> 5) & 0x3f;
+		uint8_t b = p & 0x1f;
+		pal[i] = SDL_MapRGB(surface->format, (r << 3) | (r >> 2), (g << 2) | (g >> 4),
+		                    (b << 3) | (b >> 2));
+	}
+	uint32_t black = SDL_MapRGB(surface->format, 0, 0, 0);
+	uint16_t pal16[256];
+	if (bpp == 2) {
+		for (int i = 0; i < 256; i++) {
+			pal16[i] = (uint16_t)pal[i];
+		}
+	}
+
+	bool zoomed = f.zoom_factor != 1.0 || f.zoom_rot != 0.0 || f.zoom_origin.x != f.w / 2 ||
+	              f.zoom_origin.y != f.h / 2;
+	int scale = std::min(surface->w / f.w, surface->h / f.h);
+	SDL_Rect area;
+	if (zoomed || scale < 1) {
+		area = fitArea(surface->w, surface->h, f.w, f.h);
+	} else {
+		area.w = f.w * scale;
+		area.h = f.h * scale;
+		area.x = (surface->w - area.w) / 2;
+		area.y = (surface->h - area.h) / 2;
+	}
+
+	// only the borders are cleared, the frame covers the rest
+	SDL_Rect borders[4] = {{0, 0, surface->w, area.y},
+	                       {0, area.y + area.h, surface->w, surface->h - area.y - area.h},
+	                       {0, area.y, area.x, area.h},
+	                       {area.x + area.w, area.y, surface->w - area.x - area.w, area.h}};
+	SDL_FillRects(surface, borders, 4, black);
+
+	if (SDL_MUSTLOCK(surface) && SDL_LockSurface(surface) < 0) {
+		return false;
+	}
+	uint8_t* pixels = (uint8_t*)surface->pixels;
+	int pitch = surface->pitch;
+	if (zoomed || scale < 1) {
+		if (bpp == 4) {
+			affineFrame<uint32_t>(f, pal, black, area, pixels, pitch);
+		} else {
+			affineFrame<uint16_t>(f, pal16, (uint16_t)black, area, pixels, pitch);
+		}
+	} else {
+		uint8_t* dst = pixels + area.y * pitch + area.x * bpp;
+		if (bpp == 4) {
+			scaleFrame<uint32_t>(f.pixels.data(), f.w, f.h, pal, dst, pitch, scale);
+		} else {
+			scaleFrame<uint16_t>(f.pixels.data(), f.w, f.h, pal16, dst, pitch, scale);
+		}
+	}
+	if (SDL_MUSTLOCK(surface)) {
+		SDL_UnlockSurface(surface);
+	}
+	SDL_UpdateWindowSurface(sdlWin);
+	return true;
+}
+
+// presents a frame kept by GFX_CopyBackBuffer, by the software fast path when it can
+static void showFrame(const PresentFrame& f) {
+	if (softwarePresent && blitToWindowSurface(f)) {
+		return;
+	}
+	if (convertToTexture(f.pixels.data(), f.w, f.h, 0, f.palette)) {
+		renderTexture(f.w, f.h, f.zoom_origin, f.zoom_factor, f.zoom_rot);
+	}
+}
+
+// call with presentMutex held
+static void countPresent(uint64_t submitted_us, uint64_t start_us) {
+	uint64_t now = TIME_GetProfileTime_us();
+	uint64_t latency = now - submitted_us;
+	presentStats.frames++;
+	presentStats.latency_us += latency;
+	presentStats.max_latency_us = std::max(presentStats.max_latency_us, latency);
+	presentStats.present_us += now - start_us;
+}
+
+static void convertLoop() {
+	{
+		std::lock_guard<std::mutex> lock(presentMutex);
+		presenterState = PresenterState::running;
+	}
+	presentCond.notify_all();
+
+	PresentFrame frame;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(presentMutex);
+			presentCond.wait(lock, [] { return framePending || presentQuit; });
+			if (presentQuit) {
+				break;
+			}
+			std::swap(frame, pendingFrame);
+			framePending = false;
+		}
+
+		frame.converted.resize(frame.w * frame.h);
+		GFX_ConvertScreenMode(frame.pixels.data(), frame.w, frame.h, 0, frame.palette.data(),
+		                      frame.converted.data(), frame.w);
+
+		std::lock_guard<std::mutex> lock(presentMutex);
+		if (frameReady) {
+			presentStats.replaced++;
+		}
+		std::swap(frame, readyFrame);
+		frameReady = true;
+	}
+}
+
+// copies converted pixels into the texture
+static bool uploadToTexture(const pixel_t* src, int w, int h) {
+	pixel_t* pixels;
+	int pitch;
+	SDL_Rect r = {0, 0, w, h};
+	if (SDL_LockTexture(sdlTex, &r, (void**)&pixels, &pitch) < 0) {
+		return false;
+	}
+	for (int y = 0; y < h; y++) {
+		memcpy((uint8_t*)pixels + y * pitch, src + y * w, w * sizeof(pixel_t));
+	}
+	SDL_UnlockTexture(sdlTex);
+	return true;
+}
+
+bool GFX_StartPresentThread() {
+	if (presenterState == PresenterState::running) {
+		return true;
+	}
+	// the software path converts as it scales into the window, there is nothing to move
+	if (softwarePresent) {
+		return false;
+	}
+
+	presentQuit = false;
+	framePending = false;
+	frameReady = false;
+	presenterState = PresenterState::starting;
+	presentThread = std::thread(convertLoop);
+	std::unique_lock<std::mutex> lock(presentMutex);
+	presentCond.wait(lock, [] { return presenterState != PresenterState::starting; });
+	return true;
+}
+
+bool GFX_UseSoftwarePresent() {
+	if (softwarePresent) {
+		return true;
+	}
+	// a window only has one renderer at a time
+	SDL_DestroyTexture(sdlTex);
+	SDL_DestroyRenderer(sdlRen);
+	softwarePresent = true;
+	sdlRen = createRenderer();
+	if (sdlRen == nullptr) {
+		logr << LogLevel::err << "no software renderer:" << SDL_GetError();
+		softwarePresent = false;
+		sdlRen = createRenderer();
+		if (sdlRen == nullptr) {
+			throw_error("SDL_CreateRenderer Error: ");
+		}
+	}
+	sdlTex = createTexture();
+	if (sdlTex == nullptr) {
+		throw_error("SDL_CreateTexture Error: ");
+	}
+	return softwarePresent;
+}
+
+static void stopPresentThread() {
+	if (presenterState != PresenterState::running) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(presentMutex);
+		presentQuit = true;
+	}
+	presentCond.notify_all();
+	presentThread.join();
+	presenterState = PresenterState::stopped;
+}
+
+void GFX_Flip() {
+	if (presenterState == PresenterState::running) {
+		gameFrame.zoom_origin = zoom_origin;
+		gameFrame.zoom_factor = zoom_factor;
+		gameFrame.zoom_rot = zoom_rot;
+		bool ready;
+		{
+			std::lock_guard<std::mutex> lock(presentMutex);
+			if (framePending) {
+				presentStats.replaced++;
+			}
+			std::swap(gameFrame, pendingFrame);
+			framePending = true;
+			// the frame before this one, converted while the game ran
+			ready = frameReady;
+			if (ready) {
+				std::swap(readyFrame, shownFrame);
+				frameReady = false;
+			}
+		}
+		presentCond.notify_one();
+
+		if (ready) {
+			const PresentFrame& f = shownFrame;
+			uint64_t start = TIME_GetProfileTime_us();
+			if (uploadToTexture(f.converted.data(), f.w, f.h)) {
+				renderTexture(f.w, f.h, f.zoom_origin, f.zoom_factor, f.zoom_rot);
+			}
+			std::lock_guard<std::mutex> lock(presentMutex);
+			countPresent(f.submitted_us, start);
+		}
+		return;
+	}
+
+	uint64_t start = TIME_GetProfileTime_us();
+	if (softwarePresent) {
+		gameFrame.zoom_origin = zoom_origin;
+		gameFrame.zoom_factor = zoom_factor;
+		gameFrame.zoom_rot = zoom_rot;
+		showFrame(gameFrame);
+	} else {
+		renderTexture(screenWidth, screenHeight, zoom_origin, zoom_factor, zoom_rot);
+	}
+	std::lock_guard<std::mutex> lock(presentMutex);
+	countPresent(copySubmitted_us, start);
+}
+
+PresentStats GFX_GetPresentStats() {
+	std::lock_guard<std::mutex> lock(presentMutex);
+	PresentStats stats = presentStats;
+	presentStats = PresentStats();
+	return stats;
+}
+
 static uint8_t keyState = 0;
 static uint8_t joyState = 0;
 static uint8_t hatState = 0;
@@ -438,6 +939,27 @@ bool INP_ProcessInputEvents(const SDL_Event& ev) {
 		reload_requested = true;
 		return true;
 	}
+	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_F5) {
+		save_state_requested = true;
+		return true;
+	}
+	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_F6) {
+		screenshot_requested = true;
+		return true;
+	}
+	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_F7) {
+		load_state_requested = true;
+		return true;
+	}
+	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_F9) {
+		save_gif_requested = true;
+		return true;
+	}
+	if ((ev.type == SDL_KEYDOWN || ev.type == SDL_KEYUP) &&
+	    ev.key.keysym.sym == SDLK_BACKSPACE && !SDL_IsTextInputActive()) {
+		rewind_held = ev.type == SDL_KEYDOWN;
+		return true;
+	}
 	if (ev.type == SDL_KEYDOWN || ev.type == SDL_KEYUP) {
 		set_state_bit(keyState, 0, ev.key.keysym.sym == SDLK_LEFT, ev.type == SDL_KEYDOWN);
 		set_state_bit(keyState, 1, ev.key.keysym.sym == SDLK_RIGHT, ev.type == SDL_KEYDOWN);
@@ -498,12 +1020,29 @@ void INP_SetSimState(uint8_t state) {
 	simState = state;
 }
 
+// when enabled, game time only moves when advanced by the caller. used for offline rendering
+// where frames are run as fast as possible but must see the same time as a real time run.
+static bool virtualClock = false;
+static uint64_t virtualTime_us = 0;
+
+void TIME_UseVirtualClock(bool enable) {
+	virtualClock = enable;
+	virtualTime_us = 0;
+}
+
+void TIME_AdvanceVirtualClock(uint64_t us) {
+	virtualTime_us += us;
+}
+
 uint32_t TIME_GetTime_ms() {
+	if (virtualClock) {
+		return (uint32_t)(virtualTime_us / 1000);
+	}
 	return SDL_GetTicks();
 }
 
 uint32_t TIME_GetElapsedTime_ms(uint32_t start) {
-	return SDL_GetTicks() - start;
+	return TIME_GetTime_ms() - start;
 }
 
 uint64_t TIME_GetProfileTime() {
@@ -520,13 +1059,20 @@ uint64_t TIME_GetElapsedProfileTime_ms(uint64_t start) {
 	return ((now - start) * 1000) / SDL_GetPerformanceFrequency();
 }
 
+uint64_t TIME_GetProfileTime_us() {
+	// split so the counter times a million does not overflow
+	uint64_t now = SDL_GetPerformanceCounter();
+	uint64_t freq = SDL_GetPerformanceFrequency();
+	return (now / freq) * 1000000 + ((now % freq) * 1000000) / freq;
+}
+
 void TIME_Sleep(int ms) {
 	SDL_Delay(ms);
 }
 
 static void scaleMouse(int& x, int& y) {
 	double scale;
-	SDL_Rect r = getDisplayArea(sdlWin, &scale);
+	SDL_Rect r = getDisplayArea(sdlWin, screenWidth, screenHeight, &scale);
 	x -= r.x;
 	y -= r.y;
 	x = (int)(x / scale);
@@ -566,10 +1112,169 @@ std::string FILE_LoadFile(std::string name) {
 	return data;
 }
 
+static const std::string& getPrefPath() {
+	static std::string prefPath;
+	if (prefPath.empty()) {
+		const char* path = SDL_GetPrefPath("0xcafed00d", "tac08");
+		if (path) {
+			prefPath = path;
+			SDL_free((void*)path);
+		}
+	}
+	return prefPath;
+}
+
+// writes to a temp file first and renames over the original, so a crash or power loss
+// mid write never leaves a truncated save behind.
+bool FILE_WriteFileAtomic(const std::string& name, const std::string& data) {
+	std::string tmpName = name + ".tmp";
+	SDL_RWops* file = SDL_RWFromFile(tmpName.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+	bool ok = SDL_RWwrite(file, data.c_str(), 1, data.length()) == data.length();
+	ok = (SDL_RWclose(file) == 0) && ok;
+	if (ok && rename(tmpName.c_str(), name.c_str()) != 0) {
+		// windows will not rename over an existing file
+		remove(name.c_str());
+		ok = rename(tmpName.c_str(), name.c_str()) == 0;
+	}
+	if (!ok) {
+		remove(tmpName.c_str());
+	}
+	return ok;
+}
+
+// game state saves are handed to a background thread so frequent saves (eg. dset every frame)
+// never block the game loop on file io. repeated saves to the same file within the save delay
+// are coalesced into a single write of the latest data.
+namespace {
+	struct PendingWrite {
+		std::string data;
+		std::chrono::steady_clock::time_point due;
+	};
+
+	std::mutex writerMutex;
+	std::condition_variable writerCond;
+	std::condition_variable writerIdleCond;
+	std::map<std::string, PendingWrite> pendingWrites;
+	std::thread writerThread;
+	bool writerBusy = false;
+	bool writerQuit = false;
+	bool writerFlush = false;
+	std::vector<std::string> failedWrites;
+
+	void writerMain() {
+		std::unique_lock<std::mutex> lock(writerMutex);
+		while (true) {
+			if (pendingWrites.empty()) {
+				writerFlush = false;
+				writerIdleCond.notify_all();
+				if (writerQuit) {
+					return;
+				}
+				writerCond.wait(lock);
+				continue;
+			}
+
+			auto next = pendingWrites.begin();
+			for (auto i = pendingWrites.begin(); i != pendingWrites.end(); ++i) {
+				if (i->second.due < next->second.due) {
+					next = i;
+				}
+			}
+			if (!writerFlush && !writerQuit &&
+			    next->second.due > std::chrono::steady_clock::now()) {
+				writerCond.wait_until(lock, next->second.due);
+				continue;
+			}
+
+			std::string name = next->first;
+			std::string data = std::move(next->second.data);
+			pendingWrites.erase(next);
+
+			writerBusy = true;
+			lock.unlock();
+			bool ok = FILE_WriteFileAtomic(name, data);
+			lock.lock();
+			writerBusy = false;
+			if (!ok) {
+				failedWrites.push_back(name);
+			}
+		}
+	}
+
+	int getSaveDelay() {
+		const char* val = SDL_GetHint("TAC08_CARTDATA_SAVE_DELAY");
+		return val ? atoi(val) : config::CARTDATA_SAVE_DELAY_MS;
+	}
+
+	// logging is not thread safe, so failures are reported from the game thread
+	void logFailedWrites() {
+		for (auto& name : failedWrites) {
+			logr << LogLevel::err << "failed to write file: " << name;
+		}
+		failedWrites.clear();
+	}
+}  // namespace
+
+std::string FILE_GetPrefPath() {
+	return getPrefPath();
+}
+
+// maps a whole file read only. returns nullptr if the file does not exist or is empty.
+const uint8_t* FILE_MapFile(const std::string& name, size_t& size) {
+	size = 0;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+	                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	LARGE_INTEGER fileSize;
+	void* data = nullptr;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping) {
+			data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+			size = data ? (size_t)fileSize.QuadPart : 0;
+		}
+	}
+	CloseHandle(file);
+	return (const uint8_t*)data;
+#else
+	int fd = open(name.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+	struct stat st;
+	void* data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) {
+		return nullptr;
+	}
+	size = st.st_size;
+	return (const uint8_t*)data;
+#endif
+}
+
+void FILE_UnmapFile(const uint8_t* data, size_t size) {
+	if (data) {
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap((void*)data, size);
+#endif
+	}
+}
+
 std::string FILE_LoadGameState(std::string name) {
-	const char* path = SDL_GetPrefPath("0xcafed00d", "tac08");
-	name = std::string(path) + name;
-	SDL_free((void*)path);
+	name = getPrefPath() + name;
+	FILE_FlushGameState();
 
 	return FILE_LoadFile(name);
 }
@@ -577,20 +1282,63 @@ std::string FILE_LoadGameState(std::string name) {
 void FILE_SaveGameState(std::string name, std::string data) {
 	encrypt(data);
 
-	const char* path = SDL_GetPrefPath("0xcafed00d", "tac08");
-	name = std::string(path) + name;
-	SDL_free((void*)path);
+	name = getPrefPath() + name;
 
 	logr << "writing file: " << name << " bytes: " << data.length();
 
-	SDL_RWops* file = SDL_RWFromFile(name.c_str(), "w");
-	if (file) {
-		SDL_RWwrite(file, data.c_str(), data.length(), 1);
-		SDL_RWclose(file);
+	if (FILE_WriteFileAtomic(name, data)) {
 		logr << "    file writen ";
 	}
 }
 
+void FILE_QueueGameState(std::string name, std::string data) {
+	static const int saveDelay = getSaveDelay();
+
+	encrypt(data);
+	name = getPrefPath() + name;
+
+	std::lock_guard<std::mutex> lock(writerMutex);
+	logFailedWrites();
+	if (!writerThread.joinable()) {
+		writerQuit = false;
+		writerThread = std::thread(writerMain);
+	}
+
+	auto i = pendingWrites.find(name);
+	if (i != pendingWrites.end()) {
+		// keep the original deadline so continuous saves are still written periodically
+		i->second.data = std::move(data);
+	} else {
+		pendingWrites[name] = PendingWrite{
+		    std::move(data),
+		    std::chrono::steady_clock::now() + std::chrono::milliseconds(saveDelay)};
+	}
+	writerCond.notify_one();
+}
+
+void FILE_FlushGameState() {
+	std::unique_lock<std::mutex> lock(writerMutex);
+	if (writerThread.joinable()) {
+		writerFlush = true;
+		writerCond.notify_one();
+		writerIdleCond.wait(lock, [] { return pendingWrites.empty() && !writerBusy; });
+	}
+	logFailedWrites();
+}
+
+void FILE_Shutdown() {
+	TraceFunction();
+	{
+		std::lock_guard<std::mutex> lock(writerMutex);
+		writerQuit = true;
+		writerCond.notify_one();
+	}
+	if (writerThread.joinable()) {
+		writerThread.join();
+	}
+	logFailedWrites();
+}
+
 std::string FILE_ReadClip() {
 	std::string res;
 	if (SDL_HasClipboardText()) {
@@ -618,6 +1366,10 @@ std::string FILE_GetDefaultCartName() {
 void HAL_StartFrame() {
 	simState = 0;
 	reload_requested = false;
+	save_state_requested = false;
+	load_state_requested = false;
+	save_gif_requested = false;
+	screenshot_requested = false;
 }
 
 void HAL_EndFrame() {
@@ -682,3 +1434,24 @@ void DEBUG_Trace(bool enable) {
 bool DEBUG_ReloadRequested() {
 	return reload_requested;
 }
+
+bool DEBUG_SaveStateRequested() {
+	return save_state_requested;
+}
+
+bool DEBUG_LoadStateRequested() {
+	return load_state_requested;
+}
+
+bool DEBUG_SaveGifRequested() {
+	return save_gif_requested;
+}
+
+bool DEBUG_ScreenshotRequested() {
+	return screenshot_requested;
+}
+
+// true while the rewind key is held
+bool DEBUG_RewindRequested() {
+	return rewind_held;
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 
+#include <array>
 #include <stdexcept>
 
 #include "log.h"
@@ -19,11 +20,36 @@ void GFX_Init(int x, int y);
 void GFX_End();
 
 void GFX_CreateBackBuffer(int x, int y);
-void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h);
+// copies the frame for presenting, applying the 0x5f2c screen mode, see hal_screenmode.h
+void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h, uint8_t screenMode);
 void GFX_SetBackBufferSize(int x, int y);
 
 void GFX_Flip();
 
+// presents through sdl's software renderer, for machines without a usable gpu. frames that are
+// not zoomed or rotated skip the renderer and are scaled by a whole number straight into the
+// window surface. chosen automatically when sdl only offers a software renderer. call before
+// GFX_StartPresentThread, returns false if there is no software renderer.
+bool GFX_UseSoftwarePresent();
+
+// moves the conversion of each frame to texture pixels to a thread of its own so it overlaps with
+// the next game frame. GFX_Flip then hands the frame over and uploads and presents the one before
+// it, which adds a frame of latency. sdl only supports rendering from the main thread, so the
+// present stays on the calling thread. returns false with the software present, which converts
+// as it scales.
+bool GFX_StartPresentThread();
+
+struct PresentStats {
+	uint32_t frames = 0;    // frames presented
+	uint32_t replaced = 0;  // frames handed over but replaced by a newer one before presenting
+	uint64_t latency_us = 0;  // total time from GFX_CopyBackBuffer to the end of the present
+	uint64_t max_latency_us = 0;
+	uint64_t present_us = 0;  // total time the flip spent converting, uploading and presenting
+};
+
+// the present counters since the last call
+PresentStats GFX_GetPresentStats();
+
 void GFX_SelectPalette(const std::string& name);
 
 void GFX_MapPaletteIndex(uint8_t to, uint8_t from);
@@ -34,6 +60,15 @@ void GFX_RestorePaletteRGB();
 void GFX_RestorePaletteRGBIndex(uint8_t i);
 void GFX_SetPaletteRGBIndex(uint8_t i, uint8_t r, uint8_t g, uint8_t b);
 
+struct PaletteState {
+	std::string name;
+	std::array<pixel_t, 256> rgb;     // colour of each index, including setpal() changes
+	std::array<pixel_t, 256> mapped;  // screen palette, including pal(c0, c1, 1) changes
+};
+
+PaletteState GFX_GetPaletteState();
+void GFX_SetPaletteState(const PaletteState& state);
+
 void GFX_ShowHWMouse(bool show);
 void GFX_GetDisplayArea(int* w, int* h);
 void GFX_ToggleFullScreen();
@@ -43,6 +78,13 @@ void GFX_SetZoom(int x, int y, double factor, double rot);
 std::string FILE_LoadFile(std::string name);
 std::string FILE_LoadGameState(std::string name);
 void FILE_SaveGameState(std::string name, std::string data);
+void FILE_QueueGameState(std::string name, std::string data);
+void FILE_FlushGameState();
+void FILE_Shutdown();
+std::string FILE_GetPrefPath();
+bool FILE_WriteFileAtomic(const std::string& name, const std::string& data);
+const uint8_t* FILE_MapFile(const std::string& name, size_t& size);
+void FILE_UnmapFile(const uint8_t* data, size_t size);
 std::string FILE_ReadClip();
 void FILE_WriteClip(const std::string& data);
 std::string FILE_GetDefaultCartName();
@@ -57,7 +99,11 @@ uint32_t TIME_GetElapsedTime_ms(uint32_t start);
 uint64_t TIME_GetProfileTime();
 uint64_t TIME_GetElapsedProfileTime_us(uint64_t start);
 uint64_t TIME_GetElapsedProfileTime_ms(uint64_t start);
+// the profile clock in microseconds, for timing against deadlines
+uint64_t TIME_GetProfileTime_us();
 void TIME_Sleep(int ms);
+void TIME_UseVirtualClock(bool enable);
+void TIME_AdvanceVirtualClock(uint64_t us);
 
 void SYSLOG_LogMessage(LogLevel l, const char* msg);
 
@@ -92,5 +138,10 @@ void PLATFORM_OpenURL(std::string url);
 bool DEBUG_Trace();
 void DEBUG_Trace(bool enable);
 bool DEBUG_ReloadRequested();
+bool DEBUG_SaveStateRequested();
+bool DEBUG_LoadStateRequested();
+bool DEBUG_SaveGifRequested();
+bool DEBUG_ScreenshotRequested();
+bool DEBUG_RewindRequested();
 
 #endif /* GFX_CORE_H */
@@ -0,0 +1,543 @@
+// a hal with no window, input or sound output, for running carts without sdl. it is thread safe
+// so many machines can share it, state that belongs to a running cart is kept per thread and is
+// carried from thread to thread with the machine, see pico_machine.cpp
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "crypt.h"
+#include "hal_audio.h"
+#include "hal_core.h"
+#include "hal_palette.h"
+#include "hal_screenmode.h"
+#include "log.h"
+
+static thread_local std::array<pixel_t, 256> original_palette;
+static thread_local std::array<pixel_t, 256> palette;
+// set when palette differs from original_palette, so restoring an unmapped palette is free
+static thread_local bool paletteMapped = false;
+static thread_local std::string selectedPalette;
+
+// the frame as the sdl hal would upload it, nothing shows it but it keeps the cost of
+// presenting a frame measurable
+static thread_local std::vector<pixel_t> backbuffer;
+
+static thread_local uint8_t simState = 0;
+static thread_local bool virtualClock = false;
+static thread_local uint64_t virtualTime_us = 0;
+
+static thread_local uint32_t target_fps = 30;
+static thread_local uint32_t actual_fps = 30;
+static thread_local uint32_t sys_fps = 60;
+static thread_local uint32_t cpu_usage = 0;
+
+static std::mutex logMutex;
+
+void SYSLOG_LogMessage(LogLevel l, const char* msg) {
+	const char* prefix = "";
+	switch (l) {
+		case LogLevel::info:
+			prefix = "DEBUG";
+			break;
+		case LogLevel::perf:
+			prefix = " PERF";
+			break;
+		case LogLevel::err:
+			prefix = " FAIL";
+			break;
+		case LogLevel::trace:
+			prefix = "TRACE";
+			break;
+		case LogLevel::apitrace:
+			prefix = "  API";
+			break;
+	}
+	std::lock_guard<std::mutex> lock(logMutex);
+	fprintf(stderr, "%s: %s\n", prefix, msg);
+}
+
+void checkmem() {
+}
+
+void GFX_Init(int x, int y) {
+	GFX_CreateBackBuffer(x, y);
+}
+
+void GFX_End() {
+}
+
+// rgb565, the same format the sdl hal renders to
+static pixel_t GFX_GetPixel(uint8_t r, uint8_t g, uint8_t b) {
+	return (pixel_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+void GFX_CreateBackBuffer(int x, int y) {
+	GFX_SelectPalette("pico8");
+}
+
+void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h, uint8_t screenMode) {
+	size_t size = (size_t)buffer_w * buffer_h;
+	if (backbuffer.size() < size) {
+		backbuffer.resize(size);
+	}
+	GFX_ConvertScreenMode(buffer, buffer_w, buffer_h, screenMode, palette.data(),
+	                      backbuffer.data(), buffer_w);
+}
+
+void GFX_SetBackBufferSize(int x, int y) {
+	backbuffer.resize((size_t)x * y);
+}
+
+void GFX_Flip() {
+}
+
+bool GFX_UseSoftwarePresent() {
+	return false;
+}
+
+bool GFX_StartPresentThread() {
+	return false;
+}
+
+PresentStats GFX_GetPresentStats() {
+	return PresentStats();
+}
+
+void GFX_SelectPalette(const std::string& name) {
+	auto& pal = GFX_GetPaletteInfo(name);
+	selectedPalette = name;
+
+	for (size_t i = 0; i < pal.size; i++) {
+		auto p = pal.pal[i];
+		pixel_t pix = GFX_GetPixel((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff);
+		original_palette[i] = pix;
+		palette[i] = pix;
+	}
+	paletteMapped = false;
+}
+
+void GFX_MapPaletteIndex(uint8_t to, uint8_t from) {
+	palette[to] = original_palette[from];
+	paletteMapped = true;
+}
+
+void GFX_RestorePaletteMapping() {
+	if (paletteMapped) {
+		palette = original_palette;
+		paletteMapped = false;
+	}
+}
+
+void GFX_RestorePaletteMappingIndex(uint8_t i) {
+	palette[i] = original_palette[i];
+}
+
+void GFX_RestorePaletteRGB() {
+	GFX_SelectPalette(selectedPalette);
+}
+
+void GFX_RestorePaletteRGBIndex(uint8_t i) {
+	auto& pal = GFX_GetPaletteInfo(selectedPalette);
+	if (i < pal.size) {
+		auto p = pal.pal[i];
+		pixel_t pix = GFX_GetPixel((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff);
+		original_palette[i] = pix;
+		palette[i] = pix;
+	}
+}
+
+void GFX_SetPaletteRGBIndex(uint8_t i, uint8_t r, uint8_t g, uint8_t b) {
+	palette[i] = GFX_GetPixel(r, g, b);
+	original_palette[i] = palette[i];
+}
+
+PaletteState GFX_GetPaletteState() {
+	PaletteState state;
+	state.name = selectedPalette;
+	state.rgb = original_palette;
+	state.mapped = palette;
+	return state;
+}
+
+void GFX_SetPaletteState(const PaletteState& state) {
+	selectedPalette = state.name;
+	original_palette = state.rgb;
+	palette = state.mapped;
+	paletteMapped = palette != original_palette;
+}
+
+void GFX_ShowHWMouse(bool show) {
+}
+
+void GFX_GetDisplayArea(int* w, int* h) {
+	*w = config::INIT_SCREEN_WIDTH;
+	*h = config::INIT_SCREEN_HEIGHT;
+}
+
+void GFX_ToggleFullScreen() {
+}
+
+void GFX_SetFullScreen(bool fullscreen) {
+}
+
+void GFX_SetZoom(int x, int y, double factor, double rot) {
+}
+
+bool INP_TouchAvailable() {
+	return false;
+}
+
+uint8_t INP_GetTouchMask() {
+	return 0;
+}
+
+TouchInfo INP_GetTouchInfo(int idx) {
+	return TouchInfo();
+}
+
+std::string INP_GetKeyPress() {
+	return "";
+}
+
+bool EVT_ProcessEvents() {
+	return true;
+}
+
+uint8_t INP_GetInputState() {
+	return simState;
+}
+
+void INP_SetSimState(uint8_t state) {
+	simState = state;
+}
+
+MouseState INP_GetMouseState() {
+	return MouseState{0, 0, 0, 0};
+}
+
+void TIME_UseVirtualClock(bool enable) {
+	virtualClock = enable;
+	virtualTime_us = 0;
+}
+
+void TIME_AdvanceVirtualClock(uint64_t us) {
+	virtualTime_us += us;
+}
+
+uint64_t TIME_GetProfileTime() {
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t TIME_GetElapsedProfileTime_us(uint64_t start) {
+	return TIME_GetProfileTime() - start;
+}
+
+uint64_t TIME_GetElapsedProfileTime_ms(uint64_t start) {
+	return TIME_GetElapsedProfileTime_us(start) / 1000;
+}
+
+uint64_t TIME_GetProfileTime_us() {
+	return TIME_GetProfileTime();
+}
+
+uint32_t TIME_GetTime_ms() {
+	if (virtualClock) {
+		return (uint32_t)(virtualTime_us / 1000);
+	}
+	return (uint32_t)(TIME_GetProfileTime() / 1000);
+}
+
+uint32_t TIME_GetElapsedTime_ms(uint32_t start) {
+	return TIME_GetTime_ms() - start;
+}
+
+void TIME_Sleep(int ms) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+std::string FILE_LoadFile(std::string name) {
+	std::string data;
+	FILE* file = fopen(name.c_str(), "rb");
+	if (file) {
+		char buf[4096];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+			data.append(buf, n);
+		}
+		fclose(file);
+	}
+	decrypt(data);
+	return data;
+}
+
+bool FILE_WriteFileAtomic(const std::string& name, const std::string& data) {
+	std::string tmpName = name + ".tmp";
+	FILE* file = fopen(tmpName.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+	bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+	ok = (fclose(file) == 0) && ok;
+	if (ok && rename(tmpName.c_str(), name.c_str()) != 0) {
+		// windows will not rename over an existing file
+		remove(name.c_str());
+		ok = rename(tmpName.c_str(), name.c_str()) == 0;
+	}
+	if (!ok) {
+		remove(tmpName.c_str());
+	}
+	return ok;
+}
+
+// saves go to the working directory
+std::string FILE_GetPrefPath() {
+	return "";
+}
+
+// read into memory rather than mapped, the data is freed by FILE_UnmapFile.
+const uint8_t* FILE_MapFile(const std::string& name, size_t& size) {
+	size = 0;
+	FILE* file = fopen(name.c_str(), "rb");
+	if (!file) {
+		return nullptr;
+	}
+	std::vector<uint8_t> data;
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+		data.insert(data.end(), buf, buf + n);
+	}
+	fclose(file);
+	if (data.empty()) {
+		return nullptr;
+	}
+	uint8_t* res = new uint8_t[data.size()];
+	std::copy(data.begin(), data.end(), res);
+	size = data.size();
+	return res;
+}
+
+void FILE_UnmapFile(const uint8_t* data, size_t size) {
+	delete[] data;
+}
+
+std::string FILE_LoadGameState(std::string name) {
+	return FILE_LoadFile(FILE_GetPrefPath() + name);
+}
+
+void FILE_SaveGameState(std::string name, std::string data) {
+	encrypt(data);
+	if (!FILE_WriteFileAtomic(FILE_GetPrefPath() + name, data)) {
+		logr << LogLevel::err << "failed to write file: " << name;
+	}
+}
+
+// there is no frame loop to keep smooth, so queued saves are written straight away
+void FILE_QueueGameState(std::string name, std::string data) {
+	FILE_SaveGameState(name, data);
+}
+
+void FILE_FlushGameState() {
+}
+
+void FILE_Shutdown() {
+}
+
+std::string FILE_ReadClip() {
+	return "";
+}
+
+void FILE_WriteClip(const std::string& data) {
+}
+
+std::string FILE_GetDefaultCartName() {
+	return "cart.p8";
+}
+
+void HAL_StartFrame() {
+	simState = 0;
+}
+
+void HAL_EndFrame() {
+}
+
+void HAL_SetFrameRates(uint32_t target, uint32_t actual, uint32_t sys, uint32_t cpu) {
+	target_fps = target;
+	actual_fps = actual;
+	sys_fps = sys;
+	cpu_usage = cpu;
+}
+
+// 't' = target, 'a' = actual, 's' = sys
+uint32_t HAL_GetFrameRate(char fps_type) {
+	switch (fps_type) {
+		case 't':
+			return target_fps;
+		case 'a':
+			return actual_fps;
+		case 's':
+			return sys_fps;
+		case 'c':
+			return cpu_usage;
+	}
+	return 0;
+}
+
+void PLATFORM_OpenURL(std::string url) {
+}
+
+bool DEBUG_Trace() {
+	return false;
+}
+
+void DEBUG_Trace(bool enable) {
+}
+
+bool DEBUG_ReloadRequested() {
+	return false;
+}
+
+bool DEBUG_SaveStateRequested() {
+	return false;
+}
+
+bool DEBUG_LoadStateRequested() {
+	return false;
+}
+
+bool DEBUG_SaveGifRequested() {
+	return false;
+}
+
+bool DEBUG_ScreenshotRequested() {
+	return false;
+}
+
+bool DEBUG_RewindRequested() {
+	return false;
+}
+
+// wavs are only registered so sfx ids stay stable, nothing is decoded or played. sounds end as
+// soon as they start unless they loop, so carts waiting on a channel are not held up.
+
+struct HeadlessWav {
+	std::string name;
+	bool trim;
+	bool pack;
+};
+
+static std::mutex wavMutex;
+static std::vector<HeadlessWav> loadedWavs;
+static thread_local std::array<AudioChannelState, config::AUDIO_CHANNELS> channels;
+
+void AUDIO_Init() {
+}
+
+void AUDIO_Shutdown() {
+}
+
+void AUDIO_InitRender(const char* filename) {
+}
+
+void AUDIO_RenderFrame(int fps) {
+}
+
+bool AUDIO_IsRendering() {
+	return false;
+}
+
+int AUDIO_LoadWav(const char* name, bool trim, bool pack) {
+	FILE* file = fopen(name, "rb");
+	if (!file) {
+		throw audio_exception(std::string("failed to open wav: ") + name);
+	}
+	fclose(file);
+
+	std::lock_guard<std::mutex> lock(wavMutex);
+	for (size_t n = 0; n < loadedWavs.size(); n++) {
+		if (loadedWavs[n].name == name && loadedWavs[n].trim == trim &&
+		    loadedWavs[n].pack == pack) {
+			return (int)n;
+		}
+	}
+	loadedWavs.push_back(HeadlessWav{name, trim, pack});
+	return (int)loadedWavs.size() - 1;
+}
+
+static void play(int id, int chan, bool loop) {
+	if (chan < 0 || chan >= (int)channels.size()) {
+		return;
+	}
+	AudioChannelState state;
+	if (loop) {
+		std::lock_guard<std::mutex> lock(wavMutex);
+		if (id >= 0 && id < (int)loadedWavs.size()) {
+			state.wav = loadedWavs[id].name;
+			state.trim = loadedWavs[id].trim;
+			state.pack = loadedWavs[id].pack;
+			state.loop = true;
+		}
+	}
+	channels[chan] = state;
+}
+
+void AUDIO_Play(int id, int chan, bool loop) {
+	play(id, chan, loop);
+}
+
+void AUDIO_Play(int id, int chan, int start, int end, bool loop) {
+	play(id, chan, loop);
+}
+
+void AUDIO_Play(int id, int chan, int loop_start, int loop_end) {
+	play(id, chan, true);
+}
+
+void AUDIO_StopAll() {
+	channels.fill(AudioChannelState());
+}
+
+void AUDIO_Stop(int chan) {
+	if (chan >= 0 && chan < (int)channels.size()) {
+		channels[chan] = AudioChannelState();
+	}
+}
+
+void AUDIO_StopLoop(int chan) {
+	AUDIO_Stop(chan);
+}
+
+bool AUDIO_isPlaying(int chan) {
+	return chan >= 0 && chan < (int)channels.size() && !channels[chan].wav.empty();
+}
+
+int AUDIO_AvailableChan(bool force) {
+	for (int c = 0; c < (int)channels.size(); c++) {
+		if (!AUDIO_isPlaying(c)) {
+			return c;
+		}
+	}
+	return force ? 0 : -1;
+}
+
+AudioChannelState AUDIO_GetChannelState(int chan) {
+	if (chan >= 0 && chan < (int)channels.size()) {
+		return channels[chan];
+	}
+	return AudioChannelState();
+}
+
+void AUDIO_SetChannelState(int chan, const AudioChannelState& state) {
+	if (chan >= 0 && chan < (int)channels.size()) {
+		channels[chan] = state;
+	}
+}
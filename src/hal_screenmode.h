@@ -0,0 +1,100 @@
+#ifndef HAL_SCREENMODE_H
+#define HAL_SCREENMODE_H
+
+#include <stdint.h>
+
+// pico-8's 0x5f2c screen modes, applied as a frame is copied out of the backbuffer so they cost
+// the cart nothing:
+//   1, 2, 3        stretch the left half, top half or top left quarter over the whole screen
+//   5, 6, 7        mirror the left half to the right, the top half to the bottom, or both
+//   129, 130, 131  flip horizontally, vertically or both
+//   133, 134, 135  rotate 90, 180 or 270 degrees clockwise, square screens only
+// other values show the screen as it is.
+
+enum class ScreenAxisMode { none, stretch, mirror, flip };
+
+inline ScreenAxisMode GFX_ScreenAxisMode(uint8_t mode, uint8_t axisBit) {
+	if ((mode & axisBit) == 0) {
+		return ScreenAxisMode::none;
+	}
+	if (mode & 0x80) {
+		return ScreenAxisMode::flip;
+	}
+	return (mode & 4) ? ScreenAxisMode::mirror : ScreenAxisMode::stretch;
+}
+
+inline int GFX_ScreenModeSource(ScreenAxisMode m, int i, int size) {
+	switch (m) {
+		case ScreenAxisMode::stretch:
+			return i / 2;
+		case ScreenAxisMode::mirror:
+			return i < (size + 1) / 2 ? i : size - 1 - i;
+		case ScreenAxisMode::flip:
+			return size - 1 - i;
+		default:
+			return i;
+	}
+}
+
+// converts a w x h frame of colour indexes through pal into dst, pitch is in pixels
+template <typename P>
+void GFX_ConvertScreenMode(const uint8_t* src,
+                           int w,
+                           int h,
+                           uint8_t mode,
+                           const P* pal,
+                           P* dst,
+                           int pitch) {
+	if ((mode & 0x84) == 0x84) {
+		int rotation = w == h ? mode & 3 : 0;
+		if (rotation == 1 || rotation == 3) {
+			for (int y = 0; y < h; y++) {
+				for (int x = 0; x < w; x++) {
+					int sx = rotation == 1 ? y : w - 1 - y;
+					int sy = rotation == 1 ? h - 1 - x : x;
+					dst[x] = pal[src[sy * w + sx]];
+				}
+				dst += pitch;
+			}
+			return;
+		}
+		// a half turn is a flip on both axes
+		mode = rotation == 2 ? 0x83 : 0;
+	}
+
+	ScreenAxisMode hmode = GFX_ScreenAxisMode(mode, 1);
+	ScreenAxisMode vmode = GFX_ScreenAxisMode(mode, 2);
+	for (int y = 0; y < h; y++) {
+		const uint8_t* row = src + GFX_ScreenModeSource(vmode, y, h) * w;
+		switch (hmode) {
+			case ScreenAxisMode::none:
+				for (int x = 0; x < w; x++) {
+					dst[x] = pal[row[x]];
+				}
+				break;
+			case ScreenAxisMode::stretch:
+				for (int x = 0; x < w; x++) {
+					dst[x] = pal[row[x >> 1]];
+				}
+				break;
+			case ScreenAxisMode::mirror: {
+				int half = (w + 1) / 2;
+				for (int x = 0; x < half; x++) {
+					dst[x] = pal[row[x]];
+				}
+				for (int x = half; x < w; x++) {
+					dst[x] = pal[row[w - 1 - x]];
+				}
+				break;
+			}
+			case ScreenAxisMode::flip:
+				for (int x = 0; x < w; x++) {
+					dst[x] = pal[row[w - 1 - x]];
+				}
+				break;
+		}
+		dst += pitch;
+	}
+}
+
+#endif /* HAL_SCREENMODE_H */
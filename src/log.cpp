@@ -1,3 +1,3 @@
 #include "log.h"
 
-Logger logr;
+thread_local Logger logr;
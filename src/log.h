@@ -69,6 +69,13 @@ class Logger {
 		m_outputFunc = outFunc;
 	}
 
+	// loggers are per thread, new threads take their settings from the thread that started them
+	void copySettings(const Logger& from) {
+		m_enabled = from.m_enabled;
+		m_logfilter = from.m_logfilter;
+		m_outputFunc = from.m_outputFunc;
+	}
+
 	void setOutputFilter(LogLevel l, bool on) {
 		uint32_t n = (uint32_t)l;
 		if (on) {
@@ -104,7 +111,7 @@ class Logger {
 	std::function<void(LogLevel, const char*)> m_outputFunc;
 };
 
-extern Logger logr;
+extern thread_local Logger logr;
 
 class logr_trace_func__ {
 	const char* fname;
@@ -5,19 +5,92 @@
 #include "hal_core.h"
 #include "log.h"
 #include "pico_audio.h"
+#include "pico_capture.h"
 #include "pico_cart.h"
 #include "pico_core.h"
 #include "pico_data.h"
+#include "pico_loop.h"
+#include "pico_rewind.h"
 #include "pico_script.h"
 
+// offline audio render. when TAC08_AUDIO_RENDER_FILE is set the game runs unthrottled against a
+// virtual clock and the mixed audio is written to that file instead of played. rendering stops
+// after TAC08_AUDIO_RENDER_FRAMES game frames, or runs until the window is closed if not set.
+static const char* getRenderFile() {
+	return SDL_GetHint("TAC08_AUDIO_RENDER_FILE");
+}
+
+static uint32_t getRenderFrames() {
+	const char* val = SDL_GetHint("TAC08_AUDIO_RENDER_FRAMES");
+	return val ? (uint32_t)strtoul(val, nullptr, 10) : 0;
+}
+
+// bytes of rewind history, 0 turns rewinding off.
+static size_t getRewindBufferSize() {
+	const char* val = SDL_GetHint("TAC08_REWIND_BUFFER_SIZE");
+	return val ? (size_t)strtoul(val, nullptr, 10) : config::REWIND_BUFFER_SIZE;
+}
+
+// frame pacing. TAC08_FRAME_CATCHUP is the most game frames run back to back when the game
+// falls behind, TAC08_FRAME_SKIP=0 draws each of them rather than just the last one.
+// TAC08_PRESENT_ALWAYS=1 presents on every vsync like older versions instead of only when there
+// is a new game frame, sleeping until it is due.
+static int getFrameCatchUp() {
+	const char* val = SDL_GetHint("TAC08_FRAME_CATCHUP");
+	return val ? atoi(val) : config::FRAME_MAX_CATCHUP;
+}
+
+static bool getFrameSkip() {
+	return SDL_GetHintBoolean("TAC08_FRAME_SKIP", SDL_TRUE);
+}
+
+static bool getPresentAlways() {
+	return SDL_GetHintBoolean("TAC08_PRESENT_ALWAYS", SDL_FALSE);
+}
+
+// TAC08_SOFTWARE_PRESENT=1 presents through sdl's software renderer even when there is a gpu
+// renderer.
+static bool getSoftwarePresent() {
+	return SDL_GetHintBoolean("TAC08_SOFTWARE_PRESENT", SDL_FALSE);
+}
+
+// TAC08_PRESENT_THREAD=1 converts frames on a thread of its own, overlapping the conversion with
+// the next game frame at the cost of a frame of extra latency.
+static bool getPresentThread() {
+	return SDL_GetHintBoolean("TAC08_PRESENT_THREAD", SDL_FALSE);
+}
+
+// TAC08_GIF_SECONDS is how much play is kept for the gif saved with F9 or when the cart stops with
+// an error, 0 turns recording off.
+static int getGifSeconds() {
+	const char* val = SDL_GetHint("TAC08_GIF_SECONDS");
+	return val ? atoi(val) : config::GIF_SECONDS;
+}
+
+// TAC08_SCREENSHOT_SCALE is the size of each pixel in screenshots saved with F6.
+static int getScreenshotScale() {
+	const char* val = SDL_GetHint("TAC08_SCREENSHOT_SCALE");
+	return val ? atoi(val) : config::SCREENSHOT_SCALE;
+}
+
 int safe_main(int argc, char** argv) {
 	TraceFunction();
 
 	//	GFX_Init(config::INIT_SCREEN_WIDTH * 4, config::INIT_SCREEN_HEIGHT * 4);
 	GFX_Init(512 * 3, 256 * 3);
 	GFX_CreateBackBuffer(config::INIT_SCREEN_WIDTH, config::INIT_SCREEN_HEIGHT);
-	AUDIO_Init();
+
+	bool render = getRenderFile() != nullptr;
+	uint32_t renderFrames = getRenderFrames();
+	uint32_t renderedFrames = 0;
+	if (render) {
+		AUDIO_InitRender(getRenderFile());
+		TIME_UseVirtualClock(true);
+	} else {
+		AUDIO_Init();
+	}
 	pico_control::init();
+	pico_control::rewind_init(getRewindBufferSize());
 	pico_data::load_font_data();
 
 	if (argc == 1) {
@@ -31,8 +104,6 @@ int safe_main(int argc, char** argv) {
 		}
 	}
 
-	uint32_t target_ticks = 20;
-	uint32_t ticks = 0;
 	uint32_t target_fps = 30;
 	uint32_t actual_fps = 30;
 	uint32_t sys_fps = 60;
@@ -46,98 +117,125 @@ int safe_main(int argc, char** argv) {
 	uint64_t drawTime = 0;
 	uint64_t copyBBTime = 0;
 
-	bool init = false;
-	bool restarted = true;
-	bool script_error = false;
+	pico_control::GameLoop loop;
+	pico_control::FrameScheduler scheduler(loop.targetFps(), getFrameCatchUp());
+	bool frameSkip = getFrameSkip();
+	bool presentAlways = getPresentAlways();
+	if (!render && getSoftwarePresent()) {
+		GFX_UseSoftwarePresent();
+	}
+	if (!render && getPresentThread() && GFX_StartPresentThread()) {
+		// each flip hands over the frame copied out before it, so only new frames are flipped
+		presentAlways = false;
+	}
+
+	pico_capture::GifRecorder gifRecorder;
+	gifRecorder.configure(getGifSeconds(), config::GIF_BUFFER_SIZE);
+	bool errorGifSaved = false;
 
 	while (EVT_ProcessEvents()) {
-		using namespace pico_api;
-
 		if (DEBUG_ReloadRequested()) {
-			restarted = true;
-			pico_api::reloadcart();
+			loop.reload();
 		}
 
-		if (restarted == true) {
-			restarted = false;
-			script_error = false;
-			init = false;
+		if (DEBUG_SaveStateRequested()) {
+			pico_control::save_state_file();
+		}
+		if (DEBUG_LoadStateRequested()) {
+			pico_control::load_state_file();
 		}
 
-		target_fps = pico_script::symbolExist("_update60") ? 60 : 30;
+		target_fps = loop.targetFps();
+		scheduler.setRate(target_fps);
 		HAL_SetFrameRates(target_fps, actual_fps, sys_fps, cpu_usage);
 
-		if ((TIME_GetTime_ms() - ticks) > target_ticks) {
+		// the offline render runs one game frame per loop as fast as it can
+		int frames = render ? 1 : scheduler.due();
+		for (int n = 0; n < frames; n++) {
+			bool last = n == frames - 1;
 			HAL_StartFrame();
-			pico_control::frame_start();
-			pico_control::sound_tick();
-
-			if (!script_error) {
-				try {
-					if (!init) {
-						pico_script::run("_init", true, restarted);
-						init = true;
-					}
+			pico_control::FrameTimes times =
+			    loop.step(INP_GetInputState(), INP_GetMouseState(), DEBUG_RewindRequested(),
+			              last || !frameSkip);
+			updateTime += times.update_us;
+			drawTime += times.draw_us;
+
+			if (last) {
+				int buffer_w;
+				int buffer_h;
+				pico_api::colour_t* buffer = pico_control::get_buffer(buffer_w, buffer_h);
+				uint64_t copyBBStart = TIME_GetProfileTime();
+				GFX_SetBackBufferSize(buffer_w, buffer_h);
+				GFX_CopyBackBuffer(buffer, buffer_w, buffer_h, pico_control::get_screen_mode());
+				copyBBTime += TIME_GetElapsedProfileTime_us(copyBBStart);
 
-					pico_script::run("_pre_update", true, restarted);
-					pico_control::set_input_state(INP_GetInputState());
-					pico_control::set_mouse_state(INP_GetMouseState());
-
-					if (pico_control::is_pause_menu()) {
-						if (pico_script::do_menu()) {
-							pico_control::end_pause_menu();
-						}
-					} else {
-						uint64_t updateTimeStart = TIME_GetProfileTime();
-						if (!pico_script::run("_update", true, restarted)) {
-							if (pico_script::run("_update60", true, restarted)) {
-								target_ticks = 1;
-							}
-						}
-						updateTime += TIME_GetElapsedProfileTime_us(updateTimeStart);
-
-						uint64_t drawTimeStart = TIME_GetProfileTime();
-						pico_script::run("_draw", true, restarted);
-						drawTime += TIME_GetElapsedProfileTime_us(drawTimeStart);
+				PaletteState palette = GFX_GetPaletteState();
+				int screenshotScale = 0;
+				bool screenshot = pico_control::take_screenshot_request(screenshotScale);
+				if (screenshot || DEBUG_ScreenshotRequested()) {
+					pico_capture::screenshot(
+					    buffer, buffer_w, buffer_h, pico_control::get_screen_mode(), palette.mapped,
+					    screenshotScale ? screenshotScale : getScreenshotScale(),
+					    pico_capture::captureName("", "png"));
+				}
+
+				// skipped frames are recorded as part of the one that is shown
+				gifRecorder.addFrame(buffer, buffer_w, buffer_h, pico_control::get_screen_mode(),
+				                     palette.mapped, frames * 1000000 / target_fps);
+				if (DEBUG_SaveGifRequested()) {
+					gifRecorder.save(pico_capture::captureName("", "gif"));
+				}
+				// keep the lead up to a script error, once per error
+				if (loop.scriptError() != errorGifSaved) {
+					if (!errorGifSaved) {
+						gifRecorder.save(pico_capture::captureName("-error", "gif"));
 					}
-				} catch (pico_script::error& e) {
-					pico_control::displayerror(e.what());
-					logr << LogLevel::err << e.what();
-					script_error = true;
+					errorGifSaved = loop.scriptError();
 				}
 			}
 
-			// call flip() even though this does not do anything, some carts implement their
-			// own version to make end of frame.
-			pico_script::run("flip", true, restarted);
-
-			int buffer_w;
-			int buffer_h;
-			pico_api::colour_t* buffer = pico_control::get_buffer(buffer_w, buffer_h);
-			uint64_t copyBBStart = TIME_GetProfileTime();
-			GFX_SetBackBufferSize(buffer_w, buffer_h);
-			GFX_CopyBackBuffer(buffer, buffer_w, buffer_h);
-			copyBBTime += TIME_GetElapsedProfileTime_us(copyBBStart);
-
-			ticks = TIME_GetTime_ms();
 			gameFrameCount++;
 
-			pico_control::frame_end();
 			HAL_EndFrame();
+
+			if (render) {
+				AUDIO_RenderFrame(target_fps);
+				TIME_AdvanceVirtualClock(1000000 / target_fps);
+				renderedFrames++;
+			}
+		}
+		if (render && renderedFrames == renderFrames) {
+			break;
+		}
+		pico_capture::poll();
+
+		if (!render) {
+			if (presentAlways || frames > 0) {
+				systemFrameCount++;
+				GFX_Flip();
+			}
+			if (!presentAlways) {
+				scheduler.sleepUntilDue();
+			}
 		}
-		systemFrameCount++;
-		GFX_Flip();
 
 		if (TIME_GetElapsedTime_ms(frameTimer) >= 1000) {
 			updateTime /= gameFrameCount;
 			drawTime /= gameFrameCount;
 			copyBBTime /= gameFrameCount;
 
+			PresentStats present = GFX_GetPresentStats();
+			uint64_t latency = present.frames ? present.latency_us / present.frames : 0;
+			uint64_t presentTime = present.frames ? present.present_us / present.frames : 0;
+
 			logr << LogLevel::perf << "game FPS: " << gameFrameCount
-			     << " sys FPS: " << systemFrameCount << " update: " << updateTime / 1000.0f
+			     << " sys FPS: " << systemFrameCount << " dropped: " << scheduler.dropped()
+			     << " update: " << updateTime / 1000.0f
 			     << "ms  draw: " << drawTime / 1000.0f << "ms"
 			     << " bb copy: " << copyBBTime << "us"
-			     << " cpu: " << cpu_usage;
+			     << " present: " << presentTime << "us"
+			     << " latency: " << latency << "us max: " << present.max_latency_us << "us"
+			     << " replaced: " << present.replaced << " cpu: " << cpu_usage;
 
 			actual_fps = gameFrameCount;
 			sys_fps = systemFrameCount;
@@ -174,6 +272,9 @@ int main(int argc, char** argv) {
 		logr << LogLevel::err << err.what();
 	}
 
+	pico_control::flush_cartdata();
+	pico_capture::shutdown();
+	FILE_Shutdown();
 	pico_script::unload_scripting();
 	AUDIO_Shutdown();
 	GFX_End();
@@ -1,8 +1,11 @@
 #include <map>
+#include <memory>
 #include <sstream>
+#include <vector>
 
 #include "pico_audio.h"
 
+#include "config.h"
 #include "hal_audio.h"
 #include "log.h"
 #include "pico_cart.h"
@@ -40,38 +43,60 @@ namespace pico_private {
 
 #pragma pack()
 
-	std::map<int, int> sfx_map;
-
-	void load_wavs() {
-		sfx_map[-1] = -1;
-		for (int n = 0; n < 64; n++) {
-			std::string name = pico_cart::getCart().sections["base_path"] +
-			                   pico_cart::getCart().sections["cart_name"] + std::to_string(n) +
-			                   ".wav";
-			try {
-				int id = AUDIO_LoadWav(name.c_str());
-				sfx_map[n] = id;
-			} catch (audio_exception& e) {
-				// logr << "failed to load wav: " << e.what();
-			}
-		}
-	}
+}  // namespace pico_private
+
+namespace pico_control {
+	struct AudioContext {
+		std::map<int, int> sfx_map;
+	};
+}  // namespace pico_control
 
+// the context of the machine running on this thread
+static pico_control::AudioContext defaultAudio;
+static thread_local pico_control::AudioContext* audio = &defaultAudio;
+
+namespace pico_private {
+
+	// wavs are registered on first use, so carts that never play a sound never touch the disk.
+	// sfx without a wav are remembered as -1 so the file is only looked for once.
 	int get_wavid(int sfx_id) {
-		auto i = sfx_map.find(sfx_id);
-		if (i != sfx_map.end()) {
+		auto i = audio->sfx_map.find(sfx_id);
+		if (i != audio->sfx_map.end()) {
 			return i->second;
 		}
-		return -1;
+
+		int id = -1;
+		std::string name = pico_cart::getCart().sections["base_path"] +
+		                   pico_cart::getCart().sections["cart_name"] + std::to_string(sfx_id) +
+		                   ".wav";
+		try {
+			id = AUDIO_LoadWav(name.c_str());
+		} catch (audio_exception& e) {
+			// logr << "failed to load wav: " << e.what();
+		}
+		audio->sfx_map[sfx_id] = id;
+		return id;
 	}
 
 }  // namespace pico_private
 
 namespace pico_control {
+	AudioContext* audio_create_context() {
+		return new AudioContext();
+	}
+
+	void audio_destroy_context(AudioContext* context) {
+		delete context;
+	}
+
+	void audio_select_context(AudioContext* context) {
+		audio = context ? context : &defaultAudio;
+	}
+
 	void audio_init() {
 		TraceFunction();
 		AUDIO_StopAll();
-		pico_private::sfx_map.clear();
+		audio->sfx_map.clear();
 	}
 
 	void set_music_from_cart(std::string& data) {
@@ -137,9 +162,6 @@ namespace pico_control {
 	}
 
 	void sound_tick() {
-		if (pico_private::sfx_map.empty()) {
-			pico_private::load_wavs();
-		}
 	}
 
 	void stop_all_audio() {
@@ -147,6 +169,52 @@ namespace pico_control {
 		AUDIO_StopAll();
 	}
 
+	void audio_save_state(utils::BinaryWriter& w) {
+		w.write((uint32_t)config::AUDIO_CHANNELS);
+		for (int c = 0; c < config::AUDIO_CHANNELS; c++) {
+			AudioChannelState cs = AUDIO_GetChannelState(c);
+			w.writeString(cs.wav);
+			w.write(cs.trim);
+			w.write(cs.pack);
+			w.write(cs.loop);
+			w.write(cs.current);
+			w.write(cs.start);
+			w.write(cs.end);
+			w.write(cs.loop_start);
+			w.write(cs.loop_end);
+		}
+	}
+
+	std::function<void()> audio_load_state(utils::BinaryReader& r) {
+		uint32_t count = r.read<uint32_t>();
+		if (count > config::AUDIO_CHANNELS) {
+			return nullptr;
+		}
+		auto channels = std::make_shared<std::vector<AudioChannelState>>();
+		for (uint32_t c = 0; c < count && r.ok(); c++) {
+			AudioChannelState cs;
+			cs.wav = r.readString();
+			cs.trim = r.read<bool>();
+			cs.pack = r.read<bool>();
+			cs.loop = r.read<bool>();
+			cs.current = r.read<uint32_t>();
+			cs.start = r.read<uint32_t>();
+			cs.end = r.read<uint32_t>();
+			cs.loop_start = r.read<uint32_t>();
+			cs.loop_end = r.read<uint32_t>();
+			channels->push_back(cs);
+		}
+		if (!r.ok()) {
+			return nullptr;
+		}
+
+		return [channels]() {
+			for (size_t c = 0; c < channels->size(); c++) {
+				AUDIO_SetChannelState((int)c, (*channels)[c]);
+			}
+		};
+	}
+
 }  // namespace pico_control
 
 namespace pico_api {
@@ -167,7 +235,7 @@ namespace pico_api {
 			int wavid = pico_private::get_wavid(n);
 			if (wavid >= 0) {
 				pico_private::SFX* sfx_ptr = (pico_private::SFX*)pico_control::get_sfx_data();
-				sfx_ptr += wavid;
+				sfx_ptr += n;
 
 				if (sfx_ptr->loopstart == 0 && sfx_ptr->loopend == 0) {
 					AUDIO_Play(wavid, channel, false);
@@ -207,7 +275,7 @@ namespace pico_api {
 			int wavid = pico_private::get_wavid(n);
 			if (wavid >= 0) {
 				pico_private::SFX* sfx_ptr = (pico_private::SFX*)pico_control::get_sfx_data();
-				sfx_ptr += wavid;
+				sfx_ptr += n;
 
 				int speed = sfx_ptr->speed;
 				int start = speed * offset;
@@ -229,10 +297,10 @@ namespace pico_api {
 }  // namespace pico_api
 
 namespace pico_apix {
-	int wavload(std::string filename) {
+	int wavload(std::string filename, bool pack) {
 		filename = pico_cart::getCart().sections["base_path"] + filename;
 		try {
-			return AUDIO_LoadWav(filename.c_str());
+			return AUDIO_LoadWav(filename.c_str(), true, pack);
 		} catch (audio_exception&) {
 			return -1;
 		}
@@ -1,7 +1,10 @@
 #ifndef PICO_AUDIO_H
 #define PICO_AUDIO_H
 
+#include <functional>
+
 #include "hal_core.h"
+#include "utils.h"
 
 namespace pico_api {
 	void sfx(int n);
@@ -16,15 +19,24 @@ namespace pico_api {
 }  // namespace pico_api
 
 namespace pico_apix {
-	int wavload(std::string filename);
+	int wavload(std::string filename, bool pack = false);
 }
 
 namespace pico_control {
+	struct AudioContext;
+	AudioContext* audio_create_context();
+	void audio_destroy_context(AudioContext* context);
+	void audio_select_context(AudioContext* context);
+
 	void audio_init();
 	void set_music_from_cart(std::string& data);
 	void set_sfx_from_cart(std::string& data);
 	void sound_tick();
 	void stop_all_audio();
+	void audio_save_state(utils::BinaryWriter& w);
+	// reads the audio section of a save state and returns the function that applies it, or an
+	// empty function if the section is bad
+	std::function<void()> audio_load_state(utils::BinaryReader& r);
 }  // namespace pico_control
 
 #endif /* PICO_AUDIO_H */
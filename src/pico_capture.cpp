@@ -0,0 +1,281 @@
+#include "pico_capture.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "gif.h"
+#include "hal_screenmode.h"
+#include "log.h"
+#include "png.h"
+
+namespace pico_capture {
+
+	// the capture thread runs queued jobs one at a time. each job returns the line to log for it,
+	// which is logged from the game thread by poll().
+	namespace {
+		typedef std::function<std::pair<LogLevel, std::string>()> Job;
+
+		std::mutex jobMutex;
+		std::condition_variable jobCond;
+		std::deque<Job> jobs;
+		std::vector<std::pair<LogLevel, std::string>> results;
+		std::thread jobThread;
+		bool jobQuit = false;
+
+		void jobMain() {
+			std::unique_lock<std::mutex> lock(jobMutex);
+			while (true) {
+				if (jobs.empty()) {
+					if (jobQuit) {
+						return;
+					}
+					jobCond.wait(lock);
+					continue;
+				}
+				Job job = std::move(jobs.front());
+				jobs.pop_front();
+
+				lock.unlock();
+				auto result = job();
+				lock.lock();
+				results.push_back(std::move(result));
+			}
+		}
+
+		void queueJob(Job job) {
+			std::lock_guard<std::mutex> lock(jobMutex);
+			if (!jobThread.joinable()) {
+				jobQuit = false;
+				jobThread = std::thread(jobMain);
+			}
+			jobs.push_back(std::move(job));
+			jobCond.notify_one();
+		}
+
+		std::pair<LogLevel, std::string> writeResult(const std::string& name,
+		                                             const std::string& data) {
+			if (FILE_WriteFileAtomic(name, data)) {
+				return {LogLevel::info, "capture written: " + name};
+			}
+			return {LogLevel::err, "failed to write file: " + name};
+		}
+
+		uint32_t toRGB(pixel_t p) {
+			uint32_t r = (p >> 11) & 0x1f;
+			uint32_t g = (p >> 5) & 0x3f;
+			uint32_t b = p & 0x1f;
+			return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) |
+			       ((b << 3) | (b >> 2));
+		}
+
+		void toRGB(const std::array<pixel_t, 256>& palette, uint32_t* rgb) {
+			for (int n = 0; n < 256; n++) {
+				rgb[n] = toRGB(palette[n]);
+			}
+		}
+
+		void identityTable(uint8_t* table) {
+			for (int n = 0; n < 256; n++) {
+				table[n] = (uint8_t)n;
+			}
+		}
+	}  // namespace
+
+	static const uint32_t GIF_MIN_FRAME_US = 20000;
+
+	void GifRecorder::configure(int seconds, size_t maxBytes) {
+		m_seconds = std::max(seconds, 0);
+		m_maxBytes = maxBytes;
+		clear();
+	}
+
+	void GifRecorder::addFrame(const uint8_t* buffer,
+	                           int w,
+	                           int h,
+	                           uint8_t screenMode,
+	                           const std::array<pixel_t, 256>& palette,
+	                           uint32_t duration_us) {
+		if (!enabled()) {
+			return;
+		}
+
+		// a gif has one size, a resized screen starts a new recording
+		if (!m_frames.empty() && (m_frames.back().w != w || m_frames.back().h != h)) {
+			clear();
+		}
+
+		size_t size = (size_t)w * h;
+		if (!m_frames.empty() && m_frames.back().duration_us < GIF_MIN_FRAME_US) {
+			duration_us += m_frames.back().duration_us;
+			m_duration_us -= m_frames.back().duration_us;
+		} else {
+			m_frames.emplace_back();
+			if (!m_spare.empty()) {
+				m_frames.back().pixels = std::move(m_spare.back());
+				m_spare.pop_back();
+			}
+			m_frames.back().pixels.resize(size);
+			m_bytes += size + sizeof(Frame);
+		}
+
+		Frame& f = m_frames.back();
+		std::copy(buffer, buffer + size, f.pixels.begin());
+		f.w = w;
+		f.h = h;
+		f.screenMode = screenMode;
+		f.palette = palette;
+		f.duration_us = duration_us;
+		m_duration_us += duration_us;
+		trim();
+	}
+
+	// drops the oldest frames once there is more than the configured time or memory
+	void GifRecorder::trim() {
+		uint64_t limit_us = (uint64_t)m_seconds * 1000000;
+		while (m_frames.size() > 1 &&
+		       (m_duration_us - m_frames.front().duration_us >= limit_us || m_bytes > m_maxBytes)) {
+			Frame& f = m_frames.front();
+			m_duration_us -= f.duration_us;
+			m_bytes -= f.pixels.size() + sizeof(Frame);
+			m_spare.push_back(std::move(f.pixels));
+			m_frames.pop_front();
+		}
+	}
+
+	bool GifRecorder::save(const std::string& filename) {
+		if (m_frames.empty()) {
+			return false;
+		}
+
+		auto frames = std::make_shared<std::deque<Frame>>();
+		frames->swap(m_frames);
+		m_bytes = 0;
+		m_duration_us = 0;
+
+		queueJob([frames, filename]() {
+			int w = frames->front().w;
+			int h = frames->front().h;
+			uint8_t identity[256];
+			identityTable(identity);
+			std::vector<uint8_t> pixels((size_t)w * h);
+			uint32_t palette[256];
+			toRGB(frames->front().palette, palette);
+
+			gif::Encoder encoder(w, h, palette);
+			// delays are rounded on the total time so they do not drift
+			uint64_t time_us = 0;
+			for (auto& f : *frames) {
+				int start = (int)((time_us + 5000) / 10000);
+				time_us += f.duration_us;
+				int end = (int)((time_us + 5000) / 10000);
+
+				GFX_ConvertScreenMode(f.pixels.data(), w, h, f.screenMode, identity,
+				                      pixels.data(), w);
+				toRGB(f.palette, palette);
+				encoder.addFrame(pixels.data(), palette, std::max(end - start, 1));
+			}
+			return writeResult(filename, encoder.finish());
+		});
+		return true;
+	}
+
+	void GifRecorder::clear() {
+		for (auto& f : m_frames) {
+			m_spare.push_back(std::move(f.pixels));
+		}
+		m_frames.clear();
+		m_bytes = 0;
+		m_duration_us = 0;
+	}
+
+	static const int MAX_SCREENSHOT_SIZE = 4096;
+
+	void screenshot(const uint8_t* buffer,
+	                int w,
+	                int h,
+	                uint8_t screenMode,
+	                const std::array<pixel_t, 256>& palette,
+	                int scale,
+	                const std::string& filename) {
+		scale = std::max(1, std::min(scale, MAX_SCREENSHOT_SIZE / std::max(w, h)));
+		auto frame = std::make_shared<std::vector<uint8_t>>(buffer, buffer + (size_t)w * h);
+
+		queueJob([frame, w, h, screenMode, palette, scale, filename]() {
+			uint8_t identity[256];
+			identityTable(identity);
+			std::vector<uint8_t> screen((size_t)w * h);
+			GFX_ConvertScreenMode(frame->data(), w, h, screenMode, identity, screen.data(), w);
+
+			int sw = w * scale;
+			std::vector<uint8_t> pixels((size_t)sw * h * scale);
+			uint8_t* dst = pixels.data();
+			for (int y = 0; y < h; y++) {
+				const uint8_t* row = &screen[(size_t)y * w];
+				for (int x = 0; x < sw; x++) {
+					dst[x] = row[x / scale];
+				}
+				for (int n = 1; n < scale; n++) {
+					std::copy(dst, dst + sw, dst + (size_t)n * sw);
+				}
+				dst += (size_t)sw * scale;
+			}
+
+			// only the colours up to the highest index used go in the palette
+			uint8_t used = *std::max_element(screen.begin(), screen.end());
+			uint32_t rgb[256];
+			toRGB(palette, rgb);
+			return writeResult(filename, png::encodeIndexed(pixels.data(), sw, h * scale, rgb,
+			                                                used + 1));
+		});
+	}
+
+	std::string captureName(const std::string& suffix, const std::string& ext) {
+		static std::string lastName;
+		static int count = 0;
+
+		char stamp[32];
+		time_t now = time(nullptr);
+		strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+		std::string name = std::string("tac08-") + stamp + suffix;
+		if (name + ext == lastName) {
+			// more than one capture in a second
+			count++;
+		} else {
+			lastName = name + ext;
+			count = 0;
+		}
+		if (count) {
+			name += "-" + std::to_string(count);
+		}
+		return FILE_GetPrefPath() + name + "." + ext;
+	}
+
+	void poll() {
+		std::lock_guard<std::mutex> lock(jobMutex);
+		for (auto& r : results) {
+			logr << r.first << r.second;
+		}
+		results.clear();
+	}
+
+	void shutdown() {
+		TraceFunction();
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			jobQuit = true;
+			jobCond.notify_one();
+		}
+		if (jobThread.joinable()) {
+			jobThread.join();
+		}
+		poll();
+	}
+
+}  // namespace pico_capture
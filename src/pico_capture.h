@@ -0,0 +1,84 @@
+#ifndef PICO_CAPTURE_H
+#define PICO_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "hal_core.h"
+
+// frame capture. the game thread only copies frames, encoding and writing the files is done on
+// a capture thread so the game loop never waits on it.
+namespace pico_capture {
+
+	// keeps the last few seconds of frames, as 8 bit colour indexes plus the screen palette,
+	// ready to be written out as a gif. frames shorter than 20ms, too short for most gif players,
+	// replace the one before, so a 60 fps game is recorded at 30 fps.
+	class GifRecorder {
+	   public:
+		// seconds = 0 turns recording off. maxBytes bounds the memory the frames use.
+		void configure(int seconds, size_t maxBytes);
+
+		bool enabled() const {
+			return m_seconds > 0;
+		}
+
+		void addFrame(const uint8_t* buffer,
+		              int w,
+		              int h,
+		              uint8_t screenMode,
+		              const std::array<pixel_t, 256>& palette,
+		              uint32_t duration_us);
+
+		// hands the recorded frames to the capture thread to be written to filename and starts
+		// a new recording. returns false if there was nothing to save.
+		bool save(const std::string& filename);
+
+		void clear();
+
+	   private:
+		struct Frame {
+			std::vector<uint8_t> pixels;
+			int w = 0;
+			int h = 0;
+			uint8_t screenMode = 0;
+			std::array<pixel_t, 256> palette;
+			uint32_t duration_us = 0;
+		};
+
+		void trim();
+
+		int m_seconds = 0;
+		size_t m_maxBytes = 0;
+		std::deque<Frame> m_frames;
+		std::vector<std::vector<uint8_t>> m_spare;  // pixel buffers of dropped frames, reused
+		size_t m_bytes = 0;
+		uint64_t m_duration_us = 0;
+	};
+
+	// copies the frame and writes it to filename as an indexed png with each pixel scaled up to
+	// scale x scale.
+	void screenshot(const uint8_t* buffer,
+	                int w,
+	                int h,
+	                uint8_t screenMode,
+	                const std::array<pixel_t, 256>& palette,
+	                int scale,
+	                const std::string& filename);
+
+	// a file name in the pref path made from the time, eg. tac08-20190921-183000-error.gif
+	std::string captureName(const std::string& suffix, const std::string& ext);
+
+	// logs the captures written since the last call, call from the game thread
+	void poll();
+
+	// waits for queued captures to be written and stops the capture thread
+	void shutdown();
+
+}  // namespace pico_capture
+
+#endif /* PICO_CAPTURE_H */
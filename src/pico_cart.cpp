@@ -1,3 +1,4 @@
+#include <string.h>
 #include <fstream>
 #include <map>
 #include <set>
@@ -10,6 +11,7 @@
 #include "pico_audio.h"
 #include "pico_core.h"
 #include "pico_script.h"
+#include "png.h"
 #include "utf8-util.h"
 #include "utils.h"
 
@@ -103,9 +105,9 @@ namespace pico_cart {
 
 	void do_load(std::istream& s, Cart& cart, std::string filename);
 
-	bool check_include_file(const std::string& line, Cart& cart, int filenum) {
+	bool check_include_file(const std::string& line, Cart& cart, int filenum, int localLine) {
 		if (line.size() && line[0] == '#' && line.find("#include") == 0) {
-			cart.source.push_back(Line{filenum, std::string("-- ") + line});
+			cart.source.push_back(Line{filenum, std::string("-- ") + line, localLine});
 			std::string incfile = cart.sections["base_path"] + utils::trimboth(line.substr(8));
 			incfile = path::removeRelative(incfile);
 			logr << "Loading include file " << incfile;
@@ -113,6 +115,7 @@ namespace pico_cart {
 			if (data.size() == 0) {
 				throw error(std::string("failed to open include file: ") + incfile);
 			}
+			cart.hash = utils::fnv1a(data.data(), data.size(), cart.hash);
 			std::istringstream s(data);
 			do_load(s, cart, incfile);
 			return true;
@@ -127,17 +130,19 @@ namespace pico_cart {
 		int filenum = cart.files.size() - 1;
 
 		std::string line;
+		int localLine = 0;
 		while (std::getline(s, line)) {
+			localLine++;
 			line = utils::trimright(line, " \n\r");
 			line = convert_emojis(line);
 
-			if (!check_include_file(line, cart, filenum)) {
+			if (!check_include_file(line, cart, filenum, localLine)) {
 				if (valid_sections.find(line) != valid_sections.end()) {
 					cart.sections["cur_sect"] = line;
 					logr << "section " << line;
 				} else {
 					if (cart.sections["cur_sect"] == "__lua__") {
-						cart.source.push_back(Line{filenum, line});
+						cart.source.push_back(Line{filenum, line, localLine});
 					} else {
 						cart.sections[cart.sections["cur_sect"]] += line + "\n";
 					}
@@ -146,27 +151,60 @@ namespace pico_cart {
 		}
 	}
 
-	LineInfo getLineInfo(const Cart& cart, int lineNum) {
-		LineInfo li;
-		li.sourceLine = cart.source[lineNum].line;
-		li.filename = cart.files[cart.source[lineNum].file];
-		li.localLineNum = 0;
-
-		auto filenum = cart.source[lineNum].file;
-		for (int l = lineNum; l >= 0; l--) {
-			if (cart.source[l].file == filenum) {
-				li.localLineNum++;
+	void buildLineTable(Cart& cart) {
+		cart.lineTable.assign(cart.files.size(), std::vector<int>());
+		for (size_t n = 0; n < cart.source.size(); n++) {
+			const Line& l = cart.source[n];
+			auto& lines = cart.lineTable[l.file];
+			if ((int)lines.size() <= l.localLine) {
+				lines.resize(l.localLine + 1, -1);
 			}
+			lines[l.localLine] = n;
 		}
+	}
 
-		// if its the main p8 file add extra to skip file header.
-		if (cart.source[lineNum].file == 0) {
-			li.localLineNum += 3;
+	LineInfo getLineInfo(const Cart& cart, int lineNum) {
+		LineInfo li;
+		if (lineNum < 0 || lineNum >= (int)cart.source.size()) {
+			li.filename = cart.files.empty() ? "" : cart.files[0];
+			li.localLineNum = lineNum + 1;
+			return li;
 		}
 
+		const Line& l = cart.source[lineNum];
+		li.sourceLine = l.line;
+		li.filename = cart.files[l.file];
+		li.localLineNum = l.localLine;
 		return li;
 	}
 
+	int getGlobalLine(const Cart& cart, int file, int localLine) {
+		if (file < 0 || file >= (int)cart.lineTable.size()) {
+			return -1;
+		}
+		auto& lines = cart.lineTable[file];
+		if (localLine < 0 || localLine >= (int)lines.size()) {
+			return -1;
+		}
+		return lines[localLine];
+	}
+
+	// finds a cart or include file by its full path or by a trailing part of the path
+	int findFile(const Cart& cart, const std::string& filename) {
+		for (size_t n = 0; n < cart.files.size(); n++) {
+			const std::string& f = cart.files[n];
+			if (f == filename) {
+				return n;
+			}
+			size_t pos = f.size() - filename.size();
+			if (f.size() > filename.size() && f[pos - 1] == '/' &&
+			    f.compare(pos, filename.size(), filename) == 0) {
+				return n;
+			}
+		}
+		return -1;
+	}
+
 	std::string getCartName() {
 		return "";
 	}
@@ -190,10 +228,305 @@ namespace pico_cart {
 		return res;
 	}
 
-	static Cart loadedCart;
+	// the cart of the machine running on this thread
+	static Cart defaultCart;
+	static thread_local Cart* loadedCart = &defaultCart;
+
+	// .p8.png carts store the 0x8000 byte cart in the low 2 bits of each pixel's argb
+	// channels. the first 0x4300 bytes are the rom, the rest is the lua which may be plain,
+	// compressed with the old :c: scheme or compressed with pxa.
+	namespace p8png {
+		const size_t CART_SIZE = 0x8000;
+		const size_t CODE_ADDR = 0x4300;
+
+		static bool isPng(const std::string& data) {
+			return data.size() >= 8 && data.compare(0, 4, "\x89PNG") == 0;
+		}
+
+		static std::string decompressOld(const uint8_t* code, size_t size) {
+			static const char* lut = "\n 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
+
+			size_t len = (code[4] << 8) | code[5];
+			std::string out;
+			out.reserve(len);
+
+			size_t pos = 8;
+			while (out.size() < len && pos < size) {
+				uint8_t b = code[pos++];
+				if (b == 0) {
+					if (pos < size) {
+						out += (char)code[pos++];
+					}
+				} else if (b <= 0x3b) {
+					out += lut[b - 1];
+				} else {
+					if (pos >= size) {
+						break;
+					}
+					uint8_t b2 = code[pos++];
+					size_t offset = (b - 0x3c) * 16 + (b2 & 0x0f);
+					size_t count = (b2 >> 4) + 2;
+					if (offset == 0 || offset > out.size()) {
+						throw error("bad back reference in compressed code");
+					}
+					for (size_t n = 0; n < count; n++) {
+						out += out[out.size() - offset];
+					}
+				}
+			}
+			return out;
+		}
+
+		// bits are read lsb first
+		class BitReader {
+		   public:
+			BitReader(const uint8_t* data, size_t size) : m_data(data), m_size(size) {
+			}
+
+			int bit() {
+				if (m_pos >= m_size * 8) {
+					throw error("unexpected end of compressed code");
+				}
+				int b = (m_data[m_pos >> 3] >> (m_pos & 7)) & 1;
+				m_pos++;
+				return b;
+			}
+
+			int bits(int n) {
+				int v = 0;
+				for (int i = 0; i < n; i++) {
+					v |= bit() << i;
+				}
+				return v;
+			}
+
+		   private:
+			const uint8_t* m_data;
+			size_t m_size;
+			size_t m_pos = 0;
+		};
+
+		static std::string decompressPxa(const uint8_t* code, size_t size) {
+			size_t len = (code[4] << 8) | code[5];
+			std::string out;
+			out.reserve(len);
+
+			uint8_t mtf[256];
+			for (int n = 0; n < 256; n++) {
+				mtf[n] = n;
+			}
+
+			BitReader r(code + 8, size - 8);
+			while (out.size() < len) {
+				if (r.bit()) {
+					// literal, as an index into the move to front table
+					int extra = 0;
+					while (r.bit()) {
+						extra++;
+					}
+					int nbits = 4 + extra;
+					int index = nbits <= 8 ? r.bits(nbits) + (1 << nbits) - 16 : 256;
+					if (index > 255) {
+						throw error("bad literal in compressed code");
+					}
+					uint8_t c = mtf[index];
+					memmove(mtf + 1, mtf, index);
+					mtf[0] = c;
+					out += (char)c;
+				} else {
+					int offsetBits = r.bit() ? (r.bit() ? 5 : 10) : 15;
+					size_t offset = r.bits(offsetBits) + 1;
+
+					if (offsetBits == 10 && offset == 1) {
+						// uncompressed block, zero terminated
+						while (uint8_t c = r.bits(8)) {
+							out += (char)c;
+						}
+					} else {
+						size_t count = 3;
+						int part;
+						do {
+							part = r.bits(3);
+							count += part;
+						} while (part == 7);
+
+						if (offset > out.size()) {
+							throw error("bad back reference in compressed code");
+						}
+						for (size_t n = 0; n < count; n++) {
+							out += out[out.size() - offset];
+						}
+					}
+				}
+			}
+			return out;
+		}
+
+		static std::string extractCode(const uint8_t* code, size_t size) {
+			if (size >= 8 && memcmp(code, ":c:\0", 4) == 0) {
+				return decompressOld(code, size);
+			}
+			if (size >= 8 && memcmp(code, "\0pxa", 4) == 0) {
+				return decompressPxa(code, size);
+			}
+			size_t len = 0;
+			while (len < size && code[len]) {
+				len++;
+			}
+			return std::string((const char*)code, len);
+		}
+
+		static void load(const std::string& data, Cart& cart) {
+			TraceFunction();
+
+			// only the decoded cart bytes are kept, not the image
+			std::vector<uint8_t> bytes;
+			bytes.reserve(CART_SIZE);
+			try {
+				png::decodeRGBA(data, [&bytes](int y, const uint8_t* rgba, int width) {
+					for (int x = 0; x < width && bytes.size() < CART_SIZE; x++, rgba += 4) {
+						bytes.push_back(((rgba[3] & 3) << 6) | ((rgba[0] & 3) << 4) |
+						                ((rgba[1] & 3) << 2) | (rgba[2] & 3));
+					}
+				});
+			} catch (png::error& e) {
+				throw error(std::string("failed to decode png cart: ") + e.what());
+			}
+			if (bytes.size() < CART_SIZE) {
+				throw error("png cart image is too small");
+			}
+
+			cart.rom.assign(bytes.begin(), bytes.begin() + CODE_ADDR);
+
+			std::string code = extractCode(bytes.data() + CODE_ADDR, CART_SIZE - CODE_ADDR);
+			std::istringstream s(code);
+			std::string line;
+			int localLine = 0;
+			while (std::getline(s, line)) {
+				cart.source.push_back(Line{0, line, ++localLine});
+			}
+		}
+	}  // namespace p8png
+
+	// compiled carts are cached in the pref dir with their assets already decoded and the lua
+	// preprocessed. the cache is keyed on the cart path and only used when the content hash of
+	// the cart and all its include files still matches.
+	namespace cache {
+		const uint32_t MAGIC = 0x43433854;  // "T8CC"
+		const uint32_t VERSION = 2;
+		const uint32_t HAS_GFX8 = 1;
+		const uint32_t HAS_FONT = 2;
+
+		static std::string cacheName(const std::string& filename) {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "%016llx",
+			         (unsigned long long)utils::fnv1a(filename.data(), filename.size()));
+			return FILE_GetPrefPath() + "cart_" + buf + ".p8c";
+		}
+
+		static bool read(utils::BinaryReader& r, const std::string& filename, Cart& cart) {
+			if (r.read<uint32_t>() != MAGIC || r.read<uint32_t>() != VERSION) {
+				return false;
+			}
+			uint64_t hash = r.read<uint64_t>();
+			uint32_t flags = r.read<uint32_t>();
+
+			// include files are rehashed as they may have changed without the cart changing
+			uint32_t numFiles = r.read<uint32_t>();
+			if (!r.ok() || numFiles == 0 || r.readString() != filename) {
+				return false;
+			}
+			cart.files.push_back(filename);
+			for (uint32_t n = 1; n < numFiles && r.ok(); n++) {
+				cart.files.push_back(r.readString());
+				std::string data = FILE_LoadFile(cart.files.back());
+				cart.hash = utils::fnv1a(data.data(), data.size(), cart.hash);
+			}
+			if (!r.ok() || cart.hash != hash) {
+				return false;
+			}
+
+			uint32_t numLines = r.read<uint32_t>();
+			cart.source.resize(numLines);
+			for (auto& line : cart.source) {
+				line.file = r.read<uint16_t>();
+				line.localLine = r.read<uint32_t>();
+				line.line = r.readString();
+			}
+
+			const int sheetSize = pico_control::SPRITE_DATA_SIZE;
+			const uint8_t* rom = r.skip(pico_control::ROM_DATA_SIZE);
+			const uint8_t* gfx8 = (flags & HAS_GFX8) ? r.skip(sheetSize) : nullptr;
+			const uint8_t* font = (flags & HAS_FONT) ? r.skip(sheetSize) : nullptr;
+			if (!r.ok() || !r.atEnd()) {
+				return false;
+			}
+			cart.rom.assign(rom, rom + pico_control::ROM_DATA_SIZE);
+			if (gfx8) {
+				cart.gfx8.assign(gfx8, gfx8 + sheetSize);
+			}
+			if (font) {
+				cart.font.assign(font, font + sheetSize);
+			}
+			return true;
+		}
+
+		// returns false if there is no valid cache for the cart, in which case cart is unchanged
+		static bool load(const std::string& filename, uint64_t hash, Cart& cart) {
+			size_t size;
+			const uint8_t* data = FILE_MapFile(cacheName(filename), size);
+			if (!data) {
+				return false;
+			}
+
+			Cart c = cart;
+			c.hash = hash;
+			utils::BinaryReader r(data, size);
+			bool ok = read(r, filename, c);
+			FILE_UnmapFile(data, size);
+
+			if (ok) {
+				cart = std::move(c);
+			}
+			return ok;
+		}
+
+		static void save(const Cart& cart) {
+			utils::BinaryWriter w;
+			uint32_t flags = 0;
+			flags |= cart.gfx8.empty() ? 0 : HAS_GFX8;
+			flags |= cart.font.empty() ? 0 : HAS_FONT;
+			w.write(MAGIC);
+			w.write(VERSION);
+			w.write(cart.hash);
+			w.write(flags);
+			w.write((uint32_t)cart.files.size());
+			for (auto& f : cart.files) {
+				w.writeString(f);
+			}
+			w.write((uint32_t)cart.source.size());
+			for (auto& line : cart.source) {
+				w.write((uint16_t)line.file);
+				w.write((uint32_t)line.localLine);
+				w.writeString(line.line);
+			}
+			w.writeBytes(cart.rom.data(), cart.rom.size());
+			w.writeBytes(cart.gfx8.data(), cart.gfx8.size());
+			w.writeBytes(cart.font.data(), cart.font.size());
+
+			std::string name = cacheName(cart.files[0]);
+			if (!FILE_WriteFileAtomic(name, w.data)) {
+				logr << LogLevel::err << "failed to write cart cache: " << name;
+			}
+		}
+	}  // namespace cache
 
 	Cart& getCart() {
-		return loadedCart;
+		return *loadedCart;
+	}
+
+	void selectCart(Cart* cart) {
+		loadedCart = cart ? cart : &defaultCart;
 	}
 
 	// if the filename begins with a $ then the path of the new cart of relative to the one
@@ -206,9 +539,9 @@ namespace pico_cart {
 
 		filename = path::normalisePath(filename);
 
-		if (loadedCart.sections.find("base_path") != loadedCart.sections.end() &&
+		if (loadedCart->sections.find("base_path") != loadedCart->sections.end() &&
 		    filename.length() && filename[0] == '$') {
-			filename = loadedCart.sections["base_path"] + filename.substr(1);
+			filename = loadedCart->sections["base_path"] + filename.substr(1);
 		}
 
 		std::string data = FILE_LoadFile(filename);
@@ -217,15 +550,31 @@ namespace pico_cart {
 			throw error(std::string("failed to open cart file: ") + filename);
 		}
 
-		loadedCart = Cart{};
+		*loadedCart = Cart{};
 		logr << "Loading cart: " << filename;
-		loadedCart.sections["filename"] = filename;
-		loadedCart.sections["base_path"] = path::getPath(filename);
-		loadedCart.sections["cart_name"] = path::splitFilename(path::getFilename(filename)).first;
-		loadedCart.sections["cur_sect"] = "header";
-
-		std::istringstream s(data);
-		do_load(s, loadedCart, filename);
+		loadedCart->sections["filename"] = filename;
+		loadedCart->sections["base_path"] = path::getPath(filename);
+		loadedCart->sections["cart_name"] = path::splitFilename(path::getFilename(filename)).first;
+		loadedCart->sections["cur_sect"] = "header";
+
+		uint64_t hash = utils::fnv1a(data.data(), data.size());
+		if (p8png::isPng(data)) {
+			// strip the .p8 from name.p8.png so assets are found relative to the cart name
+			auto name = path::splitFilename(loadedCart->sections["cart_name"]);
+			if (name.second == "p8") {
+				loadedCart->sections["cart_name"] = name.first;
+			}
+			loadedCart->hash = hash;
+			loadedCart->files.push_back(filename);
+			p8png::load(data, *loadedCart);
+		} else if (cache::load(filename, hash, *loadedCart)) {
+			logr << "Loaded cart from cache";
+		} else {
+			loadedCart->hash = hash;
+			std::istringstream s(data);
+			do_load(s, *loadedCart, filename);
+		}
+		buildLineTable(*loadedCart);
 	}
 
 	void extractAssets(Cart& cart);
@@ -235,7 +584,7 @@ namespace pico_cart {
 
 		logr << "Request asset load: " << filename;
 		filename = path::normalisePath(filename);
-		filename = loadedCart.sections["base_path"] + filename;
+		filename = loadedCart->sections["base_path"] + filename;
 
 		std::string data = FILE_LoadFile(filename);
 		logr << "loaded: " << data.size() << "bytes";
@@ -249,6 +598,18 @@ namespace pico_cart {
 	}
 
 	void extractAssets(Cart& cart) {
+		if (!cart.rom.empty()) {
+			pico_control::set_rom_data(cart.rom.data());
+			if (!cart.gfx8.empty()) {
+				pico_control::set_sprite_data_raw(cart.gfx8.data());
+			}
+			if (!cart.font.empty()) {
+				pico_control::set_font_data_raw(cart.font.data());
+			}
+			pico_control::init_rom();
+			return;
+		}
+
 		pico_control::set_sprite_data_4bit(cart.sections["__gfx__"]);
 		pico_control::set_sprite_data_8bit(cart.sections["__gfx8__"]);
 		pico_control::set_sprite_flags(cart.sections["__gff__"]);
@@ -259,8 +620,28 @@ namespace pico_cart {
 		pico_control::init_rom();
 	}
 
+	// the first time a cart is extracted its decoded assets are kept so restarts skip the
+	// section parsing, and written to the cart cache for the next load.
+	static void compileCart(Cart& cart) {
+		cart.rom.resize(pico_control::ROM_DATA_SIZE);
+		pico_control::get_rom_data(cart.rom.data());
+		if (!cart.sections["__gfx8__"].empty()) {
+			cart.gfx8.resize(pico_control::SPRITE_DATA_SIZE);
+			pico_control::get_sprite_data_raw(cart.gfx8.data());
+		}
+		if (!cart.sections["__font__"].empty()) {
+			cart.font.resize(pico_control::SPRITE_DATA_SIZE);
+			pico_control::get_font_data_raw(cart.font.data());
+		}
+		cache::save(cart);
+	}
+
 	void extractCart(Cart& cart) {
+		bool compiled = !cart.rom.empty();
 		extractAssets(cart);
+		if (!compiled && !cart.files.empty()) {
+			compileCart(cart);
+		}
 		pico_script::load(cart);
 	}
 
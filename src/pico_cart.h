@@ -1,6 +1,7 @@
 #ifndef PICO_CART_H
 #define PICO_CART_H
 
+#include <stdint.h>
 #include <map>
 #include <stack>
 #include <stdexcept>
@@ -16,25 +17,41 @@ namespace pico_cart {
 	struct Line {
 		int file;
 		std::string line;
+		int localLine;  // line number within file, 1 based
 	};
 
 	struct Cart {
 		std::map<std::string, std::string> sections;
 		std::vector<Line> source;
 		std::vector<std::string> files;
+
+		// maps a file's local line numbers back to source lines, -1 where there is no source.
+		std::vector<std::vector<int>> lineTable;
+
+		// content hash of the cart and its include files.
+		uint64_t hash = 0;
+
+		// decoded asset data. when present this is used in place of the section text.
+		std::vector<uint8_t> rom;   // 0x0000-0x42ff
+		std::vector<uint8_t> gfx8;  // 8 bit sprite sheet, empty if the cart has none
+		std::vector<uint8_t> font;  // font sheet, empty if the cart has none
 	};
 
 	void load(std::string filename);
 	void loadassets(std::string filename, Cart& parentCart);
 	void extractCart(Cart& cart);
 	Cart& getCart();
+	void selectCart(Cart* cart);
 
 	struct LineInfo {
 		std::string filename;
 		int localLineNum;
 		std::string sourceLine;
 	};
+	void buildLineTable(Cart& cart);
 	LineInfo getLineInfo(const Cart& cart, int lineNum);
+	int getGlobalLine(const Cart& cart, int file, int localLine);
+	int findFile(const Cart& cart, const std::string& filename);
 	std::string convert_emojis(const std::string& lua);
 
 }  // namespace pico_cart
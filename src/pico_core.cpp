@@ -5,6 +5,10 @@
 
 #include <algorithm>
 #include <array>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
 
 #include "config.h"
 #include "log.h"
@@ -12,14 +16,10 @@
 #include "pico_cart.h"
 #include "pico_gfx.h"
 #include "pico_memory.h"
+#include "pico_rewind.h"
 #include "pico_script.h"
 #include "utils.h"
 
-static pico_api::colour_t* backbuffer = nullptr;
-
-static int buffer_size_x = 0;
-static int buffer_size_y = 0;
-
 struct InputState {
 	uint8_t old = 0;
 	uint8_t current = 0;
@@ -67,111 +67,180 @@ struct InputState {
 	}
 };
 
-static std::string lastLoadedCart;
-
-static InputState inputState[4];
-static MouseState mouseState;
-static std::string cartDataName;
-static bool pauseMenuRequested = false;
-static bool pauseMenuActive = false;
-
 struct SpriteSheet {
 	pico_api::colour_t sprite_data[128 * 128];
 	uint8_t flags[256];
 };
 
-static SpriteSheet spriteSheet;
-static SpriteSheet* currentSprData = &spriteSheet;
-static std::map<int, SpriteSheet> extendedSpriteSheets;
-
-static SpriteSheet fontSheet;
-static SpriteSheet* currentFontData = &fontSheet;
-static std::map<int, SpriteSheet> extendedFontSheets;
-
 struct MapSheet {
 	uint8_t map_data[128 * 64];
 };
 
-static uint8_t cart_data[pico_ram::MEM_CART_DATA_SIZE] = {0};
-static uint8_t scratch_data[pico_ram::MEM_SCRATCH_SIZE] = {0};
-static uint8_t music_data[pico_ram::MEM_MUSIC_SIZE] = {0};
-static uint8_t sfx_data[pico_ram::MEM_SFX_SIZE] = {0};
-
-static MapSheet mapSheet;
-static MapSheet* currentMapData = &mapSheet;
-static std::map<int, MapSheet> extendedMapSheets;
-
-static pico_ram::RAM ram;
-static pico_ram::SplitNibbleMemoryArea mem_gfx(spriteSheet.sprite_data,
-                                               pico_ram::MEM_GFX_ADDR,
-                                               pico_ram::MEM_GFX_SIZE);
-static pico_ram::SplitNibbleMemoryArea mem_gfx2(spriteSheet.sprite_data + 128 * 64,
-                                                pico_ram::MEM_GFX2_MAP2_ADDR,
-                                                pico_ram::MEM_GFX2_MAP2_SIZE);
-static pico_ram::LinearMemoryArea mem_map2(mapSheet.map_data + 128 * 32,
-                                           pico_ram::MEM_GFX2_MAP2_ADDR,
-                                           pico_ram::MEM_GFX2_MAP2_SIZE);
-static pico_ram::DualMemoryArea mem_gfx2_map2(&mem_map2,
-                                              &mem_gfx2);  // shared memory between gfx2 & map2
-static pico_ram::LinearMemoryArea mem_map(mapSheet.map_data,
-                                          pico_ram::MEM_MAP_ADDR,
-                                          pico_ram::MEM_MAP_SIZE);
-static pico_ram::LinearMemoryArea mem_flags(spriteSheet.flags,
-                                            pico_ram::MEM_GFX_PROPS_ADDR,
-                                            pico_ram::MEM_GFX_PROPS_SIZE);
-static pico_ram::SplitNibbleMemoryArea mem_screen(backbuffer,
-                                                  pico_ram::MEM_SCREEN_ADDR,
-                                                  pico_ram::MEM_SCREEN_SIZE);
-
-static pico_ram::LinearMemoryAreaDF mem_cart_data(cart_data,
-                                                  pico_ram::MEM_CART_DATA_ADDR,
-                                                  pico_ram::MEM_CART_DATA_SIZE);
-
-static pico_ram::LinearMemoryArea mem_scratch_data(scratch_data,
-                                                   pico_ram::MEM_SCRATCH_ADDR,
-                                                   pico_ram::MEM_SCRATCH_SIZE);
-
-static pico_ram::LinearMemoryArea mem_music_data(music_data,
-                                                 pico_ram::MEM_MUSIC_ADDR,
-                                                 pico_ram::MEM_MUSIC_SIZE);
-
-static pico_ram::LinearMemoryArea mem_sfx_data(sfx_data,
-                                               pico_ram::MEM_SFX_ADDR,
-                                               pico_ram::MEM_SFX_SIZE);
-
-static uint8_t cartrom[0x4300];
+namespace pico_control {
+
+	struct CoreContext {
+		CoreContext() = default;
+		CoreContext(const CoreContext&) = delete;
+		CoreContext& operator=(const CoreContext&) = delete;
+
+		pico_api::colour_t* backbuffer = nullptr;
+
+		int buffer_size_x = 0;
+		int buffer_size_y = 0;
+
+		std::string lastLoadedCart;
+
+		InputState inputState[4];
+		MouseState mouseState;
+		std::string cartDataName;
+		bool pauseMenuRequested = false;
+		bool pauseMenuActive = false;
+		bool saveStateRequested = false;
+		bool loadStateRequested = false;
+		int screenshotScale = -1;  // -1 when no screenshot is requested, 0 for the default scale
+
+		SpriteSheet spriteSheet;
+		SpriteSheet* currentSprData = &spriteSheet;
+		std::map<int, SpriteSheet> extendedSpriteSheets;
+		// the sprite page drawn to in place of the screen, see pico_apix::target
+		SpriteSheet* target = nullptr;
+		int targetPage = 0;
+		int targetW = 0;
+		int targetH = 0;
+
+		SpriteSheet fontSheet;
+		SpriteSheet* currentFontData = &fontSheet;
+		std::map<int, SpriteSheet> extendedFontSheets;
+
+		uint8_t cart_data[pico_ram::MEM_CART_DATA_SIZE] = {0};
+		uint8_t scratch_data[pico_ram::MEM_SCRATCH_SIZE] = {0};
+		uint8_t music_data[pico_ram::MEM_MUSIC_SIZE] = {0};
+		uint8_t sfx_data[pico_ram::MEM_SFX_SIZE] = {0};
+
+		MapSheet mapSheet;
+		MapSheet* currentMapData = &mapSheet;
+		std::map<int, MapSheet> extendedMapSheets;
+
+		pico_ram::RAM ram;
+		pico_ram::SplitNibbleMemoryArea mem_gfx{
+		    spriteSheet.sprite_data, pico_ram::MEM_GFX_ADDR, pico_ram::MEM_GFX_SIZE};
+		pico_ram::SplitNibbleMemoryArea mem_gfx2{spriteSheet.sprite_data + 128 * 64,
+		                                         pico_ram::MEM_GFX2_MAP2_ADDR,
+		                                         pico_ram::MEM_GFX2_MAP2_SIZE};
+		pico_ram::LinearMemoryArea mem_map2{mapSheet.map_data + 128 * 32,
+		                                    pico_ram::MEM_GFX2_MAP2_ADDR,
+		                                    pico_ram::MEM_GFX2_MAP2_SIZE};
+		// shared memory between gfx2 & map2
+		pico_ram::DualMemoryArea mem_gfx2_map2{&mem_map2, &mem_gfx2};
+		pico_ram::LinearMemoryArea mem_map{
+		    mapSheet.map_data, pico_ram::MEM_MAP_ADDR, pico_ram::MEM_MAP_SIZE};
+		pico_ram::LinearMemoryArea mem_flags{
+		    spriteSheet.flags, pico_ram::MEM_GFX_PROPS_ADDR, pico_ram::MEM_GFX_PROPS_SIZE};
+		pico_ram::SplitNibbleMemoryArea mem_screen{
+		    backbuffer, pico_ram::MEM_SCREEN_ADDR, pico_ram::MEM_SCREEN_SIZE};
+
+		pico_ram::LinearMemoryAreaDF mem_cart_data{
+		    cart_data, pico_ram::MEM_CART_DATA_ADDR, pico_ram::MEM_CART_DATA_SIZE};
+
+		pico_ram::LinearMemoryArea mem_scratch_data{
+		    scratch_data, pico_ram::MEM_SCRATCH_ADDR, pico_ram::MEM_SCRATCH_SIZE};
+
+		pico_ram::LinearMemoryArea mem_music_data{
+		    music_data, pico_ram::MEM_MUSIC_ADDR, pico_ram::MEM_MUSIC_SIZE};
+
+		pico_ram::LinearMemoryArea mem_sfx_data{
+		    sfx_data, pico_ram::MEM_SFX_ADDR, pico_ram::MEM_SFX_SIZE};
+
+		uint8_t cartrom[0x4300];
+	};
 
-namespace pico_private {
-	using namespace pico_api;
+}  // namespace pico_control
 
-	void copy_cartdata_to_ram(const std::string& data) {
-		uint16_t addr = pico_ram::MEM_CART_DATA_ADDR;
+// the context of the machine running on this thread
+static pico_control::CoreContext defaultCore;
+static thread_local pico_control::CoreContext* core = &defaultCore;
 
-		std::string buf;
+static const uint32_t STATE_MAGIC = 0x53533854;  // "T8SS"
+static const uint32_t STATE_VERSION = 5;
 
-		for (size_t n = 0; n < data.length(); n++) {
-			if (data[n] > ' ') {
-				buf += data[n];
-				if (buf.length() == 8) {
-					pico_api::poke4(addr, strtol(buf.c_str(), nullptr, 16));
-					addr += 4;
-					buf.clear();
-				}
+namespace pico_private {
+	using namespace pico_api;
+
+	// hex digit values, whitespace is marked with 0xff and skipped. any other character decodes
+	// as 0 as it did with strtol.
+	struct HexTable {
+		uint8_t value[256];
+		HexTable() {
+			memset(value, 0, sizeof(value));
+			for (int c = 0; c <= ' '; c++) {
+				value[c] = 0xff;
+			}
+			for (int n = 0; n < 10; n++) {
+				value['0' + n] = n;
+			}
+			for (int n = 0; n < 6; n++) {
+				value['a' + n] = value['A' + n] = 10 + n;
 			}
 		}
-		mem_cart_data.clearDirty();
+	};
+	static const HexTable hexTable;
+
+	// decodes one hex digit per output byte, used for pixel data where each digit is a pixel.
+	size_t decode_hex_nibbles(const std::string& data, uint8_t* dest, size_t max) {
+		const uint8_t* p = (const uint8_t*)data.data();
+		const uint8_t* end = p + data.size();
+		size_t n = 0;
+		while (p < end && n < max) {
+			uint8_t v = hexTable.value[*p++];
+			if (v != 0xff) {
+				dest[n++] = v;
+			}
+		}
+		return n;
+	}
+
+	// decodes pairs of hex digits, high nibble first.
+	size_t decode_hex_bytes(const std::string& data, uint8_t* dest, size_t max) {
+		const uint8_t* p = (const uint8_t*)data.data();
+		const uint8_t* end = p + data.size();
+		size_t n = 0;
+		while (p < end && n < max) {
+			uint8_t hi = hexTable.value[*p++];
+			if (hi != 0xff) {
+				uint8_t lo = p < end ? hexTable.value[*p++] : 0;
+				dest[n++] = (hi << 4) | (lo & 0x0f);
+			}
+		}
+		return n;
+	}
+
+	// cart data is stored as 8 digit big endian hex values.
+	void copy_cartdata_to_ram(const std::string& data) {
+		uint8_t bytes[pico_ram::MEM_CART_DATA_SIZE] = {0};
+		size_t len = decode_hex_bytes(data, bytes, sizeof(bytes)) & ~3;
+		for (size_t n = 0; n < len; n += 4) {
+			core->cart_data[n + 0] = bytes[n + 3];
+			core->cart_data[n + 1] = bytes[n + 2];
+			core->cart_data[n + 2] = bytes[n + 1];
+			core->cart_data[n + 3] = bytes[n + 0];
+		}
+		core->mem_cart_data.clearDirty();
 	}
 
 	std::string get_cartdata_as_str() {
+		static const char hex[] = "0123456789abcdef";
 		uint16_t addr = pico_ram::MEM_CART_DATA_ADDR;
 		uint16_t len = pico_ram::MEM_CART_DATA_SIZE;
 
+		// 8 hex digits per value, 8 values per line
 		std::string result;
-		char buffer[16];
+		result.reserve(len * 2 + len / 32);
 		int pos = 0;
 		for (int32_t n = addr; n < (addr + len); n += 4) {
-			sprintf(buffer, "%08x", peek4(n));
-			result += buffer;
+			uint32_t v = peek4(n);
+			for (int shift = 28; shift >= 0; shift -= 4) {
+				result += hex[(v >> shift) & 0xf];
+			}
 			pos++;
 			if (pos == 8) {
 				result += '\n';
@@ -182,93 +251,283 @@ namespace pico_private {
 		return result;
 	}
 
-	void copy_data_to_ram(uint16_t addr, const std::string& data) {
-		for (size_t n = 0; n < data.length(); n++) {
-			char buf[3] = {0};
-
-			if (data[n] > ' ') {
-				buf[0] = data[n++];
-				buf[1] = data[n];
-				pico_api::poke(addr++, (uint8_t)strtol(buf, nullptr, 16));
+	void save_cartdata() {
+		if (core->mem_cart_data.isDirty()) {
+			if (!core->cartDataName.empty()) {
+				FILE_QueueGameState(core->cartDataName + ".p8d.txt", get_cartdata_as_str());
 			}
+			core->mem_cart_data.clearDirty();
 		}
 	}
 
-	void copy_gfxdata_to_ram(uint16_t addr, const std::string& data) {
-		for (size_t n = 0; n < data.length(); n++) {
-			char buf[3] = {0};
-
-			if (data[n] > ' ') {
-				buf[1] = data[n++];
-				buf[0] = data[n];
-				pico_api::poke(addr++, (uint8_t)strtol(buf, nullptr, 16));
+	void copy_data_to_ram(uint16_t addr, const std::string& data) {
+		std::vector<uint8_t> bytes(0x8000 - (addr & 0x7fff));
+		size_t len = decode_hex_bytes(data, bytes.data(), bytes.size());
+		core->ram.write(addr, bytes.data(), (uint16_t)len);
+	}
+
+	// gfx data is one digit per pixel so decodes straight into the sprite sheet. the lower
+	// half of the sheet shares memory with the lower half of the map so that is updated too.
+	void copy_gfxdata_to_sheet(SpriteSheet& sprites, const std::string& data, bool shared) {
+		const size_t halfSheet = 128 * 64;
+		size_t len = decode_hex_nibbles(data, sprites.sprite_data, sizeof(sprites.sprite_data));
+		if (shared && len > halfSheet) {
+			const uint8_t* pixels = sprites.sprite_data + halfSheet;
+			uint8_t* map2 = core->mapSheet.map_data + 128 * 32;
+			for (size_t n = 0; n < (len - halfSheet) / 2; n++) {
+				map2[n] = pixels[n * 2] | (pixels[n * 2 + 1] << 4);
 			}
 		}
 	}
 
 	void copy_data_to_sprites(SpriteSheet& sprites, const std::string& data, bool bits8) {
-		uint16_t i = 0;
-
-		for (size_t n = 0; n < data.length(); n++) {
-			char buf[3] = {0};
-
-			if (data[n] > ' ') {
-				buf[0] = data[n++];
-				buf[1] = data[n];
-				auto val = (uint8_t)strtol(buf, nullptr, 16);
-				if (bits8) {
-					sprites.sprite_data[i++] = val;
-				} else {
-					sprites.sprite_data[i++] = val >> 4;
-					sprites.sprite_data[i++] = val & 0x0f;
-				}
+		if (bits8) {
+			decode_hex_bytes(data, sprites.sprite_data, sizeof(sprites.sprite_data));
+		} else {
+			decode_hex_nibbles(data, sprites.sprite_data, sizeof(sprites.sprite_data));
+		}
+	}
+
+
+	// extended sheets are saved as (page, sheet) pairs followed by the page in use.
+	template <typename T>
+	static void save_pages(utils::BinaryWriter& w,
+	                       const std::map<int, T>& pages,
+	                       const T* current) {
+		bool extended = false;
+		int32_t page = 0;
+		w.write((uint32_t)pages.size());
+		for (auto& p : pages) {
+			w.write((int32_t)p.first);
+			w.write(p.second);
+			if (&p.second == current) {
+				extended = true;
+				page = p.first;
 			}
 		}
+		w.write(extended);
+		w.write(page);
+	}
+
+	// pages are read into a map that is swapped in when the state is applied, the current page
+	// returned is a node of that map or base.
+	template <typename T>
+	static T* load_pages(utils::BinaryReader& r, std::map<int, T>& pages, T* base) {
+		uint32_t count = r.read<uint32_t>();
+		for (uint32_t n = 0; n < count && r.ok(); n++) {
+			int page = r.read<int32_t>();
+			r.readBytes(&pages[page], sizeof(T));
+		}
+		bool extended = r.read<bool>();
+		int page = r.read<int32_t>();
+		return extended ? &pages[page] : base;
 	}
 
+	// an extended sprite page, created blank the first time it is used
+	static SpriteSheet* sprite_page(int page) {
+		if (core->extendedSpriteSheets.find(page) == core->extendedSpriteSheets.end()) {
+			memset(&core->extendedSpriteSheets[page], 0, sizeof(SpriteSheet));
+		}
+		return &core->extendedSpriteSheets[page];
+	}
+
+	static void core_save_state(utils::BinaryWriter& w) {
+		w.write(core->spriteSheet);
+		w.write(core->fontSheet);
+		w.write(core->mapSheet);
+		save_pages(w, core->extendedSpriteSheets, core->currentSprData);
+		save_pages(w, core->extendedFontSheets, core->currentFontData);
+		save_pages(w, core->extendedMapSheets, core->currentMapData);
+
+		w.write(core->cart_data);
+		w.write(core->scratch_data);
+		w.write(core->music_data);
+		w.write(core->sfx_data);
+
+		w.write((int32_t)core->buffer_size_x);
+		w.write((int32_t)core->buffer_size_y);
+		w.writeBytes(core->backbuffer, core->buffer_size_x * core->buffer_size_y);
+		w.write(core->target != nullptr);
+		w.write((int32_t)core->targetPage);
+		w.write((int32_t)core->targetW);
+		w.write((int32_t)core->targetH);
+
+		w.write(core->inputState);
+		w.write(core->mouseState);
+		w.writeString(core->cartDataName);
+	}
+
+	// the core section of a save state, read in full before any of it is applied
+	struct CoreState {
+		SpriteSheet spriteSheet;
+		SpriteSheet fontSheet;
+		MapSheet mapSheet;
+		std::map<int, SpriteSheet> extendedSpriteSheets;
+		std::map<int, SpriteSheet> extendedFontSheets;
+		std::map<int, MapSheet> extendedMapSheets;
+		SpriteSheet* currentSprData = nullptr;
+		SpriteSheet* currentFontData = nullptr;
+		MapSheet* currentMapData = nullptr;
+
+		uint8_t cart_data[pico_ram::MEM_CART_DATA_SIZE];
+		uint8_t scratch_data[pico_ram::MEM_SCRATCH_SIZE];
+		uint8_t music_data[pico_ram::MEM_MUSIC_SIZE];
+		uint8_t sfx_data[pico_ram::MEM_SFX_SIZE];
+
+		int screenW = 0;
+		int screenH = 0;
+		const uint8_t* screen = nullptr;  // in the state data
+		bool targeted = false;
+		int targetPage = 0;
+		int targetW = 0;
+		int targetH = 0;
+
+		InputState inputState[4];
+		MouseState mouseState;
+		std::string cartDataName;
+	};
+
+	static void core_apply_state(CoreState& s, bool cartData) {
+		// the sprite pages are replaced, so nothing can be drawn to the old ones
+		pico_apix::target();
+		core->spriteSheet = s.spriteSheet;
+		core->fontSheet = s.fontSheet;
+		core->mapSheet = s.mapSheet;
+		// swapping keeps the pages where they are, so the current page pointers stay valid
+		core->extendedSpriteSheets.swap(s.extendedSpriteSheets);
+		core->extendedFontSheets.swap(s.extendedFontSheets);
+		core->extendedMapSheets.swap(s.extendedMapSheets);
+		core->currentSprData = s.currentSprData;
+		core->currentFontData = s.currentFontData;
+		core->currentMapData = s.currentMapData;
+		pico_control::set_spritebuffer(core->currentSprData->sprite_data);
+		pico_control::set_spriteflags(core->currentSprData->flags);
+		pico_control::set_fontbuffer(core->currentFontData->sprite_data);
+		pico_control::set_mapbuffer(core->currentMapData->map_data);
+
+		// written through ram so restored cart data is marked for saving
+		if (cartData) {
+			core->ram.write(pico_ram::MEM_CART_DATA_ADDR, s.cart_data, sizeof(s.cart_data));
+		}
+		memcpy(core->scratch_data, s.scratch_data, sizeof(s.scratch_data));
+		memcpy(core->music_data, s.music_data, sizeof(s.music_data));
+		memcpy(core->sfx_data, s.sfx_data, sizeof(s.sfx_data));
+
+		pico_apix::screen(s.screenW, s.screenH);
+		memcpy(core->backbuffer, s.screen, s.screenW * s.screenH);
+		if (s.targeted) {
+			pico_apix::target(s.targetPage, s.targetW, s.targetH);
+		}
+
+		memcpy(core->inputState, s.inputState, sizeof(s.inputState));
+		core->mouseState = s.mouseState;
+		core->cartDataName = s.cartDataName;
+	}
+
+	// reads the core section and returns the function that applies it, or an empty function if
+	// the section is bad
+	static std::function<void()> core_load_state(utils::BinaryReader& r, bool cartData) {
+		std::shared_ptr<CoreState> s = std::make_shared<CoreState>();
+		r.readBytes(&s->spriteSheet, sizeof(s->spriteSheet));
+		r.readBytes(&s->fontSheet, sizeof(s->fontSheet));
+		r.readBytes(&s->mapSheet, sizeof(s->mapSheet));
+		s->currentSprData = load_pages(r, s->extendedSpriteSheets, &core->spriteSheet);
+		s->currentFontData = load_pages(r, s->extendedFontSheets, &core->fontSheet);
+		s->currentMapData = load_pages(r, s->extendedMapSheets, &core->mapSheet);
+
+		r.readBytes(s->cart_data, sizeof(s->cart_data));
+		r.readBytes(s->scratch_data, sizeof(s->scratch_data));
+		r.readBytes(s->music_data, sizeof(s->music_data));
+		r.readBytes(s->sfx_data, sizeof(s->sfx_data));
+
+		s->screenW = r.read<int32_t>();
+		s->screenH = r.read<int32_t>();
+		if (s->screenW < config::MIN_SCREEN_WIDTH || s->screenW > config::MAX_SCREEN_WIDTH ||
+		    s->screenH < config::MIN_SCREEN_HEIGHT || s->screenH > config::MAX_SCREEN_HEIGHT) {
+			return nullptr;
+		}
+		s->screen = r.skip(s->screenW * s->screenH);
+		s->targeted = r.read<bool>();
+		s->targetPage = r.read<int32_t>();
+		s->targetW = r.read<int32_t>();
+		s->targetH = r.read<int32_t>();
+		if (s->targeted && (s->targetW < 1 || s->targetW > 128 || s->targetH < 1 ||
+		                    s->targetH > 128)) {
+			return nullptr;
+		}
+
+		r.readBytes(s->inputState, sizeof(s->inputState));
+		r.readBytes(&s->mouseState, sizeof(s->mouseState));
+		s->cartDataName = r.readString();
+		if (!r.ok()) {
+			return nullptr;
+		}
+		return [s, cartData]() { core_apply_state(*s, cartData); };
+	}
+
+	static std::string state_file_name() {
+		return FILE_GetPrefPath() + pico_cart::getCart().sections["cart_name"] + ".p8s";
+	}
 }  // namespace pico_private
 
 namespace pico_control {
 
+	CoreContext* core_create_context() {
+		return new CoreContext();
+	}
+
+	void core_destroy_context(CoreContext* context) {
+		if (context) {
+			delete[] context->backbuffer;
+			delete context;
+		}
+	}
+
+	void core_select_context(CoreContext* context) {
+		core = context ? context : &defaultCore;
+	}
+
 	void init_backbuffer_mem(int x, int y) {
 		TraceFunction();
 		x = utils::limit(x, config::MIN_SCREEN_WIDTH, config::MAX_SCREEN_WIDTH);
 		y = utils::limit(y, config::MIN_SCREEN_HEIGHT, config::MAX_SCREEN_HEIGHT);
 
-		buffer_size_x = x;
-		buffer_size_y = y;
+		core->buffer_size_x = x;
+		core->buffer_size_y = y;
 
-		pico_control::set_backbuffer(backbuffer, x, y, x);
+		// a new screen is drawn to rather than any offscreen target
+		core->target = nullptr;
+		pico_control::set_backbuffer(core->backbuffer, x, y, x);
 	}
 
 	void init() {
 		TraceFunction();
-		if (!backbuffer) {
-			backbuffer = new uint8_t[config::MAX_SCREEN_WIDTH * config::MAX_SCREEN_HEIGHT];
+		if (!core->backbuffer) {
+			core->backbuffer = new uint8_t[config::MAX_SCREEN_WIDTH * config::MAX_SCREEN_HEIGHT];
 		}
 		gfx_init();
 
 		init_backbuffer_mem(config::INIT_SCREEN_WIDTH, config::INIT_SCREEN_HEIGHT);
-		pico_control::set_spritebuffer(spriteSheet.sprite_data);
-		pico_control::set_spriteflags(spriteSheet.flags);
-		pico_control::set_mapbuffer(mapSheet.map_data);
-		pico_control::set_fontbuffer(fontSheet.sprite_data);
+		pico_control::set_spritebuffer(core->spriteSheet.sprite_data);
+		pico_control::set_spriteflags(core->spriteSheet.flags);
+		pico_control::set_mapbuffer(core->mapSheet.map_data);
+		pico_control::set_fontbuffer(core->fontSheet.sprite_data);
 
-		mem_screen.setData(backbuffer);
+		core->mem_screen.setData(core->backbuffer);
 
-		cartDataName = "";
+		core->cartDataName = "";
 
-		pauseMenuActive = false;
+		core->pauseMenuActive = false;
 
-		ram.addMemoryArea(&mem_gfx);
-		ram.addMemoryArea(&mem_gfx2_map2);
-		ram.addMemoryArea(&mem_map);
-		ram.addMemoryArea(&mem_flags);
-		ram.addMemoryArea(&mem_screen);
-		ram.addMemoryArea(&mem_cart_data);
-		ram.addMemoryArea(&mem_scratch_data);
-		ram.addMemoryArea(&mem_music_data);
-		ram.addMemoryArea(&mem_sfx_data);
+		core->ram.addMemoryArea(&core->mem_gfx);
+		core->ram.addMemoryArea(&core->mem_gfx2_map2);
+		core->ram.addMemoryArea(&core->mem_map);
+		core->ram.addMemoryArea(&core->mem_flags);
+		core->ram.addMemoryArea(&core->mem_screen);
+		core->ram.addMemoryArea(&core->mem_cart_data);
+		core->ram.addMemoryArea(&core->mem_scratch_data);
+		core->ram.addMemoryArea(&core->mem_music_data);
+		core->ram.addMemoryArea(&core->mem_sfx_data);
 
 		audio_init();
 	}
@@ -277,30 +536,41 @@ namespace pico_control {
 	}
 
 	void frame_end() {
-		if (mem_cart_data.isDirty()) {
-			if (!cartDataName.empty()) {
-				FILE_SaveGameState(cartDataName + ".p8d.txt", pico_private::get_cartdata_as_str());
-			}
-			mem_cart_data.clearDirty();
+		if (core->saveStateRequested) {
+			core->saveStateRequested = false;
+			save_state_file();
 		}
-		if (pauseMenuRequested)
+		if (core->loadStateRequested) {
+			core->loadStateRequested = false;
+			load_state_file();
+		}
+		rewind_frame_end();
+		pico_private::save_cartdata();
+		if (core->pauseMenuRequested)
 			begin_pause_menu();
 	}
 
+	// the screenshot is taken by the player once the frame is complete
+	bool take_screenshot_request(int& scale) {
+		if (core->screenshotScale < 0) {
+			return false;
+		}
+		scale = core->screenshotScale;
+		core->screenshotScale = -1;
+		return true;
+	}
+
 	pico_api::colour_t* get_buffer(int& width, int& height) {
-		width = buffer_size_x;
-		height = buffer_size_y;
-		return backbuffer;
+		width = core->buffer_size_x;
+		height = core->buffer_size_y;
+		return core->backbuffer;
 	}
 
 	void set_sprite_data_4bit(std::string data) {
 		TraceFunction();
 		if (data.size()) {
-			if (currentSprData == &spriteSheet) {
-				pico_private::copy_gfxdata_to_ram(pico_ram::MEM_GFX_ADDR, data);
-			} else {
-				pico_private::copy_data_to_sprites(*currentSprData, data, false);
-			}
+			bool shared = core->currentSprData == &core->spriteSheet;
+			pico_private::copy_gfxdata_to_sheet(*core->currentSprData, data, shared);
 		}
 	}
 
@@ -308,7 +578,7 @@ namespace pico_control {
 		TraceFunction();
 		if (data.size()) {
 			logr << " loading 8bit sprite data";
-			pico_private::copy_data_to_sprites(*currentSprData, data, true);
+			pico_private::copy_data_to_sprites(*core->currentSprData, data, true);
 		}
 	}
 
@@ -319,7 +589,7 @@ namespace pico_control {
 
 	void set_font_data(std::string data) {
 		TraceFunction();
-		pico_private::copy_data_to_sprites(*currentFontData, data, false);
+		pico_private::copy_data_to_sprites(*core->currentFontData, data, false);
 	}
 
 	void set_map_data(std::string data) {
@@ -328,51 +598,58 @@ namespace pico_control {
 	}
 
 	void set_input_state(int state, int player) {
-		inputState[player].set(state);
+		core->inputState[player].set(state);
 		if (player == 0) {
-			if (inputState[0].justPressed(6) && !is_pause_menu()) {
-				pauseMenuRequested = true;
+			if (core->inputState[0].justPressed(6) && !is_pause_menu()) {
+				core->pauseMenuRequested = true;
 			}
 		}
 	}
 
 	void set_mouse_state(const MouseState& ms) {
-		mouseState = ms;
+		core->mouseState = ms;
 	}
 
 	void test_integrity() {
 	}
 
+	void flush_cartdata() {
+		pico_private::save_cartdata();
+		FILE_FlushGameState();
+	}
+
 	void begin_pause_menu() {
+		flush_cartdata();
 		pico_apix::gfxstate(-1);
-		pauseMenuRequested = false;
-		pauseMenuActive = true;
+		core->pauseMenuRequested = false;
+		core->pauseMenuActive = true;
 	}
 
 	bool is_pause_menu() {
-		return pauseMenuActive;
+		return core->pauseMenuActive;
 	}
 
 	void end_pause_menu() {
-		pauseMenuActive = false;
+		core->pauseMenuActive = false;
 		pico_apix::gfxstate(0);
 	}
 
 	uint8_t* get_music_data() {
-		return music_data;
+		return core->music_data;
 	}
 	uint8_t* get_sfx_data() {
-		return sfx_data;
+		return core->sfx_data;
 	}
 
 	void restartCart() {
 		TraceFunction();
-		pauseMenuActive = false;
+		core->pauseMenuActive = false;
 		gfx_init();
 		init_backbuffer_mem(config::INIT_SCREEN_WIDTH, config::INIT_SCREEN_HEIGHT);
 		stop_all_audio();
 		audio_init();
 		pico_cart::extractCart(pico_cart::getCart());
+		rewind_reset();
 		pico_apix::gfxstate(0);
 		pico_apix::screen(128, 128);
 	}
@@ -395,9 +672,124 @@ namespace pico_control {
 	}
 
 	void init_rom() {
-		for (uint16_t a = 0; a < 0x4300; a++) {
-			cartrom[a] = pico_api::peek(a);
+		core->ram.read(0, core->cartrom, sizeof(core->cartrom));
+	}
+
+	// raw access to the decoded cart data, used to store and restore compiled carts.
+	void set_rom_data(const uint8_t* data) {
+		core->ram.write(0, data, ROM_DATA_SIZE);
+	}
+
+	void get_rom_data(uint8_t* data) {
+		core->ram.read(0, data, ROM_DATA_SIZE);
+	}
+
+	void set_sprite_data_raw(const uint8_t* data) {
+		memcpy(core->currentSprData->sprite_data, data, SPRITE_DATA_SIZE);
+	}
+
+	void get_sprite_data_raw(uint8_t* data) {
+		memcpy(data, core->currentSprData->sprite_data, SPRITE_DATA_SIZE);
+	}
+
+	void set_font_data_raw(const uint8_t* data) {
+		memcpy(core->currentFontData->sprite_data, data, SPRITE_DATA_SIZE);
+	}
+
+	void get_font_data_raw(uint8_t* data) {
+		memcpy(data, core->currentFontData->sprite_data, SPRITE_DATA_SIZE);
+	}
+
+	// a save state is everything needed to resume the cart: memory, extended sheets, graphics
+	// states, playing sounds and the lua globals.
+	void write_state(utils::BinaryWriter& w) {
+		w.write(STATE_MAGIC);
+		w.write(STATE_VERSION);
+		w.write(pico_cart::getCart().hash);
+		pico_private::core_save_state(w);
+		gfx_save_state(w);
+		audio_save_state(w);
+		pico_script::save_state(w);
+	}
+
+	bool read_state(utils::BinaryReader& r, bool cartData) {
+		if (r.read<uint32_t>() != STATE_MAGIC || r.read<uint32_t>() != STATE_VERSION ||
+		    r.read<uint64_t>() != pico_cart::getCart().hash) {
+			logr << LogLevel::err << "save state is not for this cart or version";
+			return false;
+		}
+
+		// every section is read before anything is changed, so a bad state leaves the cart
+		// running as it was
+		auto applyCore = pico_private::core_load_state(r, cartData);
+		auto applyGfx = applyCore ? gfx_load_state(r) : nullptr;
+		auto applyAudio = applyGfx ? audio_load_state(r) : nullptr;
+		if (!applyAudio) {
+			logr << LogLevel::err << "save state is corrupt";
+			return false;
 		}
+
+		// lua tables are restored in place, so the globals are saved first to be put back if the
+		// rest of the state is bad
+		utils::BinaryWriter globals;
+		pico_script::save_state(globals);
+		if (!pico_script::load_state(r) || !r.atEnd()) {
+			utils::BinaryReader gr(globals.data.data(), globals.data.size());
+			pico_script::load_state(gr);
+			logr << LogLevel::err << "save state is corrupt";
+			return false;
+		}
+
+		if (core->pauseMenuActive) {
+			end_pause_menu();
+		}
+		applyCore();
+		applyGfx();
+		applyAudio();
+		return true;
+	}
+
+	std::string save_state() {
+		uint64_t start = TIME_GetProfileTime();
+		utils::BinaryWriter w;
+		write_state(w);
+		logr << LogLevel::perf << "state saved: " << w.data.size() << " bytes in "
+		     << TIME_GetElapsedProfileTime_us(start) << "us";
+		return std::move(w.data);
+	}
+
+	bool load_state(const uint8_t* data, size_t size) {
+		uint64_t start = TIME_GetProfileTime();
+		utils::BinaryReader r(data, size);
+		if (!read_state(r)) {
+			return false;
+		}
+		logr << LogLevel::perf << "state loaded: " << size << " bytes in "
+		     << TIME_GetElapsedProfileTime_us(start) << "us";
+		return true;
+	}
+
+	void save_state_file() {
+		if (core->pauseMenuActive) {
+			logr << LogLevel::err << "state not saved, pause menu is active";
+			return;
+		}
+		std::string name = pico_private::state_file_name();
+		if (!FILE_WriteFileAtomic(name, save_state())) {
+			logr << LogLevel::err << "failed to write save state: " << name;
+		}
+	}
+
+	void load_state_file() {
+		std::string name = pico_private::state_file_name();
+		size_t size;
+		const uint8_t* data = FILE_MapFile(name, size);
+		if (!data) {
+			logr << LogLevel::err << "no save state: " << name;
+			return;
+		}
+		load_state(data, size);
+		FILE_UnmapFile(data, size);
 	}
 
 }  // namespace pico_control
@@ -406,8 +798,9 @@ namespace pico_api {
 
 	void load(std::string cartname) {
 		TraceFunction();
+		pico_control::flush_cartdata();
 		pico_cart::load(cartname);
-		lastLoadedCart = cartname;
+		core->lastLoadedCart = cartname;
 		pico_control::restartCart();
 	}
 
@@ -426,7 +819,7 @@ namespace pico_api {
 		if (a >= 0x5f00 && a <= 0x5f3f) {
 			return gfx_peek(a);
 		} else {
-			return ram.peek(a);
+			return core->ram.peek(a);
 		}
 	}
 
@@ -449,7 +842,7 @@ namespace pico_api {
 		if (a >= 0x5f00 && a <= 0x5f3f) {
 			gfx_poke(a, v);
 		} else {
-			ram.poke(a, v);
+			core->ram.poke(a, v);
 		}
 	}
 
@@ -486,8 +879,8 @@ namespace pico_api {
 	}
 
 	void cartdata(std::string name) {
-		cartDataName = name;
-		std::string data = FILE_LoadGameState(cartDataName + ".p8d.txt");
+		core->cartDataName = name;
+		std::string data = FILE_LoadGameState(core->cartDataName + ".p8d.txt");
 		pico_private::copy_cartdata_to_ram(data);
 	}
 
@@ -500,23 +893,23 @@ namespace pico_api {
 	}
 
 	int btn() {
-		return inputState[0].current;
+		return core->inputState[0].current;
 	}
 
 	int btn(int n, int player) {
 		if (player < 0 || player > 3)
 			return 0;
-		return inputState[player].isPressed(n);
+		return core->inputState[player].isPressed(n);
 	}
 
 	int btnp() {
-		return inputState[0].justPressed();  // TODO: impl repeat on this
+		return core->inputState[0].justPressed();  // TODO: impl repeat on this
 	}
 
 	int btnp(int n, int player) {
 		if (player < 0 || player > 3)
 			return 0;
-		return inputState[player].justPressedRpt(n);
+		return core->inputState[player].justPressedRpt(n);
 	}
 
 	int stat(int key, std::string& sval, int& ival, double& fval) {
@@ -535,16 +928,16 @@ namespace pico_api {
 				ival = HAL_GetFrameRate('s');
 				return 2;
 			case 32:
-				ival = mouseState.x;
+				ival = core->mouseState.x;
 				return 2;
 			case 33:
-				ival = mouseState.y;
+				ival = core->mouseState.y;
 				return 2;
 			case 34:
-				ival = mouseState.buttons;
+				ival = core->mouseState.buttons;
 				return 2;
 			case 36:
-				ival = mouseState.wheel;
+				ival = core->mouseState.wheel;
 				return 2;
 			case 102:
 				sval = TOSTRING(TAC08_PLATFORM);
@@ -556,10 +949,10 @@ namespace pico_api {
 				sval = pico_cart::getCart().sections["cart_name"];
 				return 1;
 			case 410:
-				ival = buffer_size_x;
+				ival = core->buffer_size_x;
 				return 2;
 			case 411:
-				ival = buffer_size_y;
+				ival = core->buffer_size_y;
 				return 2;
 			case 412: {
 				int x, y;
@@ -581,8 +974,12 @@ namespace pico_api {
 
 	void reload(uint16_t dest_addr, uint16_t source_addr, uint16_t len) {
 		len = std::min<uint16_t>(len, 0x4300);
+		if (source_addr + len <= 0x4300 && dest_addr + len <= 0x5f00) {
+			core->ram.write(dest_addr, core->cartrom + source_addr, len);
+			return;
+		}
 		for (uint16_t n = 0; n < len; n++) {
-			poke(dest_addr + n, cartrom[source_addr + n]);
+			poke(dest_addr + n, core->cartrom[source_addr + n]);
 		}
 	}
 
@@ -598,11 +995,11 @@ namespace pico_apix {
 	}
 
 	void wrstr(const std::string& name, const std::string& s) {
-		FILE_SaveGameState(cartDataName + "_" + name, s);
+		FILE_SaveGameState(core->cartDataName + "_" + name, s);
 	}
 
 	std::string rdstr(const std::string& name) {
-		return FILE_LoadGameState(cartDataName + "_" + name);
+		return FILE_LoadGameState(core->cartDataName + "_" + name);
 	}
 
 	void setpal(uint8_t i, uint8_t r, uint8_t g, uint8_t b) {
@@ -632,7 +1029,7 @@ namespace pico_apix {
 	}
 
 	void zoom() {
-		GFX_SetZoom(buffer_size_x / 2, buffer_size_y / 2, 1.0, 0);
+		GFX_SetZoom(core->buffer_size_x / 2, core->buffer_size_y / 2, 1.0, 0);
 	}
 
 	void cursor(bool enable) {
@@ -641,7 +1038,7 @@ namespace pico_apix {
 
 	void menu() {
 		if (!pico_control::is_pause_menu())
-			pauseMenuRequested = true;
+			core->pauseMenuRequested = true;
 	}
 
 	void siminput(uint8_t state) {
@@ -649,50 +1046,76 @@ namespace pico_apix {
 	}
 
 	void sprites() {
-		currentSprData = &spriteSheet;
-		pico_control::set_spritebuffer(currentSprData->sprite_data);
-		pico_control::set_spriteflags(currentSprData->flags);
+		core->currentSprData = &core->spriteSheet;
+		pico_control::set_spritebuffer(core->currentSprData->sprite_data);
+		pico_control::set_spriteflags(core->currentSprData->flags);
 	}
 
 	void sprites(int page) {
-		if (extendedSpriteSheets.find(page) == extendedSpriteSheets.end()) {
-			memset(&extendedSpriteSheets[page], 0, sizeof(SpriteSheet));
-		}
-		currentSprData = &extendedSpriteSheets[page];
-		pico_control::set_spritebuffer(currentSprData->sprite_data);
-		pico_control::set_spriteflags(currentSprData->flags);
+		core->currentSprData = pico_private::sprite_page(page);
+		pico_control::set_spritebuffer(core->currentSprData->sprite_data);
+		pico_control::set_spriteflags(core->currentSprData->flags);
+	}
+
+	void target() {
+		core->target = nullptr;
+		pico_control::set_backbuffer(core->backbuffer, core->buffer_size_x, core->buffer_size_y,
+		                             core->buffer_size_x);
+		pico_api::clip();
+	}
+
+	void target(int page, int w, int h) {
+		core->target = pico_private::sprite_page(page);
+		core->targetPage = page;
+		core->targetW = utils::limit(w, 1, 128);
+		core->targetH = utils::limit(h, 1, 128);
+		// rows of a sprite page are always 128 pixels apart, whatever the size drawn to
+		pico_control::set_backbuffer(core->target->sprite_data, core->targetW, core->targetH, 128);
+		pico_api::clip();
 	}
 
 	void maps() {
-		currentMapData = &mapSheet;
-		pico_control::set_mapbuffer(currentMapData->map_data);
+		core->currentMapData = &core->mapSheet;
+		pico_control::set_mapbuffer(core->currentMapData->map_data);
 	}
 
 	void maps(int page) {
-		if (extendedMapSheets.find(page) == extendedMapSheets.end()) {
-			memset(&extendedMapSheets[page], 0, sizeof(MapSheet));
+		if (core->extendedMapSheets.find(page) == core->extendedMapSheets.end()) {
+			memset(&core->extendedMapSheets[page], 0, sizeof(MapSheet));
 		}
-		currentMapData = &extendedMapSheets[page];
-		pico_control::set_mapbuffer(currentMapData->map_data);
+		core->currentMapData = &core->extendedMapSheets[page];
+		pico_control::set_mapbuffer(core->currentMapData->map_data);
 	}
 
 	void fonts() {
-		currentFontData = &fontSheet;
-		pico_control::set_fontbuffer(currentFontData->sprite_data);
+		core->currentFontData = &core->fontSheet;
+		pico_control::set_fontbuffer(core->currentFontData->sprite_data);
 	}
 
 	void fonts(int page) {
-		if (extendedFontSheets.find(page) == extendedFontSheets.end()) {
-			memset(&extendedFontSheets[page], 0, sizeof(SpriteSheet));
+		if (core->extendedFontSheets.find(page) == core->extendedFontSheets.end()) {
+			memset(&core->extendedFontSheets[page], 0, sizeof(SpriteSheet));
 		}
-		currentFontData = &extendedFontSheets[page];
-		pico_control::set_fontbuffer(currentFontData->sprite_data);
+		core->currentFontData = &core->extendedFontSheets[page];
+		pico_control::set_fontbuffer(core->currentFontData->sprite_data);
 	}
 
 	void fullscreen(bool enable) {
 		GFX_SetFullScreen(enable);
 	}
 
+	void savestate() {
+		core->saveStateRequested = true;
+	}
+
+	void loadstate() {
+		core->loadStateRequested = true;
+	}
+
+	void screenshot(int scale) {
+		core->screenshotScale = std::max(scale, 0);
+	}
+
 	void assetload(std::string filename) {
 		pico_cart::loadassets(filename, pico_cart::getCart());
 	}
@@ -61,6 +61,11 @@ namespace pico_apix {
 	void sprites();
 	void sprites(int page);
 
+	// draws to the top left w x h of a sprite page instead of the screen, target() goes back to
+	// the screen. the clip rectangle is reset to the whole of the surface either way.
+	void target();
+	void target(int page, int w = 128, int h = 128);
+
 	void maps();
 	void maps(int page);
 
@@ -69,6 +74,10 @@ namespace pico_apix {
 
 	void fullscreen(bool enable);
 
+	void savestate();
+	void loadstate();
+	void screenshot(int scale);
+
 	void assetload(std::string filename);
 
 	std::pair<std::string, bool> dbg_getsrc(std::string src, int line);
@@ -79,10 +88,17 @@ namespace pico_apix {
 }  // namespace pico_apix
 
 namespace pico_control {
+	struct CoreContext;
+	CoreContext* core_create_context();
+	void core_destroy_context(CoreContext* context);
+	void core_select_context(CoreContext* context);
+
 	void init();
 	void frame_start();
 	void frame_end();
+	void flush_cartdata();
 	pico_api::colour_t* get_buffer(int& width, int& height);
+	bool take_screenshot_request(int& scale);
 	void set_sprite_data_4bit(std::string data);
 	void set_sprite_data_8bit(std::string data);
 	void set_sprite_flags(std::string flags);
@@ -100,8 +116,25 @@ namespace pico_control {
 	void restartCart();
 	void init_rom();
 
+	const int ROM_DATA_SIZE = 0x4300;
+	const int SPRITE_DATA_SIZE = 128 * 128;
+	void set_rom_data(const uint8_t* data);
+	void get_rom_data(uint8_t* data);
+	void set_sprite_data_raw(const uint8_t* data);
+	void get_sprite_data_raw(uint8_t* data);
+	void set_font_data_raw(const uint8_t* data);
+	void get_font_data_raw(uint8_t* data);
+
 	void displayerror(const std::string& msg);
 
+	void write_state(utils::BinaryWriter& w);
+	// cartData = false leaves the persistent cart data as it is rather than restoring it
+	bool read_state(utils::BinaryReader& r, bool cartData = true);
+	std::string save_state();
+	bool load_state(const uint8_t* data, size_t size);
+	void save_state_file();
+	void load_state_file();
+
 }  // namespace pico_control
 
 #endif /* PICO_CORE_H */
\ No newline at end of file
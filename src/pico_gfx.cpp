@@ -1,24 +1,16 @@
 #include "pico_gfx.h"
 #include "utils.h"
 
+#include <math.h>
 #include <string.h>
 #include <array>
 #include <map>
+#include <memory>
 
+#include "config.h"
 #include "hal_core.h"
 #include "utf8-util.h"
 
-static pico_api::colour_t* backbuffer = nullptr;
-static int buffer_size_x = 0;
-static int buffer_size_y = 0;
-static int buffer_stride = 0;
-
-static pico_api::colour_t* spritebuffer = nullptr;
-static uint8_t* spriteflags = nullptr;
-static uint8_t* mapbuffer = nullptr;
-
-static pico_api::colour_t* fontbuffer = nullptr;
-
 struct GraphicsState {
 	pico_api::colour_t fg = 7;
 	pico_api::colour_t bg = 0;
@@ -37,40 +29,106 @@ struct GraphicsState {
 	int camera_y = 0;
 	int line_x = 0;
 	int line_y = 0;
+	uint8_t screen_mode = 0;  // 0x5f2c, applied when the frame is copied out
+	uint8_t tline_wrap_w = 0;  // 0x5f38-0x5f3b, tline map wrap size and offset in cells
+	uint8_t tline_wrap_h = 0;
+	uint8_t tline_offset_x = 0;
+	uint8_t tline_offset_y = 0;
 	std::array<pico_api::colour_t, 256> palette_map;
 	std::array<bool, 256> transparent;
+	uint32_t draw_version = 0;  // bumped whenever palette_map or transparent change
 	bool extendedPalette = false;
 };
 
-static GraphicsState* currentGraphicsState = nullptr;
-static std::map<int, GraphicsState> extendedGraphicsStates;
+namespace pico_control {
+	struct GfxContext {
+		pico_api::colour_t* backbuffer = nullptr;
+		int buffer_size_x = 0;
+		int buffer_size_y = 0;
+		int buffer_stride = 0;
+
+		pico_api::colour_t* spritebuffer = nullptr;
+		uint8_t* spriteflags = nullptr;
+		uint8_t* mapbuffer = nullptr;
+
+		pico_api::colour_t* fontbuffer = nullptr;
+
+		GraphicsState* currentGraphicsState = nullptr;
+		std::map<int, GraphicsState> extendedGraphicsStates;
+
+		// palette_map and transparent of the current graphics state fused into the one table
+		// the blitters read, -1 for transparent colours. rebuilt when the state changes.
+		std::array<int16_t, 256> drawTable;
+		const GraphicsState* drawTableState = nullptr;
+		uint32_t drawTableVersion = 0;
+	};
+}  // namespace pico_control
+
+// the context of the machine running on this thread
+static pico_control::GfxContext defaultGfx;
+static thread_local pico_control::GfxContext* gfx = &defaultGfx;
 
 namespace pico_private {
 	using namespace pico_api;
 
+	static std::array<colour_t, 256> identity_palette() {
+		std::array<colour_t, 256> pal;
+		for (size_t n = 0; n < pal.size(); n++) {
+			pal[n] = (colour_t)n;
+		}
+		return pal;
+	}
+
+	static std::array<bool, 256> default_transparency() {
+		std::array<bool, 256> t;
+		t.fill(false);
+		t[0] = true;
+		return t;
+	}
+
+	// pal() is often called every frame on a palette that is already reset, which leaves the
+	// draw table as it is
 	static void restore_palette() {
-		for (size_t n = 0; n < currentGraphicsState->palette_map.size(); n++) {
-			currentGraphicsState->palette_map[n] = (colour_t)n;
+		static const std::array<colour_t, 256> identity = identity_palette();
+		GraphicsState* gs = gfx->currentGraphicsState;
+		if (gs->palette_map != identity) {
+			gs->palette_map = identity;
+			gs->draw_version++;
 		}
 		GFX_RestorePaletteMapping();
 	}
 
 	static void restore_transparency() {
-		for (size_t n = 0; n < currentGraphicsState->palette_map.size(); n++) {
-			currentGraphicsState->transparent[n] = false;
+		static const std::array<bool, 256> transparency = default_transparency();
+		GraphicsState* gs = gfx->currentGraphicsState;
+		if (gs->transparent != transparency) {
+			gs->transparent = transparency;
+			gs->draw_version++;
 		}
-		currentGraphicsState->transparent[0] = true;
+	}
+
+	// the fused draw table, only rebuilt when it is used after pal, palt or a 0x5f00 poke
+	static const int16_t* draw_table() {
+		GraphicsState* gs = gfx->currentGraphicsState;
+		if (gfx->drawTableState != gs || gfx->drawTableVersion != gs->draw_version) {
+			for (size_t n = 0; n < gfx->drawTable.size(); n++) {
+				gfx->drawTable[n] = gs->transparent[n] ? -1 : gs->palette_map[n];
+			}
+			gfx->drawTableState = gs;
+			gfx->drawTableVersion = gs->draw_version;
+		}
+		return gfx->drawTable.data();
 	}
 
 	// test if rectangle is within cliping rectangle
 	static bool is_visible(int x, int y, int w, int h) {
-		if (x >= currentGraphicsState->clip_x2)
+		if (x >= gfx->currentGraphicsState->clip_x2)
 			return false;
-		if (y >= currentGraphicsState->clip_y2)
+		if (y >= gfx->currentGraphicsState->clip_y2)
 			return false;
-		if (x + w <= currentGraphicsState->clip_x1)
+		if (x + w <= gfx->currentGraphicsState->clip_x1)
 			return false;
-		if (y + h <= currentGraphicsState->clip_y1)
+		if (y + h <= gfx->currentGraphicsState->clip_y1)
 			return false;
 		if (w <= 0 || h <= 0)
 			return false;
@@ -94,9 +152,9 @@ namespace pico_private {
 		int scr_h = spr_h;
 
 		// left clip
-		if (scr_x < currentGraphicsState->clip_x1) {
-			int nclip = currentGraphicsState->clip_x1 - scr_x;
-			scr_x = currentGraphicsState->clip_x1;
+		if (scr_x < gfx->currentGraphicsState->clip_x1) {
+			int nclip = gfx->currentGraphicsState->clip_x1 - scr_x;
+			scr_x = gfx->currentGraphicsState->clip_x1;
 			scr_w -= nclip;
 			if (!flip_x) {
 				spr_x += nclip;
@@ -106,15 +164,15 @@ namespace pico_private {
 		}
 
 		// right clip
-		if (scr_x + scr_w > currentGraphicsState->clip_x2) {
-			int nclip = (scr_x + scr_w) - currentGraphicsState->clip_x2;
+		if (scr_x + scr_w > gfx->currentGraphicsState->clip_x2) {
+			int nclip = (scr_x + scr_w) - gfx->currentGraphicsState->clip_x2;
 			scr_w -= nclip;
 		}
 
 		// top clip
-		if (scr_y < currentGraphicsState->clip_y1) {
-			int nclip = currentGraphicsState->clip_y1 - scr_y;
-			scr_y = currentGraphicsState->clip_y1;
+		if (scr_y < gfx->currentGraphicsState->clip_y1) {
+			int nclip = gfx->currentGraphicsState->clip_y1 - scr_y;
+			scr_y = gfx->currentGraphicsState->clip_y1;
 			scr_h -= nclip;
 			if (!flip_y) {
 				spr_y += nclip;
@@ -124,8 +182,8 @@ namespace pico_private {
 		}
 
 		// bottom clip
-		if (scr_y + scr_h > currentGraphicsState->clip_y2) {
-			int nclip = (scr_y + scr_h) - currentGraphicsState->clip_y2;
+		if (scr_y + scr_h > gfx->currentGraphicsState->clip_y2) {
+			int nclip = (scr_y + scr_h) - gfx->currentGraphicsState->clip_y2;
 			scr_h -= nclip;
 		}
 
@@ -135,26 +193,27 @@ namespace pico_private {
 			dy = -dy;
 		}
 
-		colour_t* pix = backbuffer + scr_y * buffer_size_x + scr_x;
+		const int16_t* table = draw_table();
+		colour_t* pix = gfx->backbuffer + scr_y * gfx->buffer_stride + scr_x;
 		for (int y = 0; y < scr_h; y++) {
 			colour_t* spr = spritebuffer + ((spr_y + y * dy) & 0x7f) * 128;
 
 			if (!flip_x) {
 				for (int x = 0; x < scr_w; x++) {
-					colour_t c = spr[(spr_x + x) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
+					int16_t c = table[spr[(spr_x + x) & 0x7f]];
+					if (c >= 0) {
+						pix[x] = (colour_t)c;
 					}
 				}
 			} else {
 				for (int x = 0; x < scr_w; x++) {
-					colour_t c = spr[(spr_x + spr_w - x - 1) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
+					int16_t c = table[spr[(spr_x + spr_w - x - 1) & 0x7f]];
+					if (c >= 0) {
+						pix[x] = (colour_t)c;
 					}
 				}
 			}
-			pix += buffer_size_x;
+			pix += gfx->buffer_stride;
 		}
 	}
 
@@ -187,9 +246,9 @@ namespace pico_private {
 		int dy = spr_h / scr_h;
 
 		// left clip
-		if (scr_x < currentGraphicsState->clip_x1) {
-			int nclip = currentGraphicsState->clip_x1 - scr_x;
-			scr_x = currentGraphicsState->clip_x1;
+		if (scr_x < gfx->currentGraphicsState->clip_x1) {
+			int nclip = gfx->currentGraphicsState->clip_x1 - scr_x;
+			scr_x = gfx->currentGraphicsState->clip_x1;
 			scr_w -= nclip;
 			if (!flip_x) {
 				spr_x += nclip * dx;
@@ -199,15 +258,15 @@ namespace pico_private {
 		}
 
 		// right clip
-		if (scr_x + scr_w > currentGraphicsState->clip_x2) {
-			int nclip = (scr_x + scr_w) - currentGraphicsState->clip_x2;
+		if (scr_x + scr_w > gfx->currentGraphicsState->clip_x2) {
+			int nclip = (scr_x + scr_w) - gfx->currentGraphicsState->clip_x2;
 			scr_w -= nclip;
 		}
 
 		// top clip
-		if (scr_y < currentGraphicsState->clip_y1) {
-			int nclip = currentGraphicsState->clip_y1 - scr_y;
-			scr_y = currentGraphicsState->clip_y1;
+		if (scr_y < gfx->currentGraphicsState->clip_y1) {
+			int nclip = gfx->currentGraphicsState->clip_y1 - scr_y;
+			scr_y = gfx->currentGraphicsState->clip_y1;
 			scr_h -= nclip;
 			if (!flip_y) {
 				spr_y += nclip * dy;
@@ -217,8 +276,8 @@ namespace pico_private {
 		}
 
 		// bottom clip
-		if (scr_y + scr_h > currentGraphicsState->clip_y2) {
-			int nclip = (scr_y + scr_h) - currentGraphicsState->clip_y2;
+		if (scr_y + scr_h > gfx->currentGraphicsState->clip_y2) {
+			int nclip = (scr_y + scr_h) - gfx->currentGraphicsState->clip_y2;
 			scr_h -= nclip;
 		}
 
@@ -227,46 +286,143 @@ namespace pico_private {
 			dy = -dy;
 		}
 
-		colour_t* pix = backbuffer + scr_y * buffer_size_x + scr_x;
+		// the source column of each screen column is the same on every row
+		uint8_t columns[config::MAX_SCREEN_WIDTH];
+		scr_w = std::min(scr_w, config::MAX_SCREEN_WIDTH);
+		for (int x = 0; x < scr_w; x++) {
+			int col = !flip_x ? spr_x + x * dx : spr_x + spr_w - (x + 1) * dx;
+			columns[x] = (col >> 16) & 0x7f;
+		}
+
+		const int16_t* table = draw_table();
+		colour_t* pix = gfx->backbuffer + scr_y * gfx->buffer_stride + scr_x;
 		for (int y = 0; y < scr_h; y++) {
 			colour_t* spr = spritebuffer + (((spr_y + y * dy) >> 16) & 0x7f) * 128;
-
-			if (!flip_x) {
-				for (int x = 0; x < scr_w; x++) {
-					colour_t c = spr[((spr_x + x * dx) >> 16) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
-					}
+			for (int x = 0; x < scr_w; x++) {
+				int16_t c = table[spr[columns[x]]];
+				if (c >= 0) {
+					pix[x] = (colour_t)c;
 				}
-			} else {
-				for (int x = 0; x < scr_w; x++) {
-					colour_t c = spr[((spr_x + spr_w - (x + 1) * dx) >> 16) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
-					}
+			}
+			pix += gfx->buffer_stride;
+		}
+	}
+
+	static int64_t floor_div(int64_t a, int64_t b) {
+		int64_t q = a / b;
+		return (a % b != 0 && ((a < 0) != (b < 0))) ? q - 1 : q;
+	}
+
+	// narrows [lo, hi) to the x where 0 <= u + x * du < limit
+	static void limit_span(int64_t u, int64_t du, int64_t limit, int& lo, int& hi) {
+		if (du == 0) {
+			if (u < 0 || u >= limit) {
+				hi = lo;
+			}
+			return;
+		}
+		int64_t first, end;
+		if (du > 0) {
+			first = -floor_div(u, du);
+			end = -floor_div(u - limit, du);
+		} else {
+			first = floor_div(limit - u, du) + 1;
+			end = floor_div(-u, du) + 1;
+		}
+		lo = (int)std::max<int64_t>(lo, first);
+		hi = (int)std::min<int64_t>(hi, end);
+	}
+
+	// draws the spr_w x spr_h sprite area rotated counter-clockwise by angle turns and scaled about
+	// its centre, which is placed at (cx, cy). each screen pixel in the rotated sprite's bounding
+	// box is mapped back into the sprite in 16.16 fixed point, and the pixels of each row that
+	// land inside the sprite are found up front so the inner loop has no tests.
+	static void rotate_blitter(colour_t* spritebuffer,
+	                           int spr_x,
+	                           int spr_y,
+	                           int spr_w,
+	                           int spr_h,
+	                           int cx,
+	                           int cy,
+	                           double angle,
+	                           double scale,
+	                           bool flip_x) {
+		// anything smaller is under a pixel, and would overflow the fixed point steps
+		if (spr_w <= 0 || spr_h <= 0 || scale < 1.0 / 256) {
+			return;
+		}
+		GraphicsState* gs = gfx->currentGraphicsState;
+
+		// the same way round as pico-8's sin and cos, which have y pointing down the screen
+		double c = cos(angle * 2 * M_PI);
+		double s = -sin(angle * 2 * M_PI);
+		double half_w = spr_w * scale / 2;
+		double half_h = spr_h * scale / 2;
+		double extent_x = fabs(c) * half_w + fabs(s) * half_h;
+		double extent_y = fabs(s) * half_w + fabs(c) * half_h;
+		int x0 = std::max((int)floor(cx - extent_x), gs->clip_x1);
+		int x1 = std::min((int)ceil(cx + extent_x), gs->clip_x2);
+		int y0 = std::max((int)floor(cy - extent_y), gs->clip_y1);
+		int y1 = std::min((int)ceil(cy + extent_y), gs->clip_y2);
+		if (x0 >= x1 || y0 >= y1) {
+			return;
+		}
+
+		// sprite position per screen pixel step, and at the centre of the top left pixel
+		const double one = 65536.0;
+		int32_t du_dx = (int32_t)lround(c / scale * one);
+		int32_t dv_dx = (int32_t)lround(-s / scale * one);
+		int32_t du_dy = (int32_t)lround(s / scale * one);
+		int32_t dv_dy = (int32_t)lround(c / scale * one);
+		double rx = x0 + 0.5 - cx;
+		double ry = y0 + 0.5 - cy;
+		int32_t row_u = (int32_t)lround(((rx * c + ry * s) / scale + spr_w / 2.0) * one);
+		int32_t row_v = (int32_t)lround(((ry * c - rx * s) / scale + spr_h / 2.0) * one);
+
+		const int16_t* table = draw_table();
+		colour_t* pix = gfx->backbuffer + y0 * gfx->buffer_stride;
+		for (int y = y0; y < y1; y++) {
+			int lo = 0;
+			int hi = x1 - x0;
+			limit_span(row_u, du_dx, (int64_t)spr_w << 16, lo, hi);
+			limit_span(row_v, dv_dx, (int64_t)spr_h << 16, lo, hi);
+
+			int32_t u = row_u + lo * du_dx;
+			int32_t v = row_v + lo * dv_dx;
+			for (int x = x0 + lo; x < x0 + hi; x++) {
+				int col = spr_x + (flip_x ? spr_w - 1 - (u >> 16) : u >> 16);
+				int row = spr_y + (v >> 16);
+				int16_t p = table[spritebuffer[(row & 0x7f) * 128 + (col & 0x7f)]];
+				if (p >= 0) {
+					pix[x] = (colour_t)p;
 				}
+				u += du_dx;
+				v += dv_dx;
 			}
-			pix += buffer_size_x;
+
+			row_u += du_dy;
+			row_v += dv_dy;
+			pix += gfx->buffer_stride;
 		}
 	}
 
 	static int clip_rect(int& x0, int& y0, int& x1, int& y1) {
 		int flags = 0;
 
-		if (x0 < currentGraphicsState->clip_x1) {
-			x0 = currentGraphicsState->clip_x1;
+		if (x0 < gfx->currentGraphicsState->clip_x1) {
+			x0 = gfx->currentGraphicsState->clip_x1;
 			flags |= 1;
 		}
-		if (y0 < currentGraphicsState->clip_y1) {
-			y0 = currentGraphicsState->clip_y1;
+		if (y0 < gfx->currentGraphicsState->clip_y1) {
+			y0 = gfx->currentGraphicsState->clip_y1;
 			flags |= 2;
 		}
-		if (x1 >= currentGraphicsState->clip_x2) {
-			x1 = currentGraphicsState->clip_x2 - 1;
+		if (x1 >= gfx->currentGraphicsState->clip_x2) {
+			x1 = gfx->currentGraphicsState->clip_x2 - 1;
 			flags |= 4;
 		}
-		if (y1 >= currentGraphicsState->clip_y2) {
-			y1 = currentGraphicsState->clip_y2 - 1;
+		if (y1 >= gfx->currentGraphicsState->clip_y2) {
+			y1 = gfx->currentGraphicsState->clip_y2 - 1;
 			flags |= 8;
 		}
 		return 0;
@@ -278,20 +434,21 @@ namespace pico_private {
 	}
 
 	void hline(int x0, int x1, int y) {
+		GraphicsState* gs = gfx->currentGraphicsState;
 		normalise_coords(x0, x1);
 		x1++;
-		if (y < currentGraphicsState->clip_y1 || y >= currentGraphicsState->clip_y2) {
+		if (y < gs->clip_y1 || y >= gs->clip_y2) {
 			return;
 		}
-		x0 = utils::limit(x0, currentGraphicsState->clip_x1, currentGraphicsState->clip_x2);
-		x1 = utils::limit(x1, currentGraphicsState->clip_x1, currentGraphicsState->clip_x2);
+		x0 = utils::limit(x0, gs->clip_x1, gs->clip_x2);
+		x1 = utils::limit(x1, gs->clip_x1, gs->clip_x2);
 
-		colour_t fg = currentGraphicsState->palette_map[currentGraphicsState->fg];
-		colour_t bg = currentGraphicsState->palette_map[currentGraphicsState->bg];
+		colour_t fg = gs->palette_map[gs->fg];
+		colour_t bg = gs->palette_map[gs->bg];
 
-		colour_t* pix = backbuffer + y * buffer_size_x;
-		uint16_t pat = currentGraphicsState->pattern;
-		bool pattr = currentGraphicsState->pattern_transparent;
+		colour_t* pix = gfx->backbuffer + y * gfx->buffer_stride;
+		uint16_t pat = gs->pattern;
+		bool pattr = gs->pattern_transparent;
 
 		if (pat == 0) {
 			memset(pix + x0, fg, x1 - x0);
@@ -313,46 +470,47 @@ namespace pico_private {
 	}
 
 	void vline(int y0, int y1, int x) {
-		if (x < currentGraphicsState->clip_x1 || x >= currentGraphicsState->clip_x2) {
+		GraphicsState* gs = gfx->currentGraphicsState;
+		if (x < gs->clip_x1 || x >= gs->clip_x2) {
 			return;
 		}
 
-		y0 = utils::limit(y0, currentGraphicsState->clip_y1, currentGraphicsState->clip_y2);
-		y1 = utils::limit(y1, currentGraphicsState->clip_y1, currentGraphicsState->clip_y2);
+		y0 = utils::limit(y0, gs->clip_y1, gs->clip_y2);
+		y1 = utils::limit(y1, gs->clip_y1, gs->clip_y2);
 
-		colour_t* pix = backbuffer + y0 * buffer_size_x;
+		colour_t* pix = gfx->backbuffer + y0 * gfx->buffer_stride;
 
-		colour_t fg = currentGraphicsState->palette_map[currentGraphicsState->fg];
-		colour_t bg = currentGraphicsState->palette_map[currentGraphicsState->bg];
-		uint16_t pat = currentGraphicsState->pattern;
-		bool pattr = currentGraphicsState->pattern_transparent;
+		colour_t fg = gs->palette_map[gs->fg];
+		colour_t bg = gs->palette_map[gs->bg];
+		uint16_t pat = gs->pattern;
+		bool pattr = gs->pattern_transparent;
 
 		if (pattr) {
 			for (int y = y0; y < y1; y++) {
 				if (((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) == 0) {
 					pix[x] = fg;
 				}
-				pix += buffer_size_x;
+				pix += gfx->buffer_stride;
 			}
 		} else {
 			for (int y = y0; y < y1; y++) {
 				pix[x] = ((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) ? bg : fg;
-				pix += buffer_size_x;
+				pix += gfx->buffer_stride;
 			}
 		}
 	}
 
 	void pset(int x, int y) {
-		if (x < currentGraphicsState->clip_x1 || x >= currentGraphicsState->clip_x2 ||
-		    y < currentGraphicsState->clip_y1 || y >= currentGraphicsState->clip_y2) {
+		if (x < gfx->currentGraphicsState->clip_x1 || x >= gfx->currentGraphicsState->clip_x2 ||
+		    y < gfx->currentGraphicsState->clip_y1 || y >= gfx->currentGraphicsState->clip_y2) {
 			return;
 		}
 
-		colour_t* pix = backbuffer + y * buffer_size_x + x;
-		uint16_t pat = currentGraphicsState->pattern;
-		colour_t fg = currentGraphicsState->palette_map[currentGraphicsState->fg];
-		colour_t bg = currentGraphicsState->palette_map[currentGraphicsState->bg];
-		bool pattr = currentGraphicsState->pattern_transparent;
+		colour_t* pix = gfx->backbuffer + y * gfx->buffer_stride + x;
+		uint16_t pat = gfx->currentGraphicsState->pattern;
+		colour_t fg = gfx->currentGraphicsState->palette_map[gfx->currentGraphicsState->fg];
+		colour_t bg = gfx->currentGraphicsState->palette_map[gfx->currentGraphicsState->bg];
+		bool pattr = gfx->currentGraphicsState->pattern_transparent;
 
 		if (pat == 0) {
 			*pix = fg;
@@ -370,12 +528,68 @@ namespace pico_private {
 	}
 
 	void apply_camera(int& x, int& y) {
-		x = x - currentGraphicsState->camera_x;
-		y = y - currentGraphicsState->camera_y;
+		x = x - gfx->currentGraphicsState->camera_x;
+		y = y - gfx->currentGraphicsState->camera_y;
+	}
+
+	// reads the map for tline, positions are 16.16 fixed point cells. a wrap size, which should
+	// be a power of two, repeats that many cells starting at the offset. returns -1 for cells
+	// outside the map, empty cells, cells not on the layers and transparent colours.
+	struct MapSampler {
+		explicit MapSampler(uint8_t layers) : table(draw_table()), layers(layers) {
+			GraphicsState* gs = gfx->currentGraphicsState;
+			mask_x = gs->tline_wrap_w ? gs->tline_wrap_w - 1 : -1;
+			mask_y = gs->tline_wrap_h ? gs->tline_wrap_h - 1 : -1;
+			offset_x = gs->tline_wrap_w ? gs->tline_offset_x : 0;
+			offset_y = gs->tline_wrap_h ? gs->tline_offset_y : 0;
+		}
+
+		int operator()(int32_t mx, int32_t my) const {
+			int cx = ((mx >> 16) & mask_x) + offset_x;
+			int cy = ((my >> 16) & mask_y) + offset_y;
+			if ((unsigned)cx >= 128 || (unsigned)cy >= 64) {
+				return -1;
+			}
+			uint8_t cell = gfx->mapbuffer[cy * 128 + cx];
+			if (cell == 0 || (layers && (gfx->spriteflags[cell] & layers) == 0)) {
+				return -1;
+			}
+			int sx = (cell % 16) * 8 + ((mx >> 13) & 7);
+			int sy = (cell / 16) * 8 + ((my >> 13) & 7);
+			return table[gfx->spritebuffer[sy * 128 + sx]];
+		}
+
+		const int16_t* table;
+		uint8_t layers;
+		int mask_x;
+		int mask_y;
+		int offset_x;
+		int offset_y;
+	};
+
+	// draws count pixels from pix, stepping by step in the backbuffer and by (mdx, mdy) in
+	// the map. used for the horizontal and vertical spans of tline.
+	static void tline_span(colour_t* pix,
+	                       int step,
+	                       int count,
+	                       int32_t mx,
+	                       int32_t my,
+	                       int32_t mdx,
+	                       int32_t mdy,
+	                       const MapSampler& sample) {
+		for (int i = 0; i < count; i++) {
+			int c = sample(mx, my);
+			if (c >= 0) {
+				*pix = (colour_t)c;
+			}
+			pix += step;
+			mx += mdx;
+			my += mdy;
+		}
 	}
 
 	inline colour_t fgcolor(uint16_t c) {
-		if (currentGraphicsState->extendedPalette) {
+		if (gfx->currentGraphicsState->extendedPalette) {
 			return c & 0xff;
 		} else {
 			return c & 0xf;
@@ -383,7 +597,7 @@ namespace pico_private {
 	}
 
 	inline colour_t bgcolor(uint16_t c) {
-		if (currentGraphicsState->extendedPalette) {
+		if (gfx->currentGraphicsState->extendedPalette) {
 			return c >> 8;
 		} else {
 			return (c >> 4) & 0xf;
@@ -394,16 +608,23 @@ namespace pico_private {
 
 namespace pico_api {
 	void color(uint16_t c) {
-		currentGraphicsState->fg = pico_private::fgcolor(c);
-		currentGraphicsState->bg = pico_private::bgcolor(c);
+		gfx->currentGraphicsState->fg = pico_private::fgcolor(c);
+		gfx->currentGraphicsState->bg = pico_private::bgcolor(c);
 	}
 
 	void cls(colour_t c) {
-		colour_t p = currentGraphicsState->palette_map[c];
-		memset(backbuffer, p, buffer_size_x * buffer_size_y);
+		colour_t p = gfx->currentGraphicsState->palette_map[c];
+		if (gfx->buffer_stride == gfx->buffer_size_x) {
+			memset(gfx->backbuffer, p, gfx->buffer_size_x * gfx->buffer_size_y);
+		} else {
+			// a surface narrower than its rows, only its own part of each row is cleared
+			for (int y = 0; y < gfx->buffer_size_y; y++) {
+				memset(gfx->backbuffer + y * gfx->buffer_stride, p, gfx->buffer_size_x);
+			}
+		}
 
-		currentGraphicsState->text_x = 0;
-		currentGraphicsState->text_y = 0;
+		gfx->currentGraphicsState->text_x = 0;
+		gfx->currentGraphicsState->text_y = 0;
 	}
 
 	void cls() {
@@ -411,7 +632,7 @@ namespace pico_api {
 	}
 
 	uint8_t fget(int n) {
-		return spriteflags[n & 0xff];
+		return gfx->spriteflags[n & 0xff];
 	}
 
 	bool fget(int n, int bit) {
@@ -419,7 +640,7 @@ namespace pico_api {
 	}
 
 	void fset(int n, uint8_t val) {
-		spriteflags[n & 0xff] = val;
+		gfx->spriteflags[n & 0xff] = val;
 	}
 
 	void fset(int n, int bit, bool val) {
@@ -442,47 +663,48 @@ namespace pico_api {
 
 		int spr_x = (n % 16) * 8;
 		int spr_y = (n / 16) * 8;
-		pico_private::blitter(spritebuffer, x, y, spr_x, spr_y, w * 8, h * 8, flip_x, flip_y);
+		pico_private::blitter(gfx->spritebuffer, x, y, spr_x, spr_y, w * 8, h * 8, flip_x, flip_y);
 	}
 
 	void sspr(int sx, int sy, int sw, int sh, int dx, int dy) {
 		pico_private::apply_camera(dx, dy);
-		pico_private::blitter(spritebuffer, dx, dy, sx, sy, sw, sh);
+		pico_private::blitter(gfx->spritebuffer, dx, dy, sx, sy, sw, sh);
 	}
 
 	void sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh) {
 		pico_private::apply_camera(dx, dy);
-		pico_private::stretch_blitter(spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh);
+		pico_private::stretch_blitter(gfx->spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh);
 	}
 
 	void
 	sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh, bool flip_x, bool flip_y) {
 		pico_private::apply_camera(dx, dy);
-		pico_private::stretch_blitter(spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh, flip_x, flip_y);
+		pico_private::stretch_blitter(gfx->spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh, flip_x,
+		                              flip_y);
 	}
 
 	colour_t sget(int x, int y) {
 		y &= 0x7f;
 		x &= 0x7f;
-		return spritebuffer[y * 128 + x];
+		return gfx->spritebuffer[y * 128 + x];
 	}
 
 	void sset(int x, int y) {
-		sset(x, y, currentGraphicsState->fg);
+		sset(x, y, gfx->currentGraphicsState->fg);
 	}
 
 	void sset(int x, int y, colour_t c) {
 		y &= 0x7f;
 		x &= 0x7f;
-		spritebuffer[y * 128 + x] = c;
+		gfx->spritebuffer[y * 128 + x] = c;
 	}
 
 	void pset(int x, int y) {
-		pset(x, y, currentGraphicsState->fg);
+		pset(x, y, gfx->currentGraphicsState->fg);
 	}
 
 	void pset(int x, int y, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx->currentGraphicsState->pattern_with_colour) {
 			fillp(pat, false);
 		}
 		color(c);
@@ -494,15 +716,15 @@ namespace pico_api {
 		pico_private::apply_camera(x, y);
 		x &= 0x7f;
 		y &= 0x7f;
-		return backbuffer[y * buffer_size_x + x];
+		return gfx->backbuffer[y * gfx->buffer_stride + x];
 	}
 
 	void rect(int x0, int y0, int x1, int y1) {
-		rect(x0, y0, x1, y1, currentGraphicsState->fg);
+		rect(x0, y0, x1, y1, gfx->currentGraphicsState->fg);
 	}
 
 	void rect(int x0, int y0, int x1, int y1, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx->currentGraphicsState->pattern_with_colour) {
 			fillp(pat, false);
 		}
 		pico_private::apply_camera(x0, y0);
@@ -517,12 +739,12 @@ namespace pico_api {
 	}
 
 	void rectfill(int x0, int y0, int x1, int y1) {
-		rectfill(x0, y0, x1, y1, currentGraphicsState->fg);
+		rectfill(x0, y0, x1, y1, gfx->currentGraphicsState->fg);
 	}
 
 	void rectfill(int x0, int y0, int x1, int y1, uint16_t c, uint16_t p) {
 		using namespace pico_private;
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx->currentGraphicsState->pattern_with_colour) {
 			fillp(p, false);
 		}
 
@@ -533,12 +755,12 @@ namespace pico_api {
 		pico_private::normalise_coords(y0, y1);
 
 		pico_private::clip_rect(x0, y0, x1, y1);
-		colour_t* pix = backbuffer + y0 * buffer_size_x;
-		colour_t p1 = currentGraphicsState->palette_map[fgcolor(c)];
-		colour_t p2 = currentGraphicsState->palette_map[bgcolor(c)];
+		colour_t* pix = gfx->backbuffer + y0 * gfx->buffer_stride;
+		colour_t p1 = gfx->currentGraphicsState->palette_map[fgcolor(c)];
+		colour_t p2 = gfx->currentGraphicsState->palette_map[bgcolor(c)];
 
-		uint16_t pat = currentGraphicsState->pattern;
-		bool pattr = currentGraphicsState->pattern_transparent;
+		uint16_t pat = gfx->currentGraphicsState->pattern;
+		bool pattr = gfx->currentGraphicsState->pattern_transparent;
 
 		if (pattr) {
 			for (int y = y0; y <= y1; y++) {
@@ -547,24 +769,24 @@ namespace pico_api {
 						pix[x] = p1;
 					}
 				}
-				pix += buffer_size_x;
+				pix += gfx->buffer_stride;
 			}
 		} else {
 			for (int y = y0; y <= y1; y++) {
 				for (int x = x0; x <= x1; x++) {
 					pix[x] = ((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) ? p2 : p1;
 				}
-				pix += buffer_size_x;
+				pix += gfx->buffer_stride;
 			}
 		}
 	}
 
 	void circ(int x, int y, int r) {
-		circ(x, y, r, currentGraphicsState->fg);
+		circ(x, y, r, gfx->currentGraphicsState->fg);
 	}
 
 	void circ(int xm, int ym, int r, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx->currentGraphicsState->pattern_with_colour) {
 			fillp(pat, false);
 		}
 		pico_private::apply_camera(xm, ym);
@@ -586,11 +808,11 @@ namespace pico_api {
 	}
 
 	void circfill(int x, int y, int r) {
-		circfill(x, y, r, currentGraphicsState->fg);
+		circfill(x, y, r, gfx->currentGraphicsState->fg);
 	}
 
 	void circfill(int xm, int ym, int r, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx->currentGraphicsState->pattern_with_colour) {
 			fillp(pat, false);
 		}
 		pico_private::apply_camera(xm, ym);
@@ -616,20 +838,20 @@ namespace pico_api {
 	}
 
 	void line(int x, int y) {
-		line(currentGraphicsState->line_x, currentGraphicsState->line_y, x, y,
-		     currentGraphicsState->fg);
+		line(gfx->currentGraphicsState->line_x, gfx->currentGraphicsState->line_y, x, y,
+		     gfx->currentGraphicsState->fg);
 	}
 
 	void line(int x0, int y0, int x1, int y1) {
-		line(x0, y0, x1, y1, currentGraphicsState->fg);
+		line(x0, y0, x1, y1, gfx->currentGraphicsState->fg);
 	}
 
 	void line(int x0, int y0, int x1, int y1, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx->currentGraphicsState->pattern_with_colour) {
 			fillp(pat, false);
 		}
-		currentGraphicsState->line_x = x1;
-		currentGraphicsState->line_y = y1;
+		gfx->currentGraphicsState->line_x = x1;
+		gfx->currentGraphicsState->line_y = y1;
 		pico_private::apply_camera(x0, y0);
 		pico_private::apply_camera(x1, y1);
 		color(c);
@@ -676,26 +898,99 @@ namespace pico_api {
 		}
 	}
 
+	void tline(int x0,
+	           int y0,
+	           int x1,
+	           int y1,
+	           int32_t mx,
+	           int32_t my,
+	           int32_t mdx,
+	           int32_t mdy,
+	           uint8_t layers) {
+		using namespace pico_private;
+		apply_camera(x0, y0);
+		apply_camera(x1, y1);
+		GraphicsState* gs = gfx->currentGraphicsState;
+		MapSampler sample(layers);
+
+		if (y0 == y1 || x0 == x1) {
+			// a span along one axis, clipped up front so the inner loop has no tests
+			bool horizontal = y0 == y1;
+			int pos = horizontal ? x0 : y0;
+			int end = horizontal ? x1 : y1;
+			int across = horizontal ? y0 : x0;
+			int clip_lo = horizontal ? gs->clip_x1 : gs->clip_y1;
+			int clip_hi = horizontal ? gs->clip_x2 : gs->clip_y2;
+			if (across < (horizontal ? gs->clip_y1 : gs->clip_x1) ||
+			    across >= (horizontal ? gs->clip_y2 : gs->clip_x2)) {
+				return;
+			}
+
+			int dir = end >= pos ? 1 : -1;
+			int count = abs(end - pos) + 1;
+			int skip = dir > 0 ? clip_lo - pos : pos - (clip_hi - 1);
+			if (skip > 0) {
+				pos += skip * dir;
+				mx += skip * mdx;
+				my += skip * mdy;
+				count -= skip;
+			}
+			count = std::min(count, dir > 0 ? clip_hi - pos : pos - clip_lo + 1);
+			if (count <= 0) {
+				return;
+			}
+
+			int x = horizontal ? pos : across;
+			int y = horizontal ? across : pos;
+			int step = horizontal ? dir : dir * gfx->buffer_stride;
+			tline_span(gfx->backbuffer + y * gfx->buffer_stride + x, step, count, mx, my, mdx, mdy,
+			           sample);
+			return;
+		}
+
+		// one pixel per step along the longer axis
+		int steps = std::max(abs(x1 - x0), abs(y1 - y0));
+		int32_t sx = (int32_t)(((int64_t)(x1 - x0) << 16) / steps);
+		int32_t sy = (int32_t)(((int64_t)(y1 - y0) << 16) / steps);
+		int32_t fx = (x0 << 16) + 0x8000;
+		int32_t fy = (y0 << 16) + 0x8000;
+		for (int i = 0; i <= steps; i++) {
+			int x = fx >> 16;
+			int y = fy >> 16;
+			if (x >= gs->clip_x1 && x < gs->clip_x2 && y >= gs->clip_y1 && y < gs->clip_y2) {
+				int c = sample(mx, my);
+				if (c >= 0) {
+					gfx->backbuffer[y * gfx->buffer_stride + x] = (colour_t)c;
+				}
+			}
+			fx += sx;
+			fy += sy;
+			mx += mdx;
+			my += mdy;
+		}
+	}
+
 	uint8_t mget(int x, int y) {
 		x &= 0x7f;
 		y &= 0x3f;
-		return mapbuffer[y * 128 + x];
+		return gfx->mapbuffer[y * 128 + x];
 	}
 
 	void mset(int x, int y, uint8_t v) {
 		x &= 0x7f;
 		y &= 0x3f;
-		mapbuffer[y * 128 + x] = v;
+		gfx->mapbuffer[y * 128 + x] = v;
 	}
 
 	void pal(colour_t c0, colour_t c1, int p) {
 		if (p) {
-			if (!currentGraphicsState->extendedPalette) {
+			if (!gfx->currentGraphicsState->extendedPalette) {
 				c1 = (c1 & 0xf) | ((c1 & 0xf0) >> 3);
 			}
 			GFX_MapPaletteIndex(c0, c1);
 		} else {
-			currentGraphicsState->palette_map[c0 & 0xf] = c1 & 0xf;
+			gfx->currentGraphicsState->palette_map[c0 & 0xf] = c1 & 0xf;
+			gfx->currentGraphicsState->draw_version++;
 		}
 	}
 
@@ -709,7 +1004,8 @@ namespace pico_api {
 	}
 
 	void palt(colour_t col, bool t) {
-		currentGraphicsState->transparent[col] = t;
+		gfx->currentGraphicsState->transparent[col] = t;
+		gfx->currentGraphicsState->draw_version++;
 	}
 
 	void palt() {
@@ -717,74 +1013,86 @@ namespace pico_api {
 	}
 
 	void cursor(int x, int y) {
-		currentGraphicsState->text_x = x;
-		currentGraphicsState->text_y = y;
+		gfx->currentGraphicsState->text_x = x;
+		gfx->currentGraphicsState->text_y = y;
 	}
 
 	void cursor(int x, int y, uint16_t c) {
 		color(c);
-		currentGraphicsState->text_x = x;
-		currentGraphicsState->text_y = y;
+		gfx->currentGraphicsState->text_x = x;
+		gfx->currentGraphicsState->text_y = y;
 	}
 
 	void print(std::string str) {
-		print(str, currentGraphicsState->text_x, currentGraphicsState->text_y);
+		print(str, gfx->currentGraphicsState->text_x, gfx->currentGraphicsState->text_y);
 	}
 
 	void print(std::string str, int x, int y) {
-		print(str, x, y, currentGraphicsState->fg);
+		print(str, x, y, gfx->currentGraphicsState->fg);
 	}
 
 	int print(std::string str, int x, int y, uint16_t c) {
 		pico_private::apply_camera(x, y);
 		color(c);
 
-		colour_t old = currentGraphicsState->palette_map[7];
-		bool oldt = currentGraphicsState->transparent[0];
+		colour_t old = gfx->currentGraphicsState->palette_map[7];
+		bool oldt = gfx->currentGraphicsState->transparent[0];
 
-		currentGraphicsState->palette_map[7] = currentGraphicsState->fg;
-		currentGraphicsState->transparent[0] = true;
+		// text is drawn in the pen colour with 0 transparent, only touch the draw table if that
+		// is not already the case
+		bool remap = old != gfx->currentGraphicsState->fg || !oldt;
+		if (remap) {
+			gfx->currentGraphicsState->palette_map[7] = gfx->currentGraphicsState->fg;
+			gfx->currentGraphicsState->transparent[0] = true;
+			gfx->currentGraphicsState->draw_version++;
+		}
 
-		currentGraphicsState->text_x = x;
+		gfx->currentGraphicsState->text_x = x;
 
 		for (size_t n = 0; n < str.length(); n++) {
 			uint8_t ch = str[n];
 			if (ch >= 0x10 && ch < 0x80) {
 				int index = ch - 0x10;
-				pico_private::blitter(fontbuffer, x, y, (index % 16) * 8, (index / 16) * 8, 4, 5);
+				int sx = (index % 16) * 8;
+				int sy = (index / 16) * 8;
+				pico_private::blitter(gfx->fontbuffer, x, y, sx, sy, 4, 5);
 				x += 4;
 			} else if (ch >= 0x80) {
 				int index = ch - 0x80;
-				pico_private::blitter(fontbuffer, x, y, (index % 16) * 8, (index / 16) * 8 + 56, 8,
-				                      5);
+				int sx = (index % 16) * 8;
+				int sy = (index / 16) * 8 + 56;
+				pico_private::blitter(gfx->fontbuffer, x, y, sx, sy, 8, 5);
 				x += 8;
 			} else if (ch == '\n') {
-				x = currentGraphicsState->text_x;
+				x = gfx->currentGraphicsState->text_x;
 				y += 6;
 			}
 		}
 
-		currentGraphicsState->text_x = 0;
-		currentGraphicsState->text_y = y + 6;
+		gfx->currentGraphicsState->text_x = 0;
+		gfx->currentGraphicsState->text_y = y + 6;
 
-		currentGraphicsState->palette_map[7] = old;
-		currentGraphicsState->transparent[0] = oldt;
+		if (remap) {
+			gfx->currentGraphicsState->palette_map[7] = old;
+			gfx->currentGraphicsState->transparent[0] = oldt;
+			gfx->currentGraphicsState->draw_version++;
+		}
 
-		currentGraphicsState->fg = c & 0xf;
+		gfx->currentGraphicsState->fg = c & 0xf;
 		return x;
 	}
 
 	void clip(int x, int y, int w, int h) {
 		using namespace pico_private;
 
-		currentGraphicsState->clip_x1 = utils::limit(x, 0, buffer_size_x);
-		currentGraphicsState->clip_y1 = utils::limit(y, 0, buffer_size_y);
-		currentGraphicsState->clip_x2 = utils::limit(x + w, 0, buffer_size_x);
-		currentGraphicsState->clip_y2 = utils::limit(y + h, 0, buffer_size_y);
+		gfx->currentGraphicsState->clip_x1 = utils::limit(x, 0, gfx->buffer_size_x);
+		gfx->currentGraphicsState->clip_y1 = utils::limit(y, 0, gfx->buffer_size_y);
+		gfx->currentGraphicsState->clip_x2 = utils::limit(x + w, 0, gfx->buffer_size_x);
+		gfx->currentGraphicsState->clip_y2 = utils::limit(y + h, 0, gfx->buffer_size_y);
 	}
 
 	void clip() {
-		clip(0, 0, currentGraphicsState->max_clip_x, currentGraphicsState->max_clip_y);
+		clip(0, 0, gfx->currentGraphicsState->max_clip_x, gfx->currentGraphicsState->max_clip_y);
 	}
 
 	void camera() {
@@ -792,8 +1100,8 @@ namespace pico_api {
 	}
 
 	void camera(int x, int y) {
-		currentGraphicsState->camera_x = x;
-		currentGraphicsState->camera_y = y;
+		gfx->currentGraphicsState->camera_x = x;
+		gfx->currentGraphicsState->camera_y = y;
 	}
 
 	void fillp() {
@@ -801,12 +1109,12 @@ namespace pico_api {
 	}
 
 	void fillp(int pattern, bool transparent) {
-		currentGraphicsState->pattern = pattern;
-		currentGraphicsState->pattern_transparent = transparent;
+		gfx->currentGraphicsState->pattern = pattern;
+		gfx->currentGraphicsState->pattern_transparent = transparent;
 	}
 
 	uint8_t gfx_peek(uint16_t a) {
-		auto cg = currentGraphicsState;
+		auto cg = gfx->currentGraphicsState;
 		if (a >= 0x5f00 && a <= 0x5f0f) {  // pal
 			if (cg->extendedPalette) {
 				return cg->palette_map[a - 0x5f00];
@@ -842,8 +1150,7 @@ namespace pico_api {
 			case 0x5f2b:  // camera y offset hi byte
 				return uint8_t(cg->camera_y >> 8);
 			case 0x5f2c:  // pixel double/mirror
-				// TODO:
-				return 0;
+				return cg->screen_mode;
 			case 0x5f2d:  // devkit mode
 				return 0;
 			case 0x5f2e:  // persist palette
@@ -862,6 +1169,14 @@ namespace pico_api {
 				return uint8_t(cg->pattern_transparent);
 			case 0x5f34:  // accept pattern in colour param
 				return uint8_t(cg->pattern_with_colour);
+			case 0x5f38:  // tline map wrap width
+				return cg->tline_wrap_w;
+			case 0x5f39:  // tline map wrap height
+				return cg->tline_wrap_h;
+			case 0x5f3a:  // tline map offset x
+				return cg->tline_offset_x;
+			case 0x5f3b:  // tline map offset y
+				return cg->tline_offset_y;
 			case 0x5f3c:  // line end x lo byte
 				return uint8_t(cg->line_x);
 			case 0x5f3d:  // line end x hi byte
@@ -875,7 +1190,7 @@ namespace pico_api {
 	}
 
 	void gfx_poke(uint16_t a, uint8_t v) {
-		auto cg = currentGraphicsState;
+		auto cg = gfx->currentGraphicsState;
 
 		if (a >= 0x5f00 && a <= 0x5f0f) {
 			pico_api::pal(a - 0x5f00, v);
@@ -922,7 +1237,7 @@ namespace pico_api {
 				cg->camera_y = int16_t((cg->camera_y & 0x00ff) | (uint16_t(v) << 8));
 				break;
 			case 0x5f2c:  // pixel double/mirror
-				// TODO:
+				cg->screen_mode = v;
 				break;
 			case 0x5f2d:  // devkit mode
 				// TODO:
@@ -948,6 +1263,18 @@ namespace pico_api {
 			case 0x5f34:  // accept pattern with colour
 				cg->pattern_with_colour = (v != 0);
 				break;
+			case 0x5f38:  // tline map wrap width
+				cg->tline_wrap_w = v;
+				break;
+			case 0x5f39:  // tline map wrap height
+				cg->tline_wrap_h = v;
+				break;
+			case 0x5f3a:  // tline map offset x
+				cg->tline_offset_x = v;
+				break;
+			case 0x5f3b:  // tline map offset y
+				cg->tline_offset_y = v;
+				break;
 			case 0x5f3c:  // line end x lo byte
 				cg->line_x = int16_t((cg->line_x & 0xff00) | v);
 				break;
@@ -967,70 +1294,138 @@ namespace pico_api {
 namespace pico_apix {
 
 	void xpal(bool enable) {
-		currentGraphicsState->extendedPalette = enable;
+		gfx->currentGraphicsState->extendedPalette = enable;
 	}
 
 	void gfxstate(int index) {
-		if (extendedGraphicsStates.find(index) == extendedGraphicsStates.end()) {
-			currentGraphicsState = &extendedGraphicsStates[index];
-			GraphicsState* gs = currentGraphicsState;
+		// states can be replaced in place, so the draw table is always rebuilt for the new one
+		gfx->drawTableState = nullptr;
+		if (gfx->extendedGraphicsStates.find(index) == gfx->extendedGraphicsStates.end()) {
+			gfx->currentGraphicsState = &gfx->extendedGraphicsStates[index];
+			GraphicsState* gs = gfx->currentGraphicsState;
 			pico_private::restore_transparency();
 			pico_private::restore_palette();
-			gs->max_clip_x = buffer_size_x;
-			gs->max_clip_y = buffer_size_y;
+			gs->max_clip_x = gfx->buffer_size_x;
+			gs->max_clip_y = gfx->buffer_size_y;
 			pico_api::clip();
 		} else {
-			currentGraphicsState = &extendedGraphicsStates[index];
-			GraphicsState* gs = currentGraphicsState;
-			gs->clip_x1 = utils::limit(gs->clip_x1, 0, buffer_size_x);
-			gs->clip_y1 = utils::limit(gs->clip_y1, 0, buffer_size_y);
-			gs->clip_x2 = utils::limit(gs->clip_x2, 0, buffer_size_x);
-			gs->clip_y2 = utils::limit(gs->clip_y2, 0, buffer_size_y);
-			gs->max_clip_x = utils::limit(gs->max_clip_x, 0, buffer_size_x);
-			gs->max_clip_y = utils::limit(gs->max_clip_y, 0, buffer_size_y);
+			gfx->currentGraphicsState = &gfx->extendedGraphicsStates[index];
+			GraphicsState* gs = gfx->currentGraphicsState;
+			gs->clip_x1 = utils::limit(gs->clip_x1, 0, gfx->buffer_size_x);
+			gs->clip_y1 = utils::limit(gs->clip_y1, 0, gfx->buffer_size_y);
+			gs->clip_x2 = utils::limit(gs->clip_x2, 0, gfx->buffer_size_x);
+			gs->clip_y2 = utils::limit(gs->clip_y2, 0, gfx->buffer_size_y);
+			gs->max_clip_x = utils::limit(gs->max_clip_x, 0, gfx->buffer_size_x);
+			gs->max_clip_y = utils::limit(gs->max_clip_y, 0, gfx->buffer_size_y);
 		}
 	}
 
+	void
+	rspr(int sx, int sy, int sw, int sh, int dx, int dy, double angle, double scale, bool flip) {
+		pico_private::apply_camera(dx, dy);
+		pico_private::rotate_blitter(gfx->spritebuffer, sx, sy, sw, sh, dx, dy, angle, scale, flip);
+	}
+
 	std::pair<int, int> printx(std::string str, int x, int y, uint16_t c) {
 		for (size_t n = 0; n < str.length(); n++) {
 			if (str[n] == '\n') {
 				str[n] = 25;
 			}
 		}
-		return std::make_pair(pico_api::print(str, x, y, c), currentGraphicsState->text_y);
+		return std::make_pair(pico_api::print(str, x, y, c), gfx->currentGraphicsState->text_y);
 	}
 }  // namespace pico_apix
 
 namespace pico_control {
 
+	GfxContext* gfx_create_context() {
+		return new GfxContext();
+	}
+
+	void gfx_destroy_context(GfxContext* context) {
+		delete context;
+	}
+
+	void gfx_select_context(GfxContext* context) {
+		gfx = context ? context : &defaultGfx;
+	}
+
 	void gfx_init() {
-		extendedGraphicsStates.clear();
+		gfx->extendedGraphicsStates.clear();
 		pico_apix::gfxstate(0);
 	}
 
 	void set_backbuffer(pico_api::colour_t* buffer, int width, int height, int stride) {
-		backbuffer = buffer;
-		buffer_size_x = width;
-		buffer_size_y = height;
-		buffer_stride = stride;
-		currentGraphicsState->max_clip_x = width;
-		currentGraphicsState->max_clip_y = height;
+		gfx->backbuffer = buffer;
+		gfx->buffer_size_x = width;
+		gfx->buffer_size_y = height;
+		gfx->buffer_stride = stride;
+		gfx->currentGraphicsState->max_clip_x = width;
+		gfx->currentGraphicsState->max_clip_y = height;
 	}
 
 	void set_spritebuffer(pico_api::colour_t* buffer) {
-		spritebuffer = buffer;
+		gfx->spritebuffer = buffer;
 	}
 
 	void set_spriteflags(uint8_t* buffer) {
-		spriteflags = buffer;
+		gfx->spriteflags = buffer;
 	}
 
 	void set_mapbuffer(uint8_t* buffer) {
-		mapbuffer = buffer;
+		gfx->mapbuffer = buffer;
 	}
 
 	void set_fontbuffer(pico_api::colour_t* buffer) {
-		fontbuffer = buffer;
+		gfx->fontbuffer = buffer;
+	}
+
+	uint8_t get_screen_mode() {
+		return gfx->currentGraphicsState->screen_mode;
+	}
+
+	// graphics states are plain data so they are saved as raw structs, along with the
+	// screen palette held by the hal.
+	void gfx_save_state(utils::BinaryWriter& w) {
+		int current = 0;
+		w.write((uint32_t)gfx->extendedGraphicsStates.size());
+		for (auto& gs : gfx->extendedGraphicsStates) {
+			w.write((int32_t)gs.first);
+			w.write(gs.second);
+			if (&gs.second == gfx->currentGraphicsState) {
+				current = gs.first;
+			}
+		}
+		w.write((int32_t)current);
+
+		PaletteState ps = GFX_GetPaletteState();
+		w.writeString(ps.name);
+		w.write(ps.rgb);
+		w.write(ps.mapped);
+	}
+
+	std::function<void()> gfx_load_state(utils::BinaryReader& r) {
+		auto states = std::make_shared<std::map<int, GraphicsState>>();
+		uint32_t count = r.read<uint32_t>();
+		for (uint32_t n = 0; n < count && r.ok(); n++) {
+			int index = r.read<int32_t>();
+			(*states)[index] = r.read<GraphicsState>();
+		}
+		int current = r.read<int32_t>();
+
+		auto ps = std::make_shared<PaletteState>();
+		ps->name = r.readString();
+		ps->rgb = r.read<std::array<pixel_t, 256>>();
+		ps->mapped = r.read<std::array<pixel_t, 256>>();
+		if (!r.ok()) {
+			return nullptr;
+		}
+
+		return [states, current, ps]() {
+			gfx->extendedGraphicsStates.swap(*states);
+			pico_apix::gfxstate(current);
+			GFX_SetPaletteState(*ps);
+		};
 	}
 
 }  // namespace pico_control
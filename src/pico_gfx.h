@@ -2,9 +2,12 @@
 #define PICO_GFX_H
 
 #include <stdint.h>
+#include <functional>
 #include <string>
 #include <utility>
 
+#include "utils.h"
+
 namespace pico_api {
 	typedef uint8_t colour_t;
 
@@ -59,6 +62,17 @@ namespace pico_api {
 	void map(int cell_x, int cell_y, int scr_x, int scr_y);
 	void map(int cell_x, int cell_y, int scr_x, int scr_y, int cell_w, int cell_h);
 	void map(int cell_x, int cell_y, int scr_x, int scr_y, int cell_w, int cell_h, uint8_t layer);
+	// draws a line textured from the map. the map position and the step per pixel are 16.16
+	// fixed point cells, the default step is one sprite pixel across.
+	void tline(int x0,
+	           int y0,
+	           int x1,
+	           int y1,
+	           int32_t mx,
+	           int32_t my,
+	           int32_t mdx = 0x2000,
+	           int32_t mdy = 0,
+	           uint8_t layers = 0);
 	uint8_t mget(int x, int y);
 	void mset(int x, int y, uint8_t v);
 
@@ -85,16 +99,28 @@ namespace pico_api {
 namespace pico_apix {
 	void xpal(bool enable);
 	void gfxstate(int index);
+	void
+	rspr(int sx, int sy, int sw, int sh, int dx, int dy, double angle, double scale, bool flip);
 	std::pair<int, int> printx(std::string str, int x, int y, uint16_t c);
 }  // namespace pico_apix
 
 namespace pico_control {
+	struct GfxContext;
+	GfxContext* gfx_create_context();
+	void gfx_destroy_context(GfxContext* context);
+	void gfx_select_context(GfxContext* context);
+
 	void gfx_init();
 	void set_backbuffer(pico_api::colour_t* buffer, int width, int height, int stride);
 	void set_spritebuffer(pico_api::colour_t* buffer);
 	void set_spriteflags(uint8_t* buffer);
 	void set_mapbuffer(uint8_t* buffer);
 	void set_fontbuffer(pico_api::colour_t* buffer);
+	uint8_t get_screen_mode();
+	void gfx_save_state(utils::BinaryWriter& w);
+	// reads the graphics section of a save state and returns the function that applies it, or an
+	// empty function if the section is bad
+	std::function<void()> gfx_load_state(utils::BinaryReader& r);
 }  // namespace pico_control
 
 #endif /* PICO_GFX_H */
@@ -0,0 +1,135 @@
+#include "pico_loop.h"
+
+#include <algorithm>
+
+#include "hal_core.h"
+#include "log.h"
+#include "pico_audio.h"
+#include "pico_core.h"
+#include "pico_rewind.h"
+#include "pico_script.h"
+
+namespace pico_control {
+
+	FrameTimes GameLoop::step(uint8_t input, const MouseState& mouse, bool rewind, bool draw) {
+		FrameTimes times;
+		if (m_restarted) {
+			m_restarted = false;
+			m_scriptError = false;
+			m_errorMessage.clear();
+			m_init = false;
+		}
+
+		frame_start();
+		sound_tick();
+
+		if (!m_scriptError) {
+			try {
+				if (!m_init) {
+					pico_script::run("_init", true, m_restarted);
+					m_init = true;
+				}
+
+				pico_script::run("_pre_update", true, m_restarted);
+				set_input_state(input);
+				set_mouse_state(mouse);
+
+				if (is_pause_menu()) {
+					if (pico_script::do_menu()) {
+						end_pause_menu();
+					}
+				} else if (rewind && rewind_step()) {
+					// the restored frame is shown, the cart does not run while rewinding
+				} else {
+					uint64_t updateTimeStart = TIME_GetProfileTime();
+					if (!pico_script::run("_update", true, m_restarted)) {
+						pico_script::run("_update60", true, m_restarted);
+					}
+					times.update_us = TIME_GetElapsedProfileTime_us(updateTimeStart);
+
+					if (draw) {
+						uint64_t drawTimeStart = TIME_GetProfileTime();
+						pico_script::run("_draw", true, m_restarted);
+						times.draw_us = TIME_GetElapsedProfileTime_us(drawTimeStart);
+					}
+				}
+			} catch (pico_script::error& e) {
+				displayerror(e.what());
+				logr << LogLevel::err << e.what();
+				m_scriptError = true;
+				m_errorMessage = e.what();
+			}
+		}
+
+		// call flip() even though this does not do anything, some carts implement their
+		// own version to make end of frame.
+		pico_script::run("flip", true, m_restarted);
+
+		frame_end();
+		return times;
+	}
+
+	void GameLoop::reload() {
+		m_restarted = true;
+		pico_api::reloadcart();
+	}
+
+	uint32_t GameLoop::targetFps() const {
+		return pico_script::symbolExist("_update60") ? 60 : 30;
+	}
+
+	FrameScheduler::FrameScheduler(uint32_t fps, int maxCatchUp)
+	    : m_period_us(1000000 / std::max(fps, 1u)),
+	      m_maxCatchUp(std::max(maxCatchUp, 1)),
+	      m_last_us(TIME_GetProfileTime_us()) {
+	}
+
+	void FrameScheduler::setRate(uint32_t fps) {
+		m_period_us = 1000000 / std::max(fps, 1u);
+	}
+
+	void FrameScheduler::setMaxCatchUp(int frames) {
+		m_maxCatchUp = std::max(frames, 1);
+	}
+
+	void FrameScheduler::reset() {
+		m_last_us = TIME_GetProfileTime_us();
+		m_accumulator_us = 0;
+	}
+
+	void FrameScheduler::advance() {
+		uint64_t now = TIME_GetProfileTime_us();
+		m_accumulator_us += now - m_last_us;
+		m_last_us = now;
+	}
+
+	int FrameScheduler::due() {
+		advance();
+		uint64_t frames = m_accumulator_us / m_period_us;
+		if (frames > (uint64_t)m_maxCatchUp) {
+			m_dropped += (uint32_t)(frames - m_maxCatchUp);
+			frames = m_maxCatchUp;
+			// whatever is left over beyond a frame period is lost time too
+			m_accumulator_us = m_accumulator_us % m_period_us;
+		} else {
+			m_accumulator_us -= frames * m_period_us;
+		}
+		return (int)frames;
+	}
+
+	uint64_t FrameScheduler::timeToNext() {
+		advance();
+		return m_accumulator_us >= m_period_us ? 0 : m_period_us - m_accumulator_us;
+	}
+
+	void FrameScheduler::sleepUntilDue() {
+		// sleeps are rounded up to whole ms, so the frame runs up to a ms late rather than the
+		// thread spinning. the accumulator carries the lateness, keeping the average rate, and
+		// an os that wakes early is slept again.
+		uint64_t remaining;
+		while ((remaining = timeToNext()) > 0) {
+			TIME_Sleep((int)((remaining + 999) / 1000));
+		}
+	}
+
+}  // namespace pico_control
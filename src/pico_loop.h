@@ -0,0 +1,91 @@
+#ifndef PICO_LOOP_H
+#define PICO_LOOP_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "hal_core.h"
+
+namespace pico_control {
+
+	struct FrameTimes {
+		uint64_t update_us = 0;
+		uint64_t draw_us = 0;
+	};
+
+	// runs the cart one game frame at a time, shared by the player in main.cpp and the
+	// headless runners. presenting the frame is left to the caller.
+	class GameLoop {
+	   public:
+		// runs _init, _update & _draw for one frame with the given input. when rewind is set a
+		// past frame is restored instead if there is one. draw = false skips _draw, for frames
+		// that will not be shown.
+		FrameTimes step(uint8_t input, const MouseState& mouse, bool rewind = false,
+		                bool draw = true);
+
+		// reloads the cart from disk and runs _init again on the next step
+		void reload();
+
+		uint32_t targetFps() const;
+
+		bool scriptError() const {
+			return m_scriptError;
+		}
+
+		// the message of the script error that stopped the cart
+		const std::string& errorMessage() const {
+			return m_errorMessage;
+		}
+
+	   private:
+		bool m_init = false;
+		bool m_restarted = true;
+		bool m_scriptError = false;
+		std::string m_errorMessage;
+	};
+
+	// fixed timestep pacing for the game frames. real time is added to an accumulator and a
+	// game frame is due for every frame period in it, so a cart runs at its own rate whatever
+	// the display refresh is. when the machine falls behind at most maxCatchUp frames are run
+	// back to back and the rest of the lost time is dropped, slowing the game down rather than
+	// trying to catch up forever.
+	class FrameScheduler {
+	   public:
+		explicit FrameScheduler(uint32_t fps = 30, int maxCatchUp = 1);
+
+		// changes the frame rate, keeping the time already accumulated
+		void setRate(uint32_t fps);
+		void setMaxCatchUp(int frames);
+
+		// starts timing again from now with nothing due, eg after a long pause
+		void reset();
+
+		// the number of game frames to run now, between 0 and maxCatchUp. the frames returned
+		// are taken from the accumulator.
+		int due();
+
+		// microseconds until the next frame is due, 0 if one is due now
+		uint64_t timeToNext();
+
+		// sleeps until the next frame is due
+		void sleepUntilDue();
+
+		// game frames dropped because the machine fell too far behind
+		uint32_t dropped() const {
+			return m_dropped;
+		}
+
+	   private:
+		void advance();
+
+		uint64_t m_period_us;
+		int m_maxCatchUp;
+		uint64_t m_last_us;
+		uint64_t m_accumulator_us = 0;
+		uint32_t m_dropped = 0;
+	};
+
+}  // namespace pico_control
+
+#endif /* PICO_LOOP_H */
@@ -0,0 +1,202 @@
+#include "pico_machine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "config.h"
+#include "hal_audio.h"
+#include "hal_core.h"
+#include "log.h"
+#include "pico_audio.h"
+#include "pico_cart.h"
+#include "pico_core.h"
+#include "pico_data.h"
+#include "pico_gfx.h"
+#include "pico_rewind.h"
+#include "pico_script.h"
+
+namespace pico_machine {
+
+	struct Machine {
+		pico_control::CoreContext* core = nullptr;
+		pico_control::GfxContext* gfx = nullptr;
+		pico_control::AudioContext* audio = nullptr;
+		pico_control::RewindContext* rewind = nullptr;
+		pico_script::ScriptContext* script = nullptr;
+		pico_cart::Cart cart;
+
+		// hal state that belongs to the cart, swapped in and out as the machine is selected
+		PaletteState palette;
+		AudioChannelState channels[config::AUDIO_CHANNELS];
+	};
+
+	// the default machine uses the default context of each module, its hal state is never
+	// swapped out so the single cart runtime behaves as it always has.
+	static Machine defaultMachine;
+	static thread_local Machine* currentMachine = &defaultMachine;
+
+	static void save_hal_state(Machine* m) {
+		if (m != &defaultMachine) {
+			m->palette = GFX_GetPaletteState();
+			for (int n = 0; n < config::AUDIO_CHANNELS; n++) {
+				m->channels[n] = AUDIO_GetChannelState(n);
+			}
+		}
+	}
+
+	static void load_hal_state(Machine* m) {
+		if (m != &defaultMachine) {
+			GFX_SetPaletteState(m->palette);
+			for (int n = 0; n < config::AUDIO_CHANNELS; n++) {
+				AUDIO_SetChannelState(n, m->channels[n]);
+			}
+		}
+	}
+
+	Machine* create() {
+		Machine* m = new Machine();
+		m->core = pico_control::core_create_context();
+		m->gfx = pico_control::gfx_create_context();
+		m->audio = pico_control::audio_create_context();
+		m->rewind = pico_control::rewind_create_context();
+		m->script = pico_script::create_context();
+
+		Machine* prev = current();
+		select(m);
+		GFX_SelectPalette("pico8");
+		pico_control::init();
+		pico_data::load_font_data();
+		select(prev);
+		return m;
+	}
+
+	void destroy(Machine* machine) {
+		if (!machine || machine == &defaultMachine) {
+			return;
+		}
+		if (current() == machine) {
+			select(nullptr);
+		}
+		pico_script::destroy_context(machine->script);
+		pico_control::rewind_destroy_context(machine->rewind);
+		pico_control::audio_destroy_context(machine->audio);
+		pico_control::gfx_destroy_context(machine->gfx);
+		pico_control::core_destroy_context(machine->core);
+		delete machine;
+	}
+
+	void select(Machine* machine) {
+		Machine* m = machine ? machine : &defaultMachine;
+		if (m == currentMachine) {
+			return;
+		}
+		save_hal_state(currentMachine);
+		currentMachine = m;
+
+		pico_control::core_select_context(m->core);
+		pico_control::gfx_select_context(m->gfx);
+		pico_control::audio_select_context(m->audio);
+		pico_control::rewind_select_context(m->rewind);
+		pico_script::select_context(m->script);
+		pico_cart::selectCart(m == &defaultMachine ? nullptr : &m->cart);
+		load_hal_state(m);
+	}
+
+	Machine* current() {
+		return currentMachine == &defaultMachine ? nullptr : currentMachine;
+	}
+
+	void parallel_for(size_t count, const std::function<void(size_t)>& fn, int threads) {
+		if (threads <= 0) {
+			threads = std::max(1, (int)std::thread::hardware_concurrency());
+		}
+		threads = (int)std::min((size_t)threads, count);
+		if (threads == 0) {
+			return;
+		}
+
+		struct WorkQueue {
+			std::mutex lock;
+			std::deque<size_t> items;
+		};
+		std::vector<WorkQueue> queues(threads);
+		for (size_t n = 0; n < count; n++) {
+			queues[n % threads].items.push_back(n);
+		}
+
+		// own work is taken from the front, stolen work from the back
+		auto take = [&](int self, size_t& item) -> bool {
+			for (int k = 0; k < threads; k++) {
+				WorkQueue& q = queues[(self + k) % threads];
+				std::lock_guard<std::mutex> lock(q.lock);
+				if (!q.items.empty()) {
+					if (k == 0) {
+						item = q.items.front();
+						q.items.pop_front();
+					} else {
+						item = q.items.back();
+						q.items.pop_back();
+					}
+					return true;
+				}
+			}
+			return false;
+		};
+
+		std::atomic<bool> failed(false);
+		std::mutex errorMutex;
+		std::exception_ptr error;
+		const Logger* parentLog = &logr;
+
+		auto worker = [&](int self) {
+			logr.copySettings(*parentLog);
+			size_t item;
+			while (!failed && take(self, item)) {
+				try {
+					fn(item);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if (!error) {
+						error = std::current_exception();
+					}
+					failed = true;
+				}
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for (int n = 0; n < threads; n++) {
+			pool.emplace_back(worker, n);
+		}
+		for (auto& t : pool) {
+			t.join();
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	// deselects the thread's machine when it goes out of scope, even when fn throws, saving its
+	// hal state so the machine can move to another thread
+	struct Deselect {
+		~Deselect() {
+			select(nullptr);
+		}
+	};
+
+	void for_each(const std::vector<Machine*>& machines,
+	              const std::function<void(Machine*)>& fn,
+	              int threads) {
+		auto run = [&](size_t n) {
+			select(machines[n]);
+			Deselect deselect;
+			fn(machines[n]);
+		};
+		parallel_for(machines.size(), run, threads);
+	}
+
+}  // namespace pico_machine
@@ -0,0 +1,42 @@
+#ifndef PICO_MACHINE_H
+#define PICO_MACHINE_H
+
+#include <stddef.h>
+
+#include <functional>
+#include <vector>
+
+// a machine holds everything one running cart owns: ram, graphics state, the lua state, the
+// loaded cart and its rewind history. the pico_* functions act on the machine selected on the
+// calling thread, which is the default machine unless another one has been selected.
+//
+// machines other than the default should be run against a hal that is safe to call from many
+// threads, such as hal_headless.cpp.
+
+namespace pico_machine {
+
+	struct Machine;
+
+	// creates and initialises a machine, the selected machine is not changed.
+	Machine* create();
+	void destroy(Machine* machine);
+
+	// selects the machine used by the calling thread, nullptr selects the default machine.
+	void select(Machine* machine);
+	Machine* current();
+
+	// calls fn(n) for n in [0, count) on a pool of threads, returns when every call has
+	// finished. the range is dealt out between the threads and a thread that runs out of work
+	// steals from the back of the others, so uneven workloads still keep every core busy. an
+	// exception thrown by fn stops the remaining work and is rethrown here. threads <= 0 uses
+	// one thread per core.
+	void parallel_for(size_t count, const std::function<void(size_t)>& fn, int threads = 0);
+
+	// calls fn for each machine using parallel_for with the machine selected.
+	void for_each(const std::vector<Machine*>& machines,
+	              const std::function<void(Machine*)>& fn,
+	              int threads = 0);
+
+}  // namespace pico_machine
+
+#endif /* PICO_MACHINE_H */
@@ -2,6 +2,7 @@
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
 
 #include "pico_memory.h"
 
@@ -33,6 +34,42 @@ namespace pico_ram {
 		}
 	}
 
+	// bulk copies are split at memory area boundaries. unmapped memory reads as 0.
+	void RAM::read(uint16_t addr, uint8_t* dest, uint16_t len) {
+		uint32_t a = addr;
+		uint32_t end = std::min<uint32_t>(a + len, 0x10000);
+		while (a < end) {
+			auto area = m_pages[a >> 8];
+			uint32_t chunk;
+			if (area == nullptr) {
+				chunk = std::min<uint32_t>(end, (a & ~0xff) + 0x100) - a;
+				memset(dest, 0, chunk);
+			} else {
+				chunk = std::min<uint32_t>(end, area->address() + area->size()) - a;
+				area->read(a - area->address(), dest, chunk);
+			}
+			a += chunk;
+			dest += chunk;
+		}
+	}
+
+	void RAM::write(uint16_t addr, const uint8_t* src, uint16_t len) {
+		uint32_t a = addr;
+		uint32_t end = std::min<uint32_t>(a + len, 0x10000);
+		while (a < end) {
+			auto area = m_pages[a >> 8];
+			uint32_t chunk;
+			if (area == nullptr) {
+				chunk = std::min<uint32_t>(end, (a & ~0xff) + 0x100) - a;
+			} else {
+				chunk = std::min<uint32_t>(end, area->address() + area->size()) - a;
+				area->write(a - area->address(), src, chunk);
+			}
+			a += chunk;
+			src += chunk;
+		}
+	}
+
 	void RAM::dump(uint16_t from, uint16_t len) {
 		int count = 0;
 		for (uint16_t i = 0; i < len; i++) {
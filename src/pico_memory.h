@@ -2,6 +2,7 @@
 #define PICO_MEMORY_H
 
 #include <stdint.h>
+#include <string.h>
 #include <array>
 
 namespace pico_ram {
@@ -32,6 +33,19 @@ namespace pico_ram {
 		virtual uint16_t size() const = 0;
 		virtual uint8_t peek(uint16_t addr) = 0;
 		virtual void poke(uint16_t addr, uint8_t val) = 0;
+
+		// bulk access, areas with a linear layout override these to copy directly
+		virtual void read(uint16_t addr, uint8_t* dest, uint16_t len) {
+			for (uint16_t n = 0; n < len; n++) {
+				dest[n] = peek(addr + n);
+			}
+		}
+
+		virtual void write(uint16_t addr, const uint8_t* src, uint16_t len) {
+			for (uint16_t n = 0; n < len; n++) {
+				poke(addr + n, src[n]);
+			}
+		}
 	};
 
 	struct MemoryArea : public IMemoryArea {
@@ -70,6 +84,14 @@ namespace pico_ram {
 		virtual void poke(uint16_t addr, uint8_t val) {
 			m_data[addr] = val;
 		}
+
+		virtual void read(uint16_t addr, uint8_t* dest, uint16_t len) {
+			memcpy(dest, m_data + addr, len);
+		}
+
+		virtual void write(uint16_t addr, const uint8_t* src, uint16_t len) {
+			memcpy(m_data + addr, src, len);
+		}
 	};
 
 	struct LinearMemoryAreaDF : public MemoryArea {
@@ -85,6 +107,15 @@ namespace pico_ram {
 			m_isDirty = true;
 		}
 
+		virtual void read(uint16_t addr, uint8_t* dest, uint16_t len) {
+			memcpy(dest, m_data + addr, len);
+		}
+
+		virtual void write(uint16_t addr, const uint8_t* src, uint16_t len) {
+			memcpy(m_data + addr, src, len);
+			m_isDirty = true;
+		}
+
 		void clearDirty() {
 			m_isDirty = false;
 		}
@@ -157,6 +188,15 @@ namespace pico_ram {
 			m_primary->poke(addr, val);
 			m_secondary->poke(addr, val);
 		}
+
+		virtual void read(uint16_t addr, uint8_t* dest, uint16_t len) {
+			m_primary->read(addr, dest, len);
+		}
+
+		virtual void write(uint16_t addr, const uint8_t* src, uint16_t len) {
+			m_primary->write(addr, src, len);
+			m_secondary->write(addr, src, len);
+		}
 	};
 
 	class RAM {
@@ -168,6 +208,8 @@ namespace pico_ram {
 		void addMemoryArea(IMemoryArea* area);
 		uint8_t peek(uint16_t addr);
 		void poke(uint16_t addr, uint8_t val);
+		void read(uint16_t addr, uint8_t* dest, uint16_t len);
+		void write(uint16_t addr, const uint8_t* src, uint16_t len);
 		void dump(uint16_t from, uint16_t len);
 	};
 }  // namespace pico_ram
@@ -0,0 +1,335 @@
+#include "pico_rewind.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "hal_core.h"
+#include "log.h"
+#include "pico_core.h"
+#include "utils.h"
+
+// rewind history. the machine state is saved every few frames and compared with the previous
+// state a page at a time, only changed pages are kept, xor'd with the previous state and run
+// length encoded. xor works both ways, so stepping back from the newest state needs nothing but
+// the deltas and the oldest deltas can be dropped as the ring fills.
+//
+// saving the lua globals costs far more than the memory, up to milliseconds on carts with large
+// tables, so states are saved only as often as config::REWIND_FRAME_BUDGET_US allows.
+
+namespace pico_private {
+
+	const size_t REWIND_PAGE_SIZE = 256;
+	const uint32_t REWIND_END = 0xffffffff;
+
+	// variable sized records in a fixed size ring of bytes, the oldest records are dropped to
+	// make room.
+	class RewindRing {
+	   public:
+		void reset(size_t capacity) {
+			m_data.assign(capacity, 0);
+			m_start = 0;
+			m_used = 0;
+			m_sizes.clear();
+		}
+
+		void clear() {
+			reset(m_data.size());
+		}
+
+		size_t capacity() const {
+			return m_data.size();
+		}
+
+		size_t used() const {
+			return m_used;
+		}
+
+		size_t count() const {
+			return m_sizes.size();
+		}
+
+		bool push(const std::string& rec) {
+			if (rec.empty() || rec.size() > m_data.size()) {
+				return false;
+			}
+			while (m_used + rec.size() > m_data.size()) {
+				m_start = (m_start + m_sizes.front()) % m_data.size();
+				m_used -= m_sizes.front();
+				m_sizes.pop_front();
+			}
+
+			size_t pos = (m_start + m_used) % m_data.size();
+			size_t first = std::min(rec.size(), m_data.size() - pos);
+			memcpy(&m_data[pos], rec.data(), first);
+			memcpy(&m_data[0], rec.data() + first, rec.size() - first);
+			m_used += rec.size();
+			m_sizes.push_back(rec.size());
+			return true;
+		}
+
+		// removes the newest record
+		bool pop(std::string& rec) {
+			if (m_sizes.empty()) {
+				return false;
+			}
+			rec.resize(m_sizes.back());
+			m_used -= rec.size();
+			m_sizes.pop_back();
+
+			size_t pos = (m_start + m_used) % m_data.size();
+			size_t first = std::min(rec.size(), m_data.size() - pos);
+			memcpy(&rec[0], &m_data[pos], first);
+			memcpy(&rec[first], &m_data[0], rec.size() - first);
+			return true;
+		}
+
+	   private:
+		std::vector<uint8_t> m_data;
+		size_t m_start = 0;
+		size_t m_used = 0;
+		std::deque<size_t> m_sizes;
+	};
+
+}  // namespace pico_private
+
+namespace pico_control {
+	struct RewindContext {
+		pico_private::RewindRing rewindRing;
+		std::string rewindLast;  // newest state, deltas step back from here
+		bool rewound = false;    // a past state was restored this frame
+		int rewindPending = 0;   // states the cart asked to step back
+		int interval = 1;        // frames between saved states
+		int sinceCapture = 0;    // frames run since the newest state was saved
+		uint64_t captureTime = 0;
+		int captures = 0;
+		int frames = 0;
+	};
+}  // namespace pico_control
+
+// the context of the machine running on this thread
+static pico_control::RewindContext defaultRewind;
+static thread_local pico_control::RewindContext* rw = &defaultRewind;
+
+namespace pico_private {
+
+	static uint8_t byte_at(const std::string& s, size_t i) {
+		return i < s.size() ? (uint8_t)s[i] : 0;
+	}
+
+	// runs of zeros are stored as 0x80 | (length - 1), other bytes as (length - 1) followed by
+	// the bytes. runs are at most 128 bytes.
+	static void encode_page(const std::string& a,
+	                        const std::string& b,
+	                        size_t from,
+	                        size_t len,
+	                        std::string& out) {
+		uint8_t x[REWIND_PAGE_SIZE];
+		for (size_t n = 0; n < len; n++) {
+			x[n] = byte_at(a, from + n) ^ byte_at(b, from + n);
+		}
+
+		size_t n = 0;
+		while (n < len) {
+			size_t run = 0;
+			if (x[n] == 0) {
+				while (n + run < len && run < 128 && x[n + run] == 0) {
+					run++;
+				}
+				out += (char)(0x80 | (run - 1));
+			} else {
+				// single zeros are cheaper left in a literal run
+				while (n + run < len && run < 128 &&
+				       !(x[n + run] == 0 && n + run + 1 < len && x[n + run + 1] == 0)) {
+					run++;
+				}
+				out += (char)(run - 1);
+				out.append((const char*)x + n, run);
+			}
+			n += run;
+		}
+	}
+
+	static bool decode_page(utils::BinaryReader& r, uint8_t* dest, size_t len) {
+		size_t n = 0;
+		while (n < len) {
+			uint8_t c = r.read<uint8_t>();
+			size_t run = (c & 0x7f) + 1;
+			if (!r.ok() || n + run > len) {
+				return false;
+			}
+			if ((c & 0x80) == 0) {
+				const uint8_t* src = r.skip(run);
+				if (!src) {
+					return false;
+				}
+				for (size_t i = 0; i < run; i++) {
+					dest[n + i] ^= src[i];
+				}
+			}
+			n += run;
+		}
+		return true;
+	}
+
+	static void rewind_capture() {
+		uint64_t start = TIME_GetProfileTime();
+		utils::BinaryWriter state;
+		pico_control::write_state(state);
+
+		if (!rw->rewindLast.empty()) {
+			const std::string& a = state.data;
+			const std::string& b = rw->rewindLast;
+			size_t len = std::max(a.size(), b.size());
+
+			utils::BinaryWriter delta;
+			delta.write((uint32_t)b.size());
+			for (size_t from = 0; from < len; from += REWIND_PAGE_SIZE) {
+				size_t plen = std::min(REWIND_PAGE_SIZE, len - from);
+				if (from + plen <= a.size() && from + plen <= b.size() &&
+				    memcmp(a.data() + from, b.data() + from, plen) == 0) {
+					continue;
+				}
+				delta.write((uint32_t)(from / REWIND_PAGE_SIZE));
+				encode_page(a, b, from, plen, delta.data);
+			}
+			delta.write(REWIND_END);
+			if (!rw->rewindRing.push(delta.data)) {
+				// the chain back from the new state is broken
+				rw->rewindRing.clear();
+			}
+		}
+		rw->rewindLast = std::move(state.data);
+
+		// the next state waits until this one's cost is spread over the frame budget
+		uint64_t elapsed = TIME_GetElapsedProfileTime_us(start);
+		rw->interval = (int)std::min<uint64_t>(
+		    config::REWIND_MAX_INTERVAL, 1 + elapsed / config::REWIND_FRAME_BUDGET_US);
+		rw->captureTime += elapsed;
+		rw->captures++;
+	}
+
+	static void rewind_log() {
+		if (++rw->frames < 60) {
+			return;
+		}
+		logr << LogLevel::perf << "rewind: " << rw->rewindRing.count() << " states "
+		     << rw->rewindRing.used() << " bytes, every " << rw->interval << " frames, capture "
+		     << (rw->captures ? rw->captureTime / rw->captures : 0) << "us, "
+		     << rw->captureTime / rw->frames << "us per frame";
+		rw->captureTime = 0;
+		rw->captures = 0;
+		rw->frames = 0;
+	}
+
+}  // namespace pico_private
+
+namespace pico_control {
+	using namespace pico_private;
+
+	RewindContext* rewind_create_context() {
+		return new RewindContext();
+	}
+
+	void rewind_destroy_context(RewindContext* context) {
+		delete context;
+	}
+
+	void rewind_select_context(RewindContext* context) {
+		rw = context ? context : &defaultRewind;
+	}
+
+	void rewind_init(size_t bufferSize) {
+		rw->rewindRing.reset(bufferSize);
+		rewind_reset();
+	}
+
+	void rewind_reset() {
+		rw->rewindRing.clear();
+		rw->rewindLast.clear();
+		rw->rewound = false;
+		rw->rewindPending = 0;
+		rw->interval = 1;
+		rw->sinceCapture = 0;
+	}
+
+	// restores the previous saved state, returns false when there is no history left. frames run
+	// since the newest state was saved go back to that state first.
+	bool rewind_step() {
+		if (rw->rewindLast.empty()) {
+			return false;
+		}
+		std::string delta;
+		if (rw->sinceCapture == 0 && !rw->rewindRing.pop(delta)) {
+			return false;
+		}
+
+		utils::BinaryReader r(delta.data(), delta.size());
+		bool ok = true;
+		if (!delta.empty()) {
+			size_t size = r.read<uint32_t>();
+			size_t len = std::max(size, rw->rewindLast.size());
+			rw->rewindLast.resize(len, 0);
+
+			for (uint32_t page = r.read<uint32_t>(); ok && page != REWIND_END;
+			     page = r.read<uint32_t>()) {
+				size_t from = page * REWIND_PAGE_SIZE;
+				size_t plen = std::min(REWIND_PAGE_SIZE, len - from);
+				ok = r.ok() && from < len &&
+				     decode_page(r, (uint8_t*)&rw->rewindLast[from], plen);
+			}
+			rw->rewindLast.resize(size);
+		}
+
+		if (ok) {
+			utils::BinaryReader sr(rw->rewindLast.data(), rw->rewindLast.size());
+			// cart data is saved to disk as it changes, stepping back must not undo a high score
+			// or write the file again
+			ok = read_state(sr, false);
+		}
+		if (!ok) {
+			logr << LogLevel::err << "rewind history is corrupt";
+			rewind_reset();
+			return false;
+		}
+		rw->rewound = true;
+		rw->sinceCapture = 0;
+		return true;
+	}
+
+	void rewind_frame_end() {
+		if (rw->rewindRing.capacity() == 0) {
+			return;
+		}
+		while (rw->rewindPending > 0) {
+			rw->rewindPending--;
+			if (!rewind_step()) {
+				rw->rewindPending = 0;
+			}
+		}
+		if (rw->rewound) {
+			// the restored state is the newest one held
+			rw->rewound = false;
+		} else if (rw->rewindLast.empty() || ++rw->sinceCapture >= rw->interval) {
+			rewind_capture();
+			rw->sinceCapture = 0;
+		}
+		rewind_log();
+	}
+
+}  // namespace pico_control
+
+namespace pico_apix {
+
+	// steps back at the end of the frame, returns the number of states that can be stepped back
+	// to.
+	int rewind(int steps) {
+		rw->rewindPending += std::max(steps, 0);
+		return (int)rw->rewindRing.count() + (rw->sinceCapture > 0 ? 1 : 0);
+	}
+
+}  // namespace pico_apix
@@ -0,0 +1,22 @@
+#ifndef PICO_REWIND_H
+#define PICO_REWIND_H
+
+#include <stddef.h>
+
+namespace pico_apix {
+	int rewind(int steps);
+}  // namespace pico_apix
+
+namespace pico_control {
+	struct RewindContext;
+	RewindContext* rewind_create_context();
+	void rewind_destroy_context(RewindContext* context);
+	void rewind_select_context(RewindContext* context);
+
+	void rewind_init(size_t bufferSize);
+	void rewind_reset();
+	bool rewind_step();
+	void rewind_frame_end();
+}  // namespace pico_control
+
+#endif /* PICO_REWIND_H */
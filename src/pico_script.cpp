@@ -6,7 +6,8 @@
 #include <deque>
 #include <functional>
 #include <iostream>
-#include <set>
+#include <unordered_map>
+#include <vector>
 
 #include "firmware.lua"
 #include "hal_audio.h"
@@ -16,32 +17,59 @@
 #include "pico_audio.h"
 #include "pico_cart.h"
 #include "pico_core.h"
+#include "pico_rewind.h"
 #include "z8lua/lauxlib.h"
 #include "z8lua/lua.h"
 #include "z8lua/lualib.h"
 
-static lua_State* lstate = nullptr;
-
 typedef std::function<void()> deferredAPICall_t;
-static std::deque<deferredAPICall_t> deferredAPICalls;
 
-static bool hook_funcs = false;
+namespace pico_script {
+
+	struct ScriptContext {
+		lua_State* lstate = nullptr;
+		std::deque<deferredAPICall_t> deferredAPICalls;
+		bool hook_funcs = false;
+
+		// source names are interned per function prototype so the pointer identifies the chunk,
+		// the result of comparing it with the cart chunk name is cached per pointer.
+		std::unordered_map<const char*, bool> debug_main_sources;
+
+		// breakpoints are only supported in the cart chunk, indexed by its line number.
+		std::vector<bool> debug_breakpoints;
+		int debug_breakpoint_count = 0;
+		bool debug_singlestep = false;
+		int break_line_number = -1;
+	};
+
+}  // namespace pico_script
+
+// the context of the machine running on this thread
+static pico_script::ScriptContext defaultScript;
+static thread_local pico_script::ScriptContext* script = &defaultScript;
 
 static void throw_error(int err) {
 	if (err) {
-		std::string msg = lua_tostring(lstate, -1);
+		std::string msg = lua_tostring(script->lstate, -1);
 		logr << LogLevel::err << msg;
-		auto errlnstart = msg.find(":");
-		auto errlnend = msg.find(":", errlnstart + 1);
-		int errline = std::stoi(msg.substr(errlnstart + 1, errlnend - errlnstart - 1)) - 1;
 
-		auto li = pico_cart::getLineInfo(pico_cart::getCart(), errline);
+		// errors in the cart code are reported as [string "main"]:<line>:, map that to the source
+		// file and line it came from
+		static const std::string mainPrefix = "[string \"main\"]:";
+		auto errlnend = msg.find(":", mainPrefix.size());
+		if (msg.compare(0, mainPrefix.size(), mainPrefix) == 0 && errlnend != std::string::npos) {
+			int errline = atoi(msg.c_str() + mainPrefix.size()) - 1;
+
+			auto li = pico_cart::getLineInfo(pico_cart::getCart(), errline);
 
-		std::stringstream ss;
-		ss << li.filename << ":" << li.localLineNum << ":" << li.sourceLine << msg.substr(errlnend);
+			std::stringstream ss;
+			ss << li.filename << ":" << li.localLineNum << ":" << li.sourceLine
+			   << msg.substr(errlnend);
+			msg = ss.str();
+		}
 
-		pico_script::error e(ss.str());
-		lua_pop(lstate, 1);
+		pico_script::error e(msg);
+		lua_pop(script->lstate, 1);
 		throw e;
 	}
 }
@@ -70,22 +98,23 @@ static void dump_func(lua_State* ls, const char* funcname) {
 static void register_cfuncs(lua_State* ls);
 
 static void init_scripting() {
-	lstate = luaL_newstate();
-	luaL_openlibs(lstate);
-	luaopen_debug(lstate);
-	luaopen_string(lstate);
+	script->lstate = luaL_newstate();
+	luaL_openlibs(script->lstate);
+	luaopen_debug(script->lstate);
+	luaopen_string(script->lstate);
 
-	hook_funcs = false;
+	script->hook_funcs = false;
+	script->debug_main_sources.clear();
 
 	DEBUG_Trace(false);
 
 	std::string fw = pico_cart::convert_emojis(firmware);
 
-	throw_error(luaL_loadbuffer(lstate, fw.c_str(), fw.size(), "firmware"));
-	throw_error(lua_pcall(lstate, 0, 0, 0));
+	throw_error(luaL_loadbuffer(script->lstate, fw.c_str(), fw.size(), "firmware"));
+	throw_error(lua_pcall(script->lstate, 0, 0, 0));
 
-	register_cfuncs(lstate);
-	luaL_dostring(lstate, "__tac08__.make_api_list()");
+	register_cfuncs(script->lstate);
+	luaL_dostring(script->lstate, "__tac08__.make_api_list()");
 }
 
 // ------------------------------------------------------------------
@@ -96,14 +125,14 @@ static int impl_load(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto s = luaL_checkstring(ls, 1);
 	if (s) {
-		deferredAPICalls.push_back([=]() { pico_api::load(s); });
+		script->deferredAPICalls.push_back([=]() { pico_api::load(s); });
 	}
 	return 0;
 }
 
 static int impl_run(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
-	deferredAPICalls.push_back([]() { pico_api::reloadcart(); });
+	script->deferredAPICalls.push_back([]() { pico_api::reloadcart(); });
 	return 0;
 }
 
@@ -326,6 +355,22 @@ static int impl_map(lua_State* ls) {
 	return 0;
 }
 
+static int impl_tline(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	auto count = lua_gettop(ls);
+	auto x0 = lua_tonumber(ls, 1).toInt();
+	auto y0 = lua_tonumber(ls, 2).toInt();
+	auto x1 = lua_tonumber(ls, 3).toInt();
+	auto y1 = lua_tonumber(ls, 4).toInt();
+	int32_t mx = lua_tonumber(ls, 5).bits();
+	int32_t my = lua_tonumber(ls, 6).bits();
+	int32_t mdx = count >= 7 ? lua_tonumber(ls, 7).bits() : 0x2000;
+	int32_t mdy = count >= 8 ? lua_tonumber(ls, 8).bits() : 0;
+	uint8_t layers = count >= 9 ? lua_tonumber(ls, 9).toInt() : 0;
+	pico_api::tline(x0, y0, x1, y1, mx, my, mdx, mdy, layers);
+	return 0;
+}
+
 static int impl_pal(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto pcount = lua_gettop(ls);
@@ -712,7 +757,7 @@ static int impl_memset(lua_State* ls) {
 
 static int impl_ord(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
-	const char* msg = luaL_checkstring(lstate, 1);
+	const char* msg = luaL_checkstring(script->lstate, 1);
 	if (msg && strlen(msg)) {
 		lua_pushnumber(ls, (uint)msg[0]);
 		return 1;
@@ -773,7 +818,8 @@ static int implx_wrstr(lua_State* ls) {
 static int implx_wavload(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto name = luaL_checkstring(ls, 1);
-	int id = pico_apix::wavload(name);
+	bool pack = lua_toboolean(ls, 2);
+	int id = pico_apix::wavload(name, pack);
 	if (id < 0)
 		lua_pushnil(ls);
 	else
@@ -993,6 +1039,60 @@ static int implx_assetload(lua_State* ls) {
 	return 0;
 }
 
+static int implx_savestate(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	pico_apix::savestate();
+	return 0;
+}
+
+static int implx_loadstate(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	pico_apix::loadstate();
+	return 0;
+}
+
+static int implx_screenshot(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	int scale = lua_gettop(ls) == 0 ? 0 : lua_tonumber(ls, 1).toInt();
+	pico_apix::screenshot(scale);
+	return 0;
+}
+
+static int implx_rewind(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	int steps = lua_gettop(ls) == 0 ? 1 : lua_tonumber(ls, 1).toInt();
+	lua_pushnumber(ls, pico_apix::rewind(steps));
+	return 1;
+}
+
+static int implx_rspr(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	auto sx = luaL_checknumber(ls, 1).toInt();
+	auto sy = luaL_checknumber(ls, 2).toInt();
+	auto sw = luaL_checknumber(ls, 3).toInt();
+	auto sh = luaL_checknumber(ls, 4).toInt();
+	auto dx = luaL_checknumber(ls, 5).toInt();
+	auto dy = luaL_checknumber(ls, 6).toInt();
+	double angle = luaL_optnumber(ls, 7, 0);
+	double scale = luaL_optnumber(ls, 8, 1);
+	auto flip = lua_toboolean(ls, 9);
+	pico_apix::rspr(sx, sy, sw, sh, dx, dy, angle, scale, flip);
+	return 0;
+}
+
+static int implx_target(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	if (lua_gettop(ls) == 0 || lua_isnil(ls, 1)) {
+		pico_apix::target();
+		return 0;
+	}
+	auto page = luaL_checknumber(ls, 1).toInt();
+	auto w = luaL_optnumber(ls, 2, 128).toInt();
+	auto h = luaL_optnumber(ls, 3, 128).toInt();
+	pico_apix::target(page, w, h);
+	return 0;
+}
+
 static int implx_gfxstate(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	int index = lua_tonumber(ls, 1).toInt();
@@ -1021,29 +1121,54 @@ static int implx_dbg_getsrclines(lua_State* ls) {
 	return 1;
 }
 
-static std::set<int> debug_breakpoints;
-static bool debug_singlestep = false;
-static int break_line_number = -1;
+static bool dbg_is_main_source(const char* source) {
+	if (source == nullptr) {
+		return true;
+	}
+	auto i = script->debug_main_sources.find(source);
+	if (i != script->debug_main_sources.end()) {
+		return i->second;
+	}
+	bool isMain = strcmp(source, "main") == 0;
+	script->debug_main_sources[source] = isMain;
+	return isMain;
+}
+
+static bool dbg_hooks_needed() {
+	return script->debug_singlestep || script->debug_breakpoint_count > 0;
+}
 
 static void dbg_hookfunc(lua_State* ls, lua_Debug* ar) {
 	//	logr << "dbg_hookfunc " << ar->currentline << ":"
 	//<< pico_apix::dbg_getsrc("main", ar->currentline).first;
 
-	break_line_number = -1;
+	script->break_line_number = -1;
 
-	lua_Debug info;
-	lua_getstack(ls, 0, &info);
-	lua_getinfo(ls, "S", &info);
+	int line = ar->currentline;
+	const std::vector<bool>& breakpoints = script->debug_breakpoints;
+	bool bp = line >= 0 && line < (int)breakpoints.size() && breakpoints[line];
+	if (!bp && !script->debug_singlestep) {
+		return;
+	}
 
-	if (info.source && strcmp(info.source, "main") != 0) {
+	lua_getinfo(ls, "S", ar);
+	if (!dbg_is_main_source(ar->source)) {
 		return;
 	}
 
-	if (debug_breakpoints.count(ar->currentline) || debug_singlestep) {
-		debug_singlestep = false;
-		break_line_number = ar->currentline;
-		luaL_dostring(ls, "__tac08__.dbg.locals = __tac08__.dbg.dumplocals(3)");
-		lua_yield(ls, 0);
+	script->debug_singlestep = false;
+	script->break_line_number = line;
+	luaL_dostring(ls, "__tac08__.dbg.locals = __tac08__.dbg.dumplocals(3)");
+	lua_yield(ls, 0);
+}
+
+// line hooks are only installed while there is something to stop on, so code run under the
+// debugger without breakpoints runs at full speed.
+static void dbg_update_hook(lua_State* co) {
+	if (dbg_hooks_needed()) {
+		lua_sethook(co, dbg_hookfunc, LUA_MASKLINE, 0);
+	} else {
+		lua_sethook(co, nullptr, 0, 0);
 	}
 }
 
@@ -1052,7 +1177,7 @@ static int implx_dbg_cocreate(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	luaL_checktype(ls, 1, LUA_TFUNCTION);
 	lua_State* co = lua_newthread(ls);
-	lua_sethook(co, dbg_hookfunc, LUA_MASKLINE, 0);
+	dbg_update_hook(co);
 	lua_pushvalue(ls, 1); /* move function to top */
 	lua_xmove(ls, co, 1); /* move function from L to NL */
 
@@ -1079,7 +1204,8 @@ static int implx_dbg_coresume(lua_State* ls) {
 	lua_State* co = lua_tothread(ls, -2);
 	std::string mode = lua_tostring(ls, -1);
 
-	debug_singlestep = (mode == "step");
+	script->debug_singlestep = (mode == "step");
+	dbg_update_hook(co);
 
 	int status = lua_status(co);
 	if (status == LUA_OK || status == LUA_YIELD) {
@@ -1093,7 +1219,7 @@ static int implx_dbg_coresume(lua_State* ls) {
 
 		case LUA_YIELD:
 			lua_pushstring(ls, "break");
-			lua_pushnumber(ls, break_line_number);
+			lua_pushnumber(ls, script->break_line_number);
 			return 2;
 
 		default:
@@ -1112,22 +1238,40 @@ static int implx_dbg_coresume(lua_State* ls) {
 	return 0;
 }
 
-// dbg_bpline (line, enabled)
+// dbg_bpline (line, enabled, [file])
+// line is the line number in the combined source, or the line within file if given.
 static int implx_dbg_bpline(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	int line = luaL_checknumber(ls, 1).toInt();
 	bool enabled = lua_toboolean(ls, 2);
 
-	if (enabled) {
-		debug_breakpoints.insert(line);
-	} else {
-		debug_breakpoints.erase(line);
+	if (lua_gettop(ls) >= 3) {
+		auto& cart = pico_cart::getCart();
+		int file = pico_cart::findFile(cart, luaL_checkstring(ls, 3));
+		line = pico_cart::getGlobalLine(cart, file, line) + 1;
+		if (line <= 0) {
+			return 0;
+		}
+	}
+
+	if (line < 0) {
+		return 0;
+	}
+	if (line >= (int)script->debug_breakpoints.size()) {
+		if (!enabled) {
+			return 0;
+		}
+		script->debug_breakpoints.resize(line + 1, false);
+	}
+	if (script->debug_breakpoints[line] != enabled) {
+		script->debug_breakpoints[line] = enabled;
+		script->debug_breakpoint_count += enabled ? 1 : -1;
 	}
 	return 0;
 }
 
 static int implx_dbg_hooks(lua_State* ls) {
-	hook_funcs = true;
+	script->hook_funcs = true;
 	return 0;
 }
 
@@ -1210,7 +1354,8 @@ static const luaL_Reg pico8_api[] = {{"load", impl_load},         {"run", impl_r
                                      {"stat", impl_stat},         {"music", impl_music},
                                      {"sfx", impl_sfx},           {"memcpy", impl_memcpy},
                                      {"memset", impl_memset},     {"ord", impl_ord},
-                                     {"chr", impl_chr},           {NULL, NULL}};
+                                     {"chr", impl_chr},           {"tline", impl_tline},
+                                     {NULL, NULL}};
 
 static const luaL_Reg tac08_api[] = {{"wrclip", implx_wrclip},
                                      {"rdclip", implx_rdclip},
@@ -1243,6 +1388,12 @@ static const luaL_Reg tac08_api[] = {{"wrclip", implx_wrclip},
                                      {"window", implx_window},
                                      {"assetload", implx_assetload},
                                      {"gfxstate", implx_gfxstate},
+                                     {"rspr", implx_rspr},
+                                     {"target", implx_target},
+                                     {"savestate", implx_savestate},
+                                     {"loadstate", implx_loadstate},
+                                     {"rewind", implx_rewind},
+                                     {"screenshot", implx_screenshot},
                                      {"dbg_getsrc", implx_dbg_getsrc},
                                      {"dbg_getsrclines", implx_dbg_getsrclines},
                                      {"dbg_cocreate", implx_dbg_cocreate},
@@ -1264,6 +1415,161 @@ static void register_cfuncs(lua_State* ls) {
 	luaL_setfuncs(ls, tac08_api, 0);
 }
 
+// ------------------------------------------------------------------
+// save states
+// ------------------------------------------------------------------
+
+// the data reachable from the globals is saved, tables are numbered in the order they are
+// found so shared tables and cycles are kept. functions, userdata and threads can't be saved,
+// they are skipped along with their keys and left as they are when a state is loaded.
+
+enum : uint8_t { STATE_END, STATE_FALSE, STATE_TRUE, STATE_NUMBER, STATE_STRING, STATE_TABLE };
+static const uint32_t STATE_NO_TABLE = 0xffffffff;
+
+// library tables are the same in every state
+static const char* const state_skip_globals[] = {
+    "_G", "package", "string", "table", "math", "coroutine", "debug", "os", "io", "__tac08__"};
+
+// table ids are stored as raw fix32 bits, the fix32 range is too small to count them.
+static void state_push_id(lua_State* ls, uint32_t id) {
+	lua_pushnumber(ls, z8::fix32::frombits(id));
+}
+
+static bool state_is_saved(lua_State* ls, int idx) {
+	int type = lua_type(ls, idx);
+	return type == LUA_TBOOLEAN || type == LUA_TNUMBER || type == LUA_TSTRING ||
+	       type == LUA_TTABLE;
+}
+
+static bool state_is_skipped_global(lua_State* ls, int key) {
+	if (lua_type(ls, key) != LUA_TSTRING) {
+		return false;
+	}
+	const char* name = lua_tostring(ls, key);
+	for (auto skip : state_skip_globals) {
+		if (strcmp(name, skip) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// returns the id of the table at idx, numbering it if it has not been seen before.
+// ids maps tables to ids, list maps ids back to tables.
+static uint32_t state_table_id(lua_State* ls, int idx, int ids, int list, uint32_t& count) {
+	lua_pushvalue(ls, idx);
+	lua_rawget(ls, ids);
+	if (!lua_isnil(ls, -1)) {
+		uint32_t id = lua_tonumber(ls, -1).bits();
+		lua_pop(ls, 1);
+		return id;
+	}
+	lua_pop(ls, 1);
+
+	uint32_t id = count++;
+	lua_pushvalue(ls, idx);
+	state_push_id(ls, id);
+	lua_rawset(ls, ids);
+	state_push_id(ls, id);
+	lua_pushvalue(ls, idx);
+	lua_rawset(ls, list);
+	return id;
+}
+
+static void state_write_value(lua_State* ls,
+                              int idx,
+                              int ids,
+                              int list,
+                              uint32_t& count,
+                              utils::BinaryWriter& w) {
+	switch (lua_type(ls, idx)) {
+		case LUA_TBOOLEAN:
+			w.write<uint8_t>(lua_toboolean(ls, idx) ? STATE_TRUE : STATE_FALSE);
+			break;
+		case LUA_TNUMBER:
+			w.write<uint8_t>(STATE_NUMBER);
+			w.write<uint32_t>(lua_tonumber(ls, idx).bits());
+			break;
+		case LUA_TSTRING: {
+			size_t len;
+			const char* str = lua_tolstring(ls, idx, &len);
+			w.write<uint8_t>(STATE_STRING);
+			w.writeString(std::string(str, len));
+			break;
+		}
+		case LUA_TTABLE:
+			w.write<uint8_t>(STATE_TABLE);
+			w.write<uint32_t>(state_table_id(ls, idx, ids, list, count));
+			break;
+	}
+}
+
+// pushes table id, the first time an id is seen it is bound to the table at live, or to a new
+// table if live is not a table or is already bound. list maps ids to tables and bound tables
+// to true.
+static bool state_push_table(lua_State* ls, uint32_t id, int list, uint32_t& count, int live) {
+	if (id < count) {
+		state_push_id(ls, id);
+		lua_rawget(ls, list);
+		return true;
+	}
+	if (id != count) {
+		return false;
+	}
+
+	bool bound = true;
+	if (live && lua_istable(ls, live)) {
+		lua_pushvalue(ls, live);
+		lua_rawget(ls, list);
+		bound = !lua_isnil(ls, -1);
+		lua_pop(ls, 1);
+	}
+	if (bound) {
+		lua_newtable(ls);
+	} else {
+		lua_pushvalue(ls, live);
+	}
+	state_push_id(ls, id);
+	lua_pushvalue(ls, -2);
+	lua_rawset(ls, list);
+	lua_pushvalue(ls, -1);
+	lua_pushboolean(ls, 1);
+	lua_rawset(ls, list);
+	count++;
+	return true;
+}
+
+// pushes a value of the given type, returns false on bad data.
+static bool state_read_value(lua_State* ls,
+                             uint8_t type,
+                             utils::BinaryReader& r,
+                             int list,
+                             uint32_t& count,
+                             int live) {
+	switch (type) {
+		case STATE_FALSE:
+		case STATE_TRUE:
+			lua_pushboolean(ls, type == STATE_TRUE);
+			break;
+		case STATE_NUMBER:
+			lua_pushnumber(ls, z8::fix32::frombits(r.read<uint32_t>()));
+			break;
+		case STATE_STRING: {
+			std::string str = r.readString();
+			lua_pushlstring(ls, str.c_str(), str.size());
+			break;
+		}
+		case STATE_TABLE:
+			if (!state_push_table(ls, r.read<uint32_t>(), list, count, live)) {
+				return false;
+			}
+			break;
+		default:
+			return false;
+	}
+	return r.ok();
+}
+
 namespace pico_script {
 
 	/* - not needed here
@@ -1289,36 +1595,53 @@ namespace pico_script {
 		for (size_t i = 0; i < cart.source.size(); i++) {
 			code += cart.source[i].line + "\n";
 		}
-		throw_error(luaL_loadbuffer(lstate, code.c_str(), code.size(), "main"));
-		throw_error(lua_pcall(lstate, 0, 0, 0));
+		throw_error(luaL_loadbuffer(script->lstate, code.c_str(), code.size(), "main"));
+		throw_error(lua_pcall(script->lstate, 0, 0, 0));
+	}
+
+	ScriptContext* create_context() {
+		return new ScriptContext();
+	}
+
+	void destroy_context(ScriptContext* context) {
+		if (context) {
+			if (context->lstate) {
+				lua_close(context->lstate);
+			}
+			delete context;
+		}
+	}
+
+	void select_context(ScriptContext* context) {
+		script = context ? context : &defaultScript;
 	}
 
 	void unload_scripting() {
-		if (lstate) {
-			lua_close(lstate);
-			lstate = nullptr;
+		if (script->lstate) {
+			lua_close(script->lstate);
+			script->lstate = nullptr;
 		}
-		deferredAPICalls.clear();
+		script->deferredAPICalls.clear();
 	}
 
 	bool symbolExist(const char* s) {
-		lua_getglobal(lstate, s);
-		bool exist = !lua_isnil(lstate, -1);
-		lua_pop(lstate, 1);
+		lua_getglobal(script->lstate, s);
+		bool exist = !lua_isnil(script->lstate, -1);
+		lua_pop(script->lstate, 1);
 		return exist;
 	}
 
 	bool simpleCall(std::string function, bool optional) {
-		lua_getglobal(lstate, function.c_str());
+		lua_getglobal(script->lstate, function.c_str());
 
-		if (!lua_isfunction(lstate, -1)) {
+		if (!lua_isfunction(script->lstate, -1)) {
 			if (optional) {
-				lua_pop(lstate, 1);
+				lua_pop(script->lstate, 1);
 				return false;
 			} else
 				throw pico_script::error(function + " not found");
 		}
-		throw_error(lua_pcall(lstate, 0, 0, 0));
+		throw_error(lua_pcall(script->lstate, 0, 0, 0));
 		return true;
 	}
 
@@ -1334,7 +1657,7 @@ namespace pico_script {
 			return true;
 		}
 
-		if (hook_funcs) {
+		if (script->hook_funcs) {
 			auto f = function_hooks.find(function);
 			if (f != function_hooks.end()) {
 				function = f->second;
@@ -1343,9 +1666,9 @@ namespace pico_script {
 
 		auto ret = simpleCall(function, optional);
 
-		while (!deferredAPICalls.empty()) {
-			deferredAPICall_t apicall = deferredAPICalls.front();
-			deferredAPICalls.pop_front();
+		while (!script->deferredAPICalls.empty()) {
+			deferredAPICall_t apicall = script->deferredAPICalls.front();
+			script->deferredAPICalls.pop_front();
 			apicall();
 			restarted = true;
 		}
@@ -1354,12 +1677,12 @@ namespace pico_script {
 
 	// returns true when menu finished
 	bool do_menu() {
-		lua_getglobal(lstate, "__tac08__");
-		lua_getfield(lstate, -1, "do_menu");
-		lua_remove(lstate, -2);
-		throw_error(lua_pcall(lstate, 0, 1, 0));
-		bool res = lua_toboolean(lstate, -1);
-		lua_pop(lstate, 1);
+		lua_getglobal(script->lstate, "__tac08__");
+		lua_getfield(script->lstate, -1, "do_menu");
+		lua_remove(script->lstate, -2);
+		throw_error(lua_pcall(script->lstate, 0, 1, 0));
+		bool res = lua_toboolean(script->lstate, -1);
+		lua_pop(script->lstate, 1);
 
 		return res;
 	}
@@ -1372,4 +1695,130 @@ namespace pico_script {
 		DEBUG_Trace(false);
 	}
 
+	void save_state(utils::BinaryWriter& w) {
+		int top = lua_gettop(script->lstate);
+		lua_newtable(script->lstate);
+		int ids = top + 1;
+		lua_newtable(script->lstate);
+		int list = top + 2;
+		int t = top + 3;
+		int key = top + 4;
+		int value = top + 5;
+
+		uint32_t count = 0;
+		lua_pushglobaltable(script->lstate);
+		state_table_id(script->lstate, t, ids, list, count);
+		lua_pop(script->lstate, 1);
+
+		for (uint32_t id = 0; id < count; id++) {
+			state_push_id(script->lstate, id);
+			lua_rawget(script->lstate, list);
+
+			if (lua_getmetatable(script->lstate, t)) {
+				w.write<uint32_t>(state_table_id(script->lstate, key, ids, list, count));
+				lua_pop(script->lstate, 1);
+			} else {
+				w.write<uint32_t>(STATE_NO_TABLE);
+			}
+
+			lua_pushnil(script->lstate);
+			while (lua_next(script->lstate, t)) {
+				if (state_is_saved(script->lstate, key) && state_is_saved(script->lstate, value) &&
+				    !(id == 0 && state_is_skipped_global(script->lstate, key))) {
+					state_write_value(script->lstate, key, ids, list, count, w);
+					state_write_value(script->lstate, value, ids, list, count, w);
+				}
+				lua_pop(script->lstate, 1);
+			}
+			w.write<uint8_t>(STATE_END);
+			lua_pop(script->lstate, 1);
+		}
+		lua_settop(script->lstate, top);
+	}
+
+	// tables are restored in place. a table seen for the first time is matched with the table
+	// under the same key in the running state, so functions holding that table see the change.
+	bool load_state(utils::BinaryReader& r) {
+		int top = lua_gettop(script->lstate);
+		lua_newtable(script->lstate);
+		int list = top + 1;
+		int t = top + 2;
+		int fresh = top + 3;
+		int key = top + 4;
+		int live = top + 5;
+
+		uint32_t count = 0;
+		lua_pushglobaltable(script->lstate);
+		state_push_table(script->lstate, 0, list, count, t);
+		lua_pop(script->lstate, 2);
+
+		bool ok = true;
+		for (uint32_t id = 0; ok && id < count; id++) {
+			state_push_id(script->lstate, id);
+			lua_rawget(script->lstate, list);
+
+			uint32_t mt = r.read<uint32_t>();
+			if (mt == STATE_NO_TABLE) {
+				lua_pushnil(script->lstate);
+			} else {
+				if (!lua_getmetatable(script->lstate, t)) {
+					lua_pushnil(script->lstate);
+				}
+				ok = state_push_table(script->lstate, mt, list, count, top + 3);
+				if (!ok) {
+					break;
+				}
+				lua_remove(script->lstate, top + 3);
+			}
+			lua_setmetatable(script->lstate, t);
+
+			// the saved contents are gathered first, the tables they refer to are matched
+			// against the current contents before those are cleared.
+			lua_newtable(script->lstate);
+			while (true) {
+				uint8_t type = r.read<uint8_t>();
+				if (type == STATE_END) {
+					break;
+				}
+				if (!state_read_value(script->lstate, type, r, list, count, 0)) {
+					ok = false;
+					break;
+				}
+				lua_pushvalue(script->lstate, key);
+				lua_rawget(script->lstate, t);
+				if (!state_read_value(script->lstate, r.read<uint8_t>(), r, list, count, live)) {
+					ok = false;
+					break;
+				}
+				lua_remove(script->lstate, live);
+				lua_rawset(script->lstate, fresh);
+			}
+			if (!ok || !r.ok()) {
+				ok = false;
+				break;
+			}
+
+			lua_pushnil(script->lstate);
+			while (lua_next(script->lstate, t)) {
+				bool skipped = id == 0 && state_is_skipped_global(script->lstate, key);
+				if (state_is_saved(script->lstate, live) && !skipped) {
+					lua_pushvalue(script->lstate, key);
+					lua_pushnil(script->lstate);
+					lua_rawset(script->lstate, t);
+				}
+				lua_pop(script->lstate, 1);
+			}
+
+			lua_pushnil(script->lstate);
+			while (lua_next(script->lstate, fresh)) {
+				lua_pushvalue(script->lstate, key);
+				lua_insert(script->lstate, -2);
+				lua_rawset(script->lstate, t);
+			}
+			lua_pop(script->lstate, 2);
+		}
+		lua_settop(script->lstate, top);
+		return ok && r.ok();
+	}
+
 }  // namespace pico_script
@@ -6,6 +6,7 @@
 #include "string"
 
 #include "pico_cart.h"
+#include "utils.h"
 
 namespace pico_script {
 
@@ -13,6 +14,11 @@ namespace pico_script {
 		using std::runtime_error::runtime_error;
 	};
 
+	struct ScriptContext;
+	ScriptContext* create_context();
+	void destroy_context(ScriptContext* context);
+	void select_context(ScriptContext* context);
+
 	void load(const pico_cart::Cart& cart);
 	bool symbolExist(const char* s);
 	bool run(std::string function, bool optional, bool& restarted);
@@ -20,6 +26,8 @@ namespace pico_script {
 	void unload_scripting();
 	void tron();
 	void troff();
+	void save_state(utils::BinaryWriter& w);
+	bool load_state(utils::BinaryReader& r);
 
 }  // namespace pico_script
 
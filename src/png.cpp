@@ -0,0 +1,684 @@
+#include "png.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace png {
+
+	static uint32_t read_u32be(const uint8_t* p) {
+		return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	}
+
+	// deflate length and distance codes, shared by inflate and deflate
+	static const uint16_t lbase[29] = {3,  4,  5,  6,  7,  8,  9,  10,  11,  13,
+	                                   15, 17, 19, 23, 27, 31, 35, 43,  51,  59,
+	                                   67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const uint8_t lext[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+	                                 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	static const uint16_t dbase[30] = {
+	    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+	    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+	static const uint8_t dext[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+	                                 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+	// ------------------------------------------------------------------
+	// chunk reading
+	// ------------------------------------------------------------------
+
+	// iterates the png chunks and presents the payload of consecutive IDAT chunks as a
+	// single byte stream.
+	class ChunkReader {
+	   public:
+		ChunkReader(const std::string& data)
+		    : m_data((const uint8_t*)data.data()), m_size(data.size()) {
+			static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+			if (m_size < 8 || memcmp(m_data, signature, 8) != 0) {
+				throw error("not a png file");
+			}
+			m_pos = 8;
+		}
+
+		// moves to the next chunk, returns false at the end of the file
+		bool next() {
+			m_pos = m_chunkEnd ? m_chunkEnd + 4 : m_pos;  // skip crc
+			if (m_pos + 8 > m_size) {
+				// leave no chunk to read from
+				m_pos = m_chunkEnd = m_size;
+				memset(m_type, 0, sizeof(m_type));
+				return false;
+			}
+			uint32_t len = read_u32be(m_data + m_pos);
+			memcpy(m_type, m_data + m_pos + 4, 4);
+			m_pos += 8;
+			if (len > m_size - m_pos) {
+				throw error("truncated png chunk");
+			}
+			m_chunkEnd = m_pos + len;
+			return true;
+		}
+
+		bool is(const char* type) const {
+			return memcmp(m_type, type, 4) == 0;
+		}
+
+		const uint8_t* data() const {
+			return m_data + m_pos;
+		}
+
+		size_t size() const {
+			return m_chunkEnd - m_pos;
+		}
+
+		// next byte of image data, crossing into following IDAT chunks as needed
+		uint8_t idatByte() {
+			while (m_pos >= m_chunkEnd) {
+				if (!next() || !is("IDAT")) {
+					throw error("unexpected end of png image data");
+				}
+			}
+			return m_data[m_pos++];
+		}
+
+	   private:
+		const uint8_t* m_data;
+		size_t m_size;
+		size_t m_pos = 0;
+		size_t m_chunkEnd = 0;
+		char m_type[4] = {0};
+	};
+
+	// ------------------------------------------------------------------
+	// inflate
+	// ------------------------------------------------------------------
+
+	// a pull based inflate. input is read a byte at a time from the chunk reader and output
+	// is pushed a byte at a time to the sink, with a 32k window kept for back references.
+	class Inflate {
+	   public:
+		typedef std::function<void(uint8_t)> Sink;
+
+		Inflate(ChunkReader& in, const Sink& out) : m_in(in), m_out(out), m_window(WINDOW_SIZE) {
+		}
+
+		void zlibStream() {
+			uint8_t cmf = m_in.idatByte();
+			uint8_t flg = m_in.idatByte();
+			if ((cmf & 0x0f) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20)) {
+				throw error("bad zlib header");
+			}
+
+			bool last;
+			do {
+				last = bits(1);
+				switch (bits(2)) {
+					case 0:
+						stored();
+						break;
+					case 1:
+						fixed();
+						break;
+					case 2:
+						dynamic();
+						break;
+					default:
+						throw error("bad deflate block type");
+				}
+			} while (!last);
+		}
+
+	   private:
+		static const size_t WINDOW_SIZE = 32768;
+		static const int MAX_BITS = 15;
+		static const int MAX_LCODES = 286;
+		static const int MAX_DCODES = 30;
+		static const int FIX_LCODES = 288;
+
+		struct Huffman {
+			uint16_t count[MAX_BITS + 1];
+			uint16_t symbol[FIX_LCODES];
+		};
+
+		int bits(int n) {
+			while (m_bitcnt < n) {
+				m_bitbuf |= uint32_t(m_in.idatByte()) << m_bitcnt;
+				m_bitcnt += 8;
+			}
+			int v = m_bitbuf & ((1u << n) - 1);
+			m_bitbuf >>= n;
+			m_bitcnt -= n;
+			return v;
+		}
+
+		void put(uint8_t b) {
+			m_window[m_wpos++ & (WINDOW_SIZE - 1)] = b;
+			m_out(b);
+		}
+
+		void stored() {
+			// discard the rest of the current byte
+			m_bitbuf = 0;
+			m_bitcnt = 0;
+
+			uint16_t len = m_in.idatByte();
+			len |= m_in.idatByte() << 8;
+			uint16_t nlen = m_in.idatByte();
+			nlen |= m_in.idatByte() << 8;
+			if (len != (uint16_t)~nlen) {
+				throw error("bad stored block length");
+			}
+			while (len--) {
+				put(m_in.idatByte());
+			}
+		}
+
+		static void build(Huffman& h, const uint8_t* lengths, int n) {
+			uint16_t offs[MAX_BITS + 1];
+
+			memset(h.count, 0, sizeof(h.count));
+			for (int sym = 0; sym < n; sym++) {
+				h.count[lengths[sym]]++;
+			}
+			offs[1] = 0;
+			for (int len = 1; len < MAX_BITS; len++) {
+				offs[len + 1] = offs[len] + h.count[len];
+			}
+			for (int sym = 0; sym < n; sym++) {
+				if (lengths[sym]) {
+					h.symbol[offs[lengths[sym]]++] = sym;
+				}
+			}
+		}
+
+		// canonical huffman decode, a bit at a time
+		int decode(const Huffman& h) {
+			int code = 0;
+			int first = 0;
+			int index = 0;
+			for (int len = 1; len <= MAX_BITS; len++) {
+				code |= bits(1);
+				int count = h.count[len];
+				if (code - count < first) {
+					return h.symbol[index + (code - first)];
+				}
+				index += count;
+				first += count;
+				first <<= 1;
+				code <<= 1;
+			}
+			throw error("bad huffman code");
+		}
+
+		void codes(const Huffman& lencode, const Huffman& distcode) {
+			while (true) {
+				int sym = decode(lencode);
+				if (sym < 256) {
+					put((uint8_t)sym);
+				} else if (sym == 256) {
+					return;
+				} else {
+					sym -= 257;
+					if (sym >= 29) {
+						throw error("bad length code");
+					}
+					int len = lbase[sym] + bits(lext[sym]);
+					int dsym = decode(distcode);
+					if (dsym >= 30) {
+						throw error("bad distance code");
+					}
+					size_t dist = dbase[dsym] + bits(dext[dsym]);
+					if (dist > m_wpos) {
+						throw error("distance too far back");
+					}
+					while (len--) {
+						put(m_window[(m_wpos - dist) & (WINDOW_SIZE - 1)]);
+					}
+				}
+			}
+		}
+
+		// the fixed code tables are built once, thread safe as a function local static
+		struct FixedCodes {
+			Huffman lencode;
+			Huffman distcode;
+
+			FixedCodes() {
+				uint8_t lengths[FIX_LCODES];
+				int sym = 0;
+				for (; sym < 144; sym++)
+					lengths[sym] = 8;
+				for (; sym < 256; sym++)
+					lengths[sym] = 9;
+				for (; sym < 280; sym++)
+					lengths[sym] = 7;
+				for (; sym < FIX_LCODES; sym++)
+					lengths[sym] = 8;
+				build(lencode, lengths, FIX_LCODES);
+
+				for (sym = 0; sym < MAX_DCODES; sym++)
+					lengths[sym] = 5;
+				build(distcode, lengths, MAX_DCODES);
+			}
+		};
+
+		void fixed() {
+			static const FixedCodes fixedCodes;
+			codes(fixedCodes.lencode, fixedCodes.distcode);
+		}
+
+		void dynamic() {
+			static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+			                                  11, 4,  12, 3, 13, 2, 14, 1, 15};
+			uint8_t lengths[MAX_LCODES + MAX_DCODES];
+			Huffman lencode;
+			Huffman distcode;
+
+			int nlen = bits(5) + 257;
+			int ndist = bits(5) + 1;
+			int ncode = bits(4) + 4;
+			if (nlen > MAX_LCODES || ndist > MAX_DCODES) {
+				throw error("bad dynamic block counts");
+			}
+
+			int index = 0;
+			for (; index < ncode; index++)
+				lengths[order[index]] = bits(3);
+			for (; index < 19; index++)
+				lengths[order[index]] = 0;
+			build(lencode, lengths, 19);
+
+			index = 0;
+			while (index < nlen + ndist) {
+				int sym = decode(lencode);
+				if (sym < 16) {
+					lengths[index++] = sym;
+				} else {
+					uint8_t len = 0;
+					int repeat;
+					if (sym == 16) {
+						if (index == 0) {
+							throw error("repeat with no previous length");
+						}
+						len = lengths[index - 1];
+						repeat = 3 + bits(2);
+					} else if (sym == 17) {
+						repeat = 3 + bits(3);
+					} else {
+						repeat = 11 + bits(7);
+					}
+					if (index + repeat > nlen + ndist) {
+						throw error("too many lengths");
+					}
+					while (repeat--) {
+						lengths[index++] = len;
+					}
+				}
+			}
+
+			build(lencode, lengths, nlen);
+			build(distcode, lengths + nlen, ndist);
+			codes(lencode, distcode);
+		}
+
+		ChunkReader& m_in;
+		Sink m_out;
+		std::vector<uint8_t> m_window;
+		size_t m_wpos = 0;
+		uint32_t m_bitbuf = 0;
+		int m_bitcnt = 0;
+	};
+
+	// ------------------------------------------------------------------
+	// scanline filtering
+	// ------------------------------------------------------------------
+
+	static inline uint8_t paeth(int a, int b, int c) {
+		int p = a + b - c;
+		int pa = abs(p - a);
+		int pb = abs(p - b);
+		int pc = abs(p - c);
+		if (pa <= pb && pa <= pc)
+			return a;
+		if (pb <= pc)
+			return b;
+		return c;
+	}
+
+	// undoes the per scanline filter on bytes as they are inflated, keeping only the
+	// current and previous rows.
+	class Unfilter {
+	   public:
+		Unfilter(int width, int height, const RowFunc& rowFunc)
+		    : m_width(width),
+		      m_height(height),
+		      m_stride(width * BPP),
+		      m_prev(m_stride, 0),
+		      m_cur(m_stride, 0),
+		      m_rowFunc(rowFunc) {
+		}
+
+		void add(uint8_t b) {
+			if (m_y >= m_height) {
+				return;  // ignore any trailing data
+			}
+			if (m_x < 0) {
+				m_filter = b;
+				if (m_filter > 4) {
+					throw error("bad png filter type");
+				}
+				m_x = 0;
+				return;
+			}
+
+			int a = m_x >= BPP ? m_cur[m_x - BPP] : 0;
+			int up = m_prev[m_x];
+			int c = m_x >= BPP ? m_prev[m_x - BPP] : 0;
+			switch (m_filter) {
+				case 1:
+					b += a;
+					break;
+				case 2:
+					b += up;
+					break;
+				case 3:
+					b += (a + up) >> 1;
+					break;
+				case 4:
+					b += paeth(a, up, c);
+					break;
+			}
+			m_cur[m_x++] = b;
+
+			if (m_x == m_stride) {
+				m_rowFunc(m_y++, m_cur.data(), m_width);
+				m_prev.swap(m_cur);
+				m_x = -1;
+			}
+		}
+
+		bool complete() const {
+			return m_y == m_height;
+		}
+
+	   private:
+		static const int BPP = 4;
+		int m_width;
+		int m_height;
+		int m_stride;
+		std::vector<uint8_t> m_prev;
+		std::vector<uint8_t> m_cur;
+		const RowFunc& m_rowFunc;
+		int m_x = -1;
+		int m_y = 0;
+		uint8_t m_filter = 0;
+	};
+
+	void decodeRGBA(const std::string& data, const RowFunc& rowFunc) {
+		ChunkReader reader(data);
+
+		if (!reader.next() || !reader.is("IHDR") || reader.size() < 13) {
+			throw error("png missing header");
+		}
+		const uint8_t* ihdr = reader.data();
+		int width = read_u32be(ihdr);
+		int height = read_u32be(ihdr + 4);
+		if (ihdr[8] != 8 || ihdr[9] != 6 || ihdr[12] != 0 || width <= 0 || height <= 0 ||
+		    width > 0x4000) {
+			throw error("unsupported png format, must be 8 bit rgba and not interlaced");
+		}
+
+		while (reader.next() && !reader.is("IDAT")) {
+			if (reader.is("IEND")) {
+				throw error("png has no image data");
+			}
+		}
+		if (!reader.is("IDAT")) {
+			throw error("png has no image data");
+		}
+
+		Unfilter unfilter(width, height, rowFunc);
+		Inflate inflate(reader, [&unfilter](uint8_t b) { unfilter.add(b); });
+		inflate.zlibStream();
+
+		if (!unfilter.complete()) {
+			throw error("png image data incomplete");
+		}
+	}
+
+	// ------------------------------------------------------------------
+	// encoding
+	// ------------------------------------------------------------------
+
+	// writes deflate bits least significant first
+	class BitWriter {
+	   public:
+		BitWriter(std::string& out) : m_out(out) {
+		}
+
+		void bits(uint32_t v, int n) {
+			m_bitbuf |= v << m_bitcnt;
+			m_bitcnt += n;
+			while (m_bitcnt >= 8) {
+				m_out += (char)(m_bitbuf & 0xff);
+				m_bitbuf >>= 8;
+				m_bitcnt -= 8;
+			}
+		}
+
+		// huffman codes are stored most significant bit first
+		void code(uint32_t c, int n) {
+			uint32_t r = 0;
+			for (int i = 0; i < n; i++) {
+				r = (r << 1) | ((c >> i) & 1);
+			}
+			bits(r, n);
+		}
+
+		void flush() {
+			if (m_bitcnt) {
+				m_out += (char)(m_bitbuf & 0xff);
+			}
+			m_bitbuf = 0;
+			m_bitcnt = 0;
+		}
+
+	   private:
+		std::string& m_out;
+		uint32_t m_bitbuf = 0;
+		int m_bitcnt = 0;
+	};
+
+	// a single fixed huffman block with greedy lz77 matching against the most recent position
+	// with the same 3 byte hash. screen images are mostly long runs so this gets close to zlib
+	// for a fraction of the code.
+	class Deflate {
+	   public:
+		Deflate(std::string& out) : m_out(out), m_head(HASH_SIZE, -1) {
+		}
+
+		void compress(const uint8_t* data, size_t size) {
+			m_out += (char)0x78;
+			m_out += (char)0x01;
+
+			m_bits.bits(1, 1);  // final block
+			m_bits.bits(1, 2);  // fixed codes
+
+			size_t pos = 0;
+			while (pos < size) {
+				size_t len = 0;
+				size_t dist = 0;
+				if (pos + MIN_MATCH <= size) {
+					uint32_t h = hash(data + pos);
+					int32_t cand = m_head[h];
+					m_head[h] = (int32_t)pos;
+					if (cand >= 0 && pos - cand <= WINDOW_SIZE) {
+						size_t max = std::min(size - pos, (size_t)MAX_MATCH);
+						while (len < max && data[cand + len] == data[pos + len]) {
+							len++;
+						}
+						dist = pos - cand;
+					}
+				}
+
+				if (len >= MIN_MATCH) {
+					match(len, dist);
+					for (size_t n = 1; n < len && pos + n + MIN_MATCH <= size; n++) {
+						m_head[hash(data + pos + n)] = (int32_t)(pos + n);
+					}
+					pos += len;
+				} else {
+					literal(data[pos++]);
+				}
+			}
+			literal(256);
+			m_bits.flush();
+
+			uint32_t a = adler32(data, size);
+			for (int shift = 24; shift >= 0; shift -= 8) {
+				m_out += (char)((a >> shift) & 0xff);
+			}
+		}
+
+	   private:
+		static const size_t WINDOW_SIZE = 32768;
+		static const size_t MIN_MATCH = 3;
+		static const size_t MAX_MATCH = 258;
+		static const size_t HASH_SIZE = 1 << 15;
+
+		static uint32_t hash(const uint8_t* p) {
+			return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (HASH_SIZE - 1);
+		}
+
+		static uint32_t adler32(const uint8_t* data, size_t size) {
+			uint32_t a = 1;
+			uint32_t b = 0;
+			for (size_t n = 0; n < size; n++) {
+				a = (a + data[n]) % 65521;
+				b = (b + a) % 65521;
+			}
+			return (b << 16) | a;
+		}
+
+		void literal(int sym) {
+			if (sym < 144) {
+				m_bits.code(0x30 + sym, 8);
+			} else if (sym < 256) {
+				m_bits.code(0x190 + sym - 144, 9);
+			} else if (sym < 280) {
+				m_bits.code(sym - 256, 7);
+			} else {
+				m_bits.code(0xc0 + sym - 280, 8);
+			}
+		}
+
+		void match(size_t len, size_t dist) {
+			int l = 28;
+			while (lbase[l] > len) {
+				l--;
+			}
+			literal(257 + l);
+			m_bits.bits(len - lbase[l], lext[l]);
+
+			int d = 29;
+			while (dbase[d] > dist) {
+				d--;
+			}
+			m_bits.code(d, 5);
+			m_bits.bits(dist - dbase[d], dext[d]);
+		}
+
+		std::string& m_out;
+		BitWriter m_bits{m_out};
+		std::vector<int32_t> m_head;
+	};
+
+	struct CrcTable {
+		uint32_t table[256];
+		CrcTable() {
+			for (uint32_t n = 0; n < 256; n++) {
+				uint32_t c = n;
+				for (int k = 0; k < 8; k++) {
+					c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+				}
+				table[n] = c;
+			}
+		}
+	};
+
+	static void write_u32be(std::string& out, uint32_t v) {
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			out += (char)((v >> shift) & 0xff);
+		}
+	}
+
+	static void writeChunk(std::string& out, const char* type, const std::string& data) {
+		static const CrcTable crc;
+		write_u32be(out, (uint32_t)data.size());
+		size_t start = out.size();
+		out.append(type, 4);
+		out += data;
+
+		uint32_t c = 0xffffffff;
+		for (size_t n = start; n < out.size(); n++) {
+			c = crc.table[(c ^ (uint8_t)out[n]) & 0xff] ^ (c >> 8);
+		}
+		write_u32be(out, c ^ 0xffffffff);
+	}
+
+	// rows are stored unfiltered, each prefixed with filter type 0.
+	static std::string encode(const uint8_t* pixels,
+	                          int width,
+	                          int height,
+	                          int bpp,
+	                          uint8_t colourType,
+	                          const std::string& plte) {
+		std::string out("\x89PNG\r\n\x1a\n", 8);
+
+		std::string ihdr;
+		write_u32be(ihdr, width);
+		write_u32be(ihdr, height);
+		ihdr += (char)8;  // bit depth
+		ihdr += (char)colourType;
+		ihdr.append(3, (char)0);  // compression, filter, interlace
+		writeChunk(out, "IHDR", ihdr);
+
+		if (!plte.empty()) {
+			writeChunk(out, "PLTE", plte);
+		}
+
+		size_t stride = (size_t)width * bpp;
+		std::vector<uint8_t> raw;
+		raw.reserve((stride + 1) * height);
+		for (int y = 0; y < height; y++) {
+			raw.push_back(0);
+			raw.insert(raw.end(), pixels + y * stride, pixels + (y + 1) * stride);
+		}
+
+		std::string idat;
+		Deflate(idat).compress(raw.data(), raw.size());
+		writeChunk(out, "IDAT", idat);
+		writeChunk(out, "IEND", std::string());
+		return out;
+	}
+
+	std::string encodeIndexed(const uint8_t* pixels,
+	                          int width,
+	                          int height,
+	                          const uint32_t* palette,
+	                          int paletteSize) {
+		std::string plte;
+		for (int n = 0; n < paletteSize; n++) {
+			plte += (char)((palette[n] >> 16) & 0xff);
+			plte += (char)((palette[n] >> 8) & 0xff);
+			plte += (char)(palette[n] & 0xff);
+		}
+		return encode(pixels, width, height, 1, 3, plte);
+	}
+
+	std::string encodeRGBA(const uint8_t* rgba, int width, int height) {
+		return encode(rgba, width, height, 4, 6, std::string());
+	}
+
+}  // namespace png
@@ -0,0 +1,34 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <stdint.h>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+namespace png {
+
+	struct error : public std::runtime_error {
+		using std::runtime_error::runtime_error;
+	};
+
+	// called for each decoded scanline of rgba pixels (4 bytes per pixel).
+	typedef std::function<void(int y, const uint8_t* rgba, int width)> RowFunc;
+
+	// decodes an 8 bit rgba non interlaced png a scanline at a time. only the current and
+	// previous scanline are held in memory, the full image is never built.
+	void decodeRGBA(const std::string& data, const RowFunc& rowFunc);
+
+	// encodes an 8 bit paletted png, palette holds 0xrrggbb for each colour index used.
+	std::string encodeIndexed(const uint8_t* pixels,
+	                          int width,
+	                          int height,
+	                          const uint32_t* palette,
+	                          int paletteSize);
+
+	// encodes an 8 bit rgba png from 4 bytes per pixel.
+	std::string encodeRGBA(const uint8_t* rgba, int width, int height);
+
+}  // namespace png
+
+#endif /* PNG_H */
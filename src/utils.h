@@ -1,6 +1,8 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
+#include <string.h>
 #include <string>
 #include <vector>
 
@@ -45,6 +47,101 @@ namespace utils {
 	                 std::vector<std::string>& output,
 	                 const char* sep_chars);
 
+	// 64 bit FNV-1a, pass the previous result as hash to continue over multiple buffers.
+	inline uint64_t fnv1a(const void* data, size_t len, uint64_t hash = 0xcbf29ce484222325ULL) {
+		const uint8_t* p = (const uint8_t*)data;
+		for (size_t n = 0; n < len; n++) {
+			hash = (hash ^ p[n]) * 0x100000001b3ULL;
+		}
+		return hash;
+	}
+
+	// simple native endian serialisation for data that is only read back on the same machine
+	// (caches, save states).
+	class BinaryWriter {
+	   public:
+		template <typename T>
+		void write(const T& v) {
+			data.append((const char*)&v, sizeof(T));
+		}
+
+		void writeBytes(const void* p, size_t len) {
+			data.append((const char*)p, len);
+		}
+
+		void writeString(const std::string& s) {
+			write((uint32_t)s.size());
+			data.append(s);
+		}
+
+		std::string data;
+	};
+
+	// reads data written by BinaryWriter. reads past the end return zeros and clear ok().
+	class BinaryReader {
+	   public:
+		BinaryReader(const void* p, size_t len)
+		    : m_pos((const uint8_t*)p), m_end((const uint8_t*)p + len) {
+		}
+
+		template <typename T>
+		T read() {
+			T v = T();
+			readBytes(&v, sizeof(T));
+			return v;
+		}
+
+		bool readBytes(void* p, size_t len) {
+			if (!check(len)) {
+				memset(p, 0, len);
+				return false;
+			}
+			memcpy(p, m_pos, len);
+			m_pos += len;
+			return true;
+		}
+
+		std::string readString() {
+			uint32_t len = read<uint32_t>();
+			if (!check(len)) {
+				return std::string();
+			}
+			std::string s((const char*)m_pos, len);
+			m_pos += len;
+			return s;
+		}
+
+		// returns a pointer to the next len bytes without copying them.
+		const uint8_t* skip(size_t len) {
+			if (!check(len)) {
+				return nullptr;
+			}
+			const uint8_t* p = m_pos;
+			m_pos += len;
+			return p;
+		}
+
+		bool ok() const {
+			return m_ok;
+		}
+
+		bool atEnd() const {
+			return m_pos == m_end;
+		}
+
+	   private:
+		bool check(size_t len) {
+			if (!m_ok || (size_t)(m_end - m_pos) < len) {
+				m_ok = false;
+			}
+			return m_ok;
+		}
+
+		const uint8_t* m_pos;
+		const uint8_t* m_end;
+		bool m_ok = true;
+	};
+
 }  // namespace utils
 
 #define STRINGIFY(x) #x
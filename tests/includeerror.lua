@@ -0,0 +1,7 @@
+-- included by includeerror.p8
+
+function _init()
+	local t = nil
+	-- this line raises the error
+	print(t.x)
+end